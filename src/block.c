@@ -0,0 +1,330 @@
+/*
+ * ARM emulator
+ * Luke Mitchell
+ *
+ */
+
+// Decoded blocks
+//
+// The emulator runs a block at a time. A block is the run of instructions
+// from a start address up to the first one that may write the PC, cut
+// short at the end of a page. Each instruction's type and condition, and
+// whether the trace filters that depend only on the instruction let it
+// through, are worked out once when the block is built.
+//
+// Pages that blocks were built from are marked PAGE_CODE. A store to one
+// sets code_written on the page table and notes the page, and the emulator
+// then throws away the blocks built from that page, so self-modifying code
+// still sees its own stores. Blocks never cross a page, so the others stay.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "block.h"
+#include "common.h"
+#include "instructions.h"
+#include "trace.h"
+#include "plugin.h"
+#include "debugger.h"
+
+/* Blocks decoded since start-up */
+uint64_t blocks_built;
+
+/* Helper functions not exposed in header file */
+
+// returns 1 if the instruction may write the PC, and so ends a block
+// returns 0 otherwise
+int ends_block (uint32_t instruction, uint8_t type)
+{
+    switch (type)
+    {
+        case INSTR_B:
+        case INSTR_SWI:
+            return 1;
+
+        case INSTR_DP:
+            return get_bits (instruction, 12, 4) == R_PC;
+
+        // loads to the PC, and writeback to the base
+        case INSTR_LS:
+            return get_bits (instruction, 12, 4) == R_PC
+                || get_bits (instruction, 16, 4) == R_PC;
+
+        case INSTR_MUL:
+            return get_bits (instruction, 16, 4) == R_PC;
+
+        case INSTR_LSH:
+            return get_bits (instruction, 12, 4) == R_PC
+                || get_bits (instruction, 16, 4) == R_PC;
+
+        // loads of the PC
+        case INSTR_LSM:
+            return get_bit (instruction, 20) && get_bit (instruction, R_PC);
+    }
+
+    return 0;
+}
+
+// marks the page holding addr as holding code
+// a page that doesn't exist yet is left alone, its first store creates it
+void mark_code (pagetable* pt, uint32_t addr)
+{
+    page* p = pagetable_find (pt, addr);
+
+    if (p)
+        p->flags |= PAGE_CODE;
+}
+
+// decodes the block starting at addr
+// returns NULL if there's insufficient memory
+block* block_build (pagetable* pt, uint32_t addr)
+{
+    decoded_instruction instr[BLOCK_MAX_INSTRUCTIONS];
+    decoded_instruction* d;
+    uint64_t* counters[BLOCK_MAX_COUNTERS];
+    uint8_t kinds[BLOCK_MAX_COUNTERS];
+    uint32_t pc = addr;
+    int length = 0, n;
+    uint8_t trace = 0, hooks = 0;
+    block* b;
+
+    do
+    {
+        // breakpoints start blocks of their own
+        if (length && breakpoint_count && debug_breakpoint_at (pc))
+            break;
+
+        // the fetch may straddle two pages
+        mark_code (pt, pc);
+        mark_code (pt, pc + 3);
+
+        d = &instr[length++];
+        d->word = fetch32 (pt, pc);
+        d->type = get_instruction_type (d->word);
+        d->cond = get_cond (d->word);
+        d->trace = trace_filter_static (pc, d->type);
+        d->hooks = plugin_hooks (pc, d->type, length == 1);
+        d->partial = 0;
+        d->passed = 0;
+
+        trace |= d->trace;
+        hooks |= d->hooks;
+        pc += 4;
+    } while (!ends_block (d->word, d->type) && length < BLOCK_MAX_INSTRUCTIONS
+        && PAGE_NUMBER (pc) == PAGE_NUMBER (addr));
+
+    b = malloc (sizeof (block) + length * sizeof (decoded_instruction));
+
+    if (!b)
+        return NULL;
+
+    blocks_built++;
+
+    b->start = addr;
+    b->length = length;
+    b->trace = trace;
+    b->hooks = hooks;
+    b->breakpoint = debug_breakpoint_at (addr);
+    b->executions = 0;
+    b->cycles = 0;
+    memcpy (b->instr, instr, length * sizeof (decoded_instruction));
+
+    // plugin counters for the block
+    n = plugin_counters (addr, counters, kinds, BLOCK_MAX_COUNTERS);
+
+    b->counter_count = 0;
+    b->counters = NULL;
+    b->counter_kinds = NULL;
+
+    if (n)
+    {
+        b->counters = malloc (n * sizeof (uint64_t*));
+        b->counter_kinds = malloc (n);
+
+        if (!b->counters || !b->counter_kinds)
+        {
+            block_free (b);
+            return NULL;
+        }
+
+        memcpy (b->counters, counters, n * sizeof (uint64_t*));
+        memcpy (b->counter_kinds, kinds, n);
+        b->counter_count = n;
+        b->hooks |= HOOK_COUNT;
+    }
+
+    return b;
+}
+
+// adds a block to the cache, growing the block array if needed
+// returns 0 on success, -1 if there's insufficient memory
+int blockcache_insert (blockcache* bc, block* b)
+{
+    block** blocks;
+
+    if (bc->count == bc->capacity)
+    {
+        blocks = realloc (bc->blocks, 2 * bc->capacity * sizeof (block*));
+
+        if (!blocks)
+            return -1;
+
+        bc->blocks = blocks;
+        bc->capacity *= 2;
+    }
+
+    if (hashtable_add_node (bc->index, b->start, bc->count) != 0)
+        return -1;
+
+    bc->blocks[bc->count++] = b;
+
+    return 0;
+}
+
+/* Blocks */
+
+// frees a block and anything it owns
+void block_free (block* b)
+{
+    free (b->counters);
+    free (b->counter_kinds);
+    free (b);
+}
+
+/* Abstract Data Structure functions */
+
+// returns the block starting at addr, building it if necessary
+// returns NULL if there's insufficient memory
+block* blockcache_find (blockcache* bc, pagetable* pt, uint32_t addr)
+{
+    block** slot = &bc->recent[(addr >> 2) & (BLOCKCACHE_RECENT_SIZE - 1)];
+    block* b = *slot;
+    node* n;
+
+    if (b && b->start == addr)
+        return b;
+
+    n = hashtable_search (bc->index, addr);
+
+    if (n)
+    {
+        b = bc->blocks[n->data];
+    }
+    else
+    {
+        b = block_build (pt, addr);
+
+        if (!b)
+            return NULL;
+
+        if (blockcache_insert (bc, b) != 0)
+        {
+            block_free (b);
+            return NULL;
+        }
+    }
+
+    *slot = b;
+
+    return b;
+}
+
+// throws away every block, and clears the pages' code marks
+void blockcache_flush (blockcache* bc, pagetable* pt)
+{
+    int i;
+
+    for (i = 0; i < bc->count; i++)
+        block_free (bc->blocks[i]);
+
+    for (i = 0; i < pt->count; i++)
+        pt->pages[i]->flags &= ~PAGE_CODE;
+
+    hashtable_destroy (bc->index);
+    bc->index = hashtable_create ();
+    bc->count = 0;
+
+    memset (bc->recent, 0, sizeof (bc->recent));
+    pt->code_written = 0;
+    pt->code_write_count = 0;
+}
+
+// throws away the blocks built from the code pages stored to since the
+// last call, or every block if more were than could be noted
+void blockcache_invalidate (blockcache* bc, pagetable* pt)
+{
+    int i = 0, j;
+    block* b;
+
+    if (pt->code_write_count > PAGETABLE_CODE_WRITES)
+    {
+        blockcache_flush (bc, pt);
+        return;
+    }
+
+    memset (bc->recent, 0, sizeof (bc->recent));
+
+    while (i < bc->count)
+    {
+        b = bc->blocks[i];
+
+        for (j = 0; j < pt->code_write_count; j++)
+            if (PAGE_NUMBER (b->start) == pt->code_writes[j])
+                break;
+
+        if (j == pt->code_write_count)
+        {
+            i++;
+            continue;
+        }
+
+        // the last block takes its place
+        hashtable_remove_node (bc->index, b->start);
+        bc->blocks[i] = bc->blocks[--bc->count];
+
+        if (i < bc->count)
+            hashtable_search (bc->index, bc->blocks[i]->start)->data = i;
+
+        block_free (b);
+    }
+
+    pt->code_written = 0;
+    pt->code_write_count = 0;
+}
+
+// create a new, empty, block cache
+// returns NULL if there's insufficient memory
+blockcache* blockcache_create (void)
+{
+    blockcache* bc = calloc (1, sizeof (blockcache));
+
+    if (!bc)
+        return NULL;
+
+    bc->capacity = 16;
+    bc->blocks = malloc (bc->capacity * sizeof (block*));
+    bc->index = hashtable_create ();
+
+    if (!bc->blocks || !bc->index)
+    {
+        blockcache_destroy (bc);
+        return NULL;
+    }
+
+    return bc;
+}
+
+// destroys the specified block cache and frees all memory used by it
+void blockcache_destroy (blockcache* bc)
+{
+    int i;
+
+    for (i = 0; i < bc->count; i++)
+        block_free (bc->blocks[i]);
+
+    if (bc->index)
+        hashtable_destroy (bc->index);
+
+    free (bc->blocks);
+    free (bc);
+}
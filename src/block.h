@@ -0,0 +1,76 @@
+/*
+ * ARM emulator
+ * Luke Mitchell
+ *
+ */
+
+#ifndef BLOCK_H
+#define BLOCK_H
+
+#include <stdint.h>
+#include "hash.h"
+#include "pagetable.h"
+
+/* Most instructions decoded into one block */
+#define BLOCK_MAX_INSTRUCTIONS 64
+
+/* Most plugin counters attached to one block */
+#define BLOCK_MAX_COUNTERS 16
+
+/* Number of recently used blocks remembered, must be a power of two */
+#define BLOCKCACHE_RECENT_SIZE 1024
+
+// an instruction decoded when its block was built
+typedef struct {
+    uint32_t word;
+    uint8_t type;       // INSTR_*
+    uint8_t cond;       // COND_*
+    uint8_t trace;      // passes the trace filters decided at build time
+    uint8_t hooks;      // HOOK_* plugin events for this instruction
+    uint64_t partial;   // runs of the block that stopped after this instruction
+    uint64_t passed;    // times the condition passed, when profiling
+} decoded_instruction;
+
+// a basic block: a run of instructions in one page, ending at the
+// first instruction that may write the PC
+typedef struct {
+    uint32_t start;     // address of the first instruction
+    int length;         // number of instructions
+    uint8_t trace;      // some instruction passes the build time trace filters
+    uint8_t hooks;      // HOOK_* for any instruction, and HOOK_COUNT
+    uint8_t breakpoint; // there's a breakpoint at the start
+    uint64_t executions; // complete runs of the block, when profiling
+    uint64_t cycles;    // estimated for every run, when timing
+    int counter_count;  // plugin counters, added to as the block finishes
+    uint64_t** counters;
+    uint8_t* counter_kinds;
+    decoded_instruction instr[];
+} block;
+
+// the blocks built so far, keyed by start address
+typedef struct {
+    hashtable* index;   // start address -> position in blocks
+    block** blocks;
+    int count;
+    int capacity;
+    block* recent[BLOCKCACHE_RECENT_SIZE];
+} blockcache;
+
+/* Blocks decoded since start-up */
+extern uint64_t blocks_built;
+
+// blocks
+void            block_free              (block*);
+
+// lookup
+block*          blockcache_find         (blockcache*, pagetable*, uint32_t);
+
+// invalidation
+void            blockcache_flush        (blockcache*, pagetable*);
+void            blockcache_invalidate   (blockcache*, pagetable*);
+
+// ctor and dtor
+blockcache*     blockcache_create       (void);
+void            blockcache_destroy      (blockcache*);
+
+#endif
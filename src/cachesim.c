@@ -0,0 +1,380 @@
+/*
+ * ARM emulator
+ * Luke Mitchell
+ *
+ */
+
+// Guest cache simulator
+//
+// Instruction fetches go to the L1 instruction cache, loads and stores to
+// the L1 data cache, and the misses of either go on to the L2 if there is
+// one. Only the line addresses are simulated, not the data, so a cache is
+// a table of sets * ways line addresses with a stamp for each way.
+//
+// Straight line code fetches the same line several times over, so each
+// cache remembers the line it last hit: that line is already the most
+// recently used, so a repeat access is counted without searching the set.
+// Accesses and misses are also counted per region, in a flat array, and
+// misses (being rarer) per instruction address.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cachesim.h"
+
+/* The caches simulated, NULL when not simulated */
+sim_cache* icache;
+sim_cache* dcache;
+sim_cache* l2cache;
+
+/* The cache whose regions are being sorted */
+sim_cache* cachesim_sorting;
+
+/* Helper functions not exposed in header file */
+
+// returns log2 of n if n is a power of two, -1 otherwise
+int cachesim_log2 (uint32_t n)
+{
+    int bits = 0;
+
+    if (n == 0 || (n & (n - 1)))
+        return -1;
+
+    while (n >>= 1)
+        bits++;
+
+    return bits;
+}
+
+// reads a size, with an optional k or m suffix, from s
+// returns 0 if there's no size there
+uint32_t cachesim_size (char* s, char** end)
+{
+    uint32_t n = strtoul (s, end, 0);
+
+    if (**end == 'k' || **end == 'K')
+    {
+        n *= 1024;
+        (*end)++;
+    }
+    else if (**end == 'm' || **end == 'M')
+    {
+        n *= 1024 * 1024;
+        (*end)++;
+    }
+
+    return n;
+}
+
+// counts a miss caused by the instruction at pc
+void cachesim_count_pc (sim_cache* c, uint32_t pc)
+{
+    node* n = hashtable_search (c->pc_index, pc);
+    cachesim_pc* pcs;
+
+    if (n)
+    {
+        c->pcs[n->data].misses++;
+        return;
+    }
+
+    if (c->pc_count == c->pc_capacity)
+    {
+        pcs = realloc (c->pcs, 2 * c->pc_capacity * sizeof (cachesim_pc));
+
+        if (!pcs)
+            return;
+
+        c->pcs = pcs;
+        c->pc_capacity *= 2;
+    }
+
+    if (hashtable_add_node (c->pc_index, pc, c->pc_count) != 0)
+        return;
+
+    c->pcs[c->pc_count].pc = pc;
+    c->pcs[c->pc_count].misses = 1;
+    c->pc_count++;
+}
+
+// returns the way to fill in a set, given its stamps
+int cachesim_victim (sim_cache* c, uint64_t* stamps)
+{
+    int i, victim = 0;
+
+    // an empty way first
+    for (i = 0; i < c->ways; i++)
+        if (!stamps[i])
+            return i;
+
+    if (c->policy == CACHESIM_RANDOM)
+    {
+        c->seed ^= c->seed << 13;
+        c->seed ^= c->seed >> 17;
+        c->seed ^= c->seed << 5;
+        return c->seed % c->ways;
+    }
+
+    // the oldest use (LRU) or fill (FIFO)
+    for (i = 1; i < c->ways; i++)
+        if (stamps[i] < stamps[victim])
+            victim = i;
+
+    return victim;
+}
+
+// orders pc counts by misses, highest first, for qsort
+int cachesim_pc_compare (const void* a, const void* b)
+{
+    uint64_t x = (*(cachesim_pc**) a)->misses;
+    uint64_t y = (*(cachesim_pc**) b)->misses;
+
+    return (x < y) - (x > y);
+}
+
+// orders regions of cachesim_sorting by misses, highest first, for qsort
+int cachesim_region_compare (const void* a, const void* b)
+{
+    uint64_t x = cachesim_sorting->region_misses[*(uint32_t*) a];
+    uint64_t y = cachesim_sorting->region_misses[*(uint32_t*) b];
+
+    return (x < y) - (x > y);
+}
+
+// returns count as a percentage of total
+double cachesim_percent (uint64_t count, uint64_t total)
+{
+    return total ? 100.0 * count / total : 0.0;
+}
+
+// prints the counts for one cache
+void cachesim_report_cache (sim_cache* c)
+{
+    static const char* policies[] = { "lru", "fifo", "random" };
+    cachesim_pc** sorted;
+    uint32_t* regions;
+    int i, n = 0;
+
+    printf ("%s: %u bytes, %d ways, %d byte lines, %s\n", c->name, c->size, c->ways,
+        1 << c->line_bits, policies[c->policy]);
+    printf ("  %llu accesses, %llu misses, %.2f%% miss rate\n\n",
+        (unsigned long long) c->accesses, (unsigned long long) c->misses,
+        cachesim_percent (c->misses, c->accesses));
+
+    if (!c->misses)
+        return;
+
+    // instructions causing the most misses
+    if ((sorted = malloc ((c->pc_count + 1) * sizeof (cachesim_pc*))))
+    {
+        for (i = 0; i < c->pc_count; i++)
+            sorted[i] = &c->pcs[i];
+
+        qsort (sorted, c->pc_count, sizeof (cachesim_pc*), cachesim_pc_compare);
+
+        printf ("  Misses by instruction:\n");
+
+        for (i = 0; i < c->pc_count && i < CACHESIM_TOP; i++)
+            printf ("    0x%08X %12llu %6.2f%%\n", sorted[i]->pc,
+                (unsigned long long) sorted[i]->misses,
+                cachesim_percent (sorted[i]->misses, c->misses));
+
+        printf ("\n");
+        free (sorted);
+    }
+
+    // regions with the most misses
+    if ((regions = malloc (CACHESIM_REGIONS * sizeof (uint32_t))))
+    {
+        for (i = 0; i < CACHESIM_REGIONS; i++)
+            if (c->region_misses[i])
+                regions[n++] = i;
+
+        cachesim_sorting = c;
+        qsort (regions, n, sizeof (uint32_t), cachesim_region_compare);
+
+        printf ("  Misses by region:\n");
+
+        for (i = 0; i < n && i < CACHESIM_TOP; i++)
+            printf ("    0x%08X-0x%08X %12llu accesses %12llu misses %6.2f%%\n",
+                regions[i] << CACHESIM_REGION_BITS,
+                (regions[i] << CACHESIM_REGION_BITS) + (1 << CACHESIM_REGION_BITS) - 1,
+                (unsigned long long) c->region_accesses[regions[i]],
+                (unsigned long long) c->region_misses[regions[i]],
+                cachesim_percent (c->region_misses[regions[i]], c->region_accesses[regions[i]]));
+
+        printf ("\n");
+        free (regions);
+    }
+}
+
+/* Access */
+
+// simulates an access to addr by the instruction at pc, passing a miss
+// on to the next level
+// returns 1 on a hit, 0 on a miss
+int cachesim_access (sim_cache* c, uint32_t pc, uint32_t addr)
+{
+    uint32_t line = addr >> c->line_bits, region = addr >> CACHESIM_REGION_BITS;
+    uint32_t set = (line & c->set_mask) * c->ways;
+    uint32_t* lines = &c->lines[set];
+    uint64_t* stamps = &c->stamps[set];
+    int i;
+
+    c->accesses++;
+    c->region_accesses[region]++;
+
+    // the line last hit is already the most recently used
+    if (c->last_valid && line == c->last)
+        return 1;
+
+    c->last = line;
+    c->last_valid = 1;
+
+    for (i = 0; i < c->ways; i++)
+    {
+        if (stamps[i] && lines[i] == line)
+        {
+            if (c->policy == CACHESIM_LRU)
+                stamps[i] = ++c->clock;
+
+            return 1;
+        }
+    }
+
+    // miss, fill from the next level
+    c->misses++;
+    c->region_misses[region]++;
+    cachesim_count_pc (c, pc);
+
+    i = cachesim_victim (c, stamps);
+    lines[i] = line;
+    stamps[i] = ++c->clock;
+
+    if (c->next)
+        cachesim_access (c->next, pc, addr);
+
+    return 0;
+}
+
+/* Reporting */
+
+// prints the counts for every cache simulated
+void cachesim_report (void)
+{
+    if (icache)
+        cachesim_report_cache (icache);
+
+    if (dcache)
+        cachesim_report_cache (dcache);
+
+    if (l2cache)
+        cachesim_report_cache (l2cache);
+}
+
+/* Abstract Data Structure functions */
+
+// create a cache described by spec, "size:ways:line[:lru|fifo|random]"
+// where size may end in k or m, e.g. "16k:4:32:lru"
+// returns NULL if spec is invalid or there's insufficient memory
+sim_cache* cachesim_create (const char* name, char* spec)
+{
+    sim_cache* c;
+    uint32_t size, ways, line, sets;
+    char* end;
+    int policy = CACHESIM_LRU;
+
+    size = cachesim_size (spec, &end);
+
+    if (*end++ != ':')
+        return NULL;
+
+    ways = strtoul (end, &end, 0);
+
+    if (*end++ != ':')
+        return NULL;
+
+    line = strtoul (end, &end, 0);
+
+    if (*end == ':')
+    {
+        end++;
+
+        if (strcmp (end, "lru") == 0)
+            policy = CACHESIM_LRU;
+        else if (strcmp (end, "fifo") == 0)
+            policy = CACHESIM_FIFO;
+        else if (strcmp (end, "random") == 0)
+            policy = CACHESIM_RANDOM;
+        else
+            return NULL;
+    }
+    else if (*end)
+        return NULL;
+
+    // everything a power of two, with at least one set
+    if (cachesim_log2 (size) < 0 || ways == 0 || cachesim_log2 (line) < 2
+        || size / line < ways || cachesim_log2 ((size / line) / ways) < 0)
+        return NULL;
+
+    if (!(c = calloc (1, sizeof (sim_cache))))
+        return NULL;
+
+    sets = (size / line) / ways;
+
+    c->name = name;
+    c->size = size;
+    c->ways = ways;
+    c->line_bits = cachesim_log2 (line);
+    c->set_mask = sets - 1;
+    c->policy = policy;
+    c->seed = 2463534242u;
+
+    c->lines = malloc (sets * ways * sizeof (uint32_t));
+    c->stamps = calloc (sets * ways, sizeof (uint64_t));
+    c->region_accesses = calloc (CACHESIM_REGIONS, sizeof (uint64_t));
+    c->region_misses = calloc (CACHESIM_REGIONS, sizeof (uint64_t));
+
+    c->pc_capacity = 16;
+    c->pcs = malloc (c->pc_capacity * sizeof (cachesim_pc));
+    c->pc_index = hashtable_create ();
+
+    if (!c->lines || !c->stamps || !c->region_accesses || !c->region_misses
+        || !c->pcs || !c->pc_index)
+    {
+        cachesim_destroy (c);
+        return NULL;
+    }
+
+    return c;
+}
+
+// destroys the specified cache and frees all memory used by it
+void cachesim_destroy (sim_cache* c)
+{
+    if (c->pc_index)
+        hashtable_destroy (c->pc_index);
+
+    free (c->lines);
+    free (c->stamps);
+    free (c->region_accesses);
+    free (c->region_misses);
+    free (c->pcs);
+    free (c);
+}
+
+// destroys every cache simulated
+void cachesim_destroy_all (void)
+{
+    if (icache)
+        cachesim_destroy (icache);
+
+    if (dcache)
+        cachesim_destroy (dcache);
+
+    if (l2cache)
+        cachesim_destroy (l2cache);
+
+    icache = dcache = l2cache = NULL;
+}
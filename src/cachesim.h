@@ -0,0 +1,76 @@
+/*
+ * ARM emulator
+ * Luke Mitchell
+ *
+ */
+
+#ifndef CACHESIM_H
+#define CACHESIM_H
+
+#include <stdint.h>
+#include "hash.h"
+
+/* Replacement policies */
+#define CACHESIM_LRU    0
+#define CACHESIM_FIFO   1
+#define CACHESIM_RANDOM 2
+
+/* Regions reported on are 1 << CACHESIM_REGION_BITS bytes */
+#define CACHESIM_REGION_BITS 16
+#define CACHESIM_REGIONS (1 << (32 - CACHESIM_REGION_BITS))
+
+/* Rows shown in each table of the report */
+#define CACHESIM_TOP 20
+
+// misses caused by one instruction address
+typedef struct {
+    uint32_t pc;
+    uint64_t misses;
+} cachesim_pc;
+
+// a simulated cache
+typedef struct sim_cache {
+    const char* name;
+    uint32_t size;
+    int ways;
+    int line_bits;
+    uint32_t set_mask;
+    int policy;
+
+    uint32_t* lines;        // sets * ways line addresses
+    uint64_t* stamps;       // last use (LRU) or fill (FIFO), 0 for an empty way
+    uint64_t clock;         // stamps handed out
+    uint32_t seed;          // for random replacement
+    uint32_t last;          // line last hit, with last_valid
+    int last_valid;
+
+    uint64_t accesses;
+    uint64_t misses;
+    uint64_t* region_accesses;
+    uint64_t* region_misses;
+
+    hashtable* pc_index;    // pc -> position in pcs
+    cachesim_pc* pcs;
+    int pc_count;
+    int pc_capacity;
+
+    struct sim_cache* next; // where misses go, or NULL for memory
+} sim_cache;
+
+/* The caches simulated, NULL when not simulated */
+extern sim_cache* icache;
+extern sim_cache* dcache;
+extern sim_cache* l2cache;
+
+// access
+int             cachesim_access         (sim_cache*, uint32_t pc, uint32_t addr);
+
+// reporting
+void            cachesim_report         (void);
+
+// ctor and dtor
+sim_cache*      cachesim_create         (const char* name, char* spec);
+void            cachesim_destroy        (sim_cache*);
+void            cachesim_destroy_all    (void);
+
+#endif
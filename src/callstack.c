@@ -0,0 +1,267 @@
+/*
+ * ARM emulator
+ * Luke Mitchell
+ *
+ */
+
+// Sampling call stack profiler
+//
+// A shadow call stack follows the guest's calls. A taken BL pushes the
+// address called and the address after the BL. Any other write to the
+// PC that lands on the return address of a frame pops back to below it,
+// so MOV PC, LR, LDR PC, ... and returns that skip frames all work.
+//
+// A profiling timer (SIGPROF) only sets a flag. The emulator checks the
+// flag between blocks and records the shadow stack when it's set. When
+// the run ends, each distinct stack is written on one line in the
+// "folded" format that flame graph tools read:
+//
+//   0x00000000;0x00000040;0x00000080 123
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/time.h>
+#include "callstack.h"
+#include "instructions.h"
+#include "common.h"
+#include "hash.h"
+
+/* Set by the timer, cleared when the sample is taken */
+volatile sig_atomic_t callstack_pending;
+
+/* Shadow stack */
+call_frame callstack[CALLSTACK_MAX];
+int callstack_depth;
+
+/* Samples */
+FILE* callstack_fp;
+hashtable* sample_index;    // hash of a stack -> position in samples
+stack_sample* samples;
+int sample_count;
+int sample_capacity;
+
+/* Helper functions not exposed in header file */
+
+// timer signal handler, asks for a sample at the next block
+void callstack_timer (int sig)
+{
+    callstack_pending = 1;
+}
+
+// returns the FNV-1a hash of the function entries on the shadow stack
+uint32_t stack_hash (void)
+{
+    uint32_t h = 2166136261u;
+    int i;
+
+    for (i = 0; i < callstack_depth; i++)
+        h = (h ^ callstack[i].entry) * 16777619u;
+
+    return h;
+}
+
+// returns 1 if sample s holds the current shadow stack
+// returns 0 otherwise
+int stack_matches (stack_sample* s)
+{
+    int i;
+
+    if (s->depth != callstack_depth)
+        return 0;
+
+    for (i = 0; i < s->depth; i++)
+        if (s->frames[i] != callstack[i].entry)
+            return 0;
+
+    return 1;
+}
+
+// adds the current shadow stack as a new distinct stack
+// returns it, or NULL if there's insufficient memory
+stack_sample* add_sample (void)
+{
+    stack_sample* s;
+    int i;
+
+    if (sample_count == sample_capacity)
+    {
+        s = realloc (samples, (sample_capacity ? 2 * sample_capacity : 64)
+            * sizeof (stack_sample));
+
+        if (!s)
+            return NULL;
+
+        samples = s;
+        sample_capacity = sample_capacity ? 2 * sample_capacity : 64;
+    }
+
+    s = &samples[sample_count];
+    s->frames = malloc ((callstack_depth + 1) * sizeof (uint32_t));
+
+    if (!s->frames)
+        return NULL;
+
+    for (i = 0; i < callstack_depth; i++)
+        s->frames[i] = callstack[i].entry;
+
+    s->depth = callstack_depth;
+    s->count = 0;
+    sample_count++;
+
+    return s;
+}
+
+/* Shadow stack */
+
+// follows a write to the PC, from the instruction at from to the
+// address to, pushing calls and popping returns
+void callstack_jump (uint32_t instr, uint8_t type, uint32_t from, uint32_t to)
+{
+    int i;
+
+    // BL
+    if (type == INSTR_B && get_bit (instr, 24))
+    {
+        if (callstack_depth < CALLSTACK_MAX)
+        {
+            callstack[callstack_depth].entry = to;
+            callstack[callstack_depth].ret = from + 4;
+            callstack_depth++;
+        }
+
+        return;
+    }
+
+    // a return to any frame, the outermost frame never returns
+    for (i = callstack_depth - 1; i > 0; i--)
+    {
+        if (callstack[i].ret == to)
+        {
+            callstack_depth = i;
+            return;
+        }
+    }
+}
+
+/* Sampling */
+
+// returns 1 if the shadow stack is being sampled, 0 otherwise
+int callstack_running (void)
+{
+    return callstack_fp != NULL;
+}
+
+// starts sampling the shadow stack hz times a second of CPU time,
+// to be written to path when sampling stops
+// entry is the address execution starts at, the outermost frame
+// returns 0 on success, -1 if path can't be created
+int callstack_start (char* path, int hz, uint32_t entry)
+{
+    struct itimerval timer;
+    struct sigaction action;
+    long interval;
+
+    callstack_fp = fopen (path, "w");
+
+    if (!callstack_fp)
+        return -1;
+
+    sample_index = hashtable_create ();
+
+    callstack[0].entry = entry;
+    callstack[0].ret = 0;
+    callstack_depth = 1;
+
+    if (hz <= 0)
+        hz = CALLSTACK_HZ;
+
+    // restart system calls, so output isn't cut short by a sample
+    memset (&action, 0, sizeof (action));
+    action.sa_handler = callstack_timer;
+    action.sa_flags = SA_RESTART;
+    sigemptyset (&action.sa_mask);
+    sigaction (SIGPROF, &action, NULL);
+
+    interval = 1000000 / hz;
+
+    if (interval < 1)
+        interval = 1;
+
+    timer.it_interval.tv_sec = interval / 1000000;
+    timer.it_interval.tv_usec = interval % 1000000;
+    timer.it_value = timer.it_interval;
+    setitimer (ITIMER_PROF, &timer, NULL);
+
+    return 0;
+}
+
+// records the current shadow stack
+void callstack_sample (void)
+{
+    uint32_t h = stack_hash ();
+    node* n = sample_index ? hashtable_search (sample_index, h) : NULL;
+    stack_sample* s = NULL;
+    int i;
+
+    callstack_pending = 0;
+
+    if (n && stack_matches (&samples[n->data]))
+    {
+        s = &samples[n->data];
+    }
+    else if (n)
+    {
+        // stacks whose hashes collide are only found by searching
+        for (i = 0; i < sample_count && !s; i++)
+            if (stack_matches (&samples[i]))
+                s = &samples[i];
+
+        if (!s)
+            s = add_sample ();
+    }
+    else if ((s = add_sample ()) && sample_index)
+    {
+        hashtable_add_node (sample_index, h, sample_count - 1);
+    }
+
+    if (s)
+        s->count++;
+}
+
+// stops sampling and writes out the folded stacks
+void callstack_stop (void)
+{
+    struct itimerval timer;
+    int i, j;
+
+    if (!callstack_fp)
+        return;
+
+    memset (&timer, 0, sizeof (timer));
+    setitimer (ITIMER_PROF, &timer, NULL);
+    signal (SIGPROF, SIG_DFL);
+
+    for (i = 0; i < sample_count; i++)
+    {
+        for (j = 0; j < samples[i].depth; j++)
+            fprintf (callstack_fp, (j == 0) ? "0x%08X" : ";0x%08X", samples[i].frames[j]);
+
+        fprintf (callstack_fp, " %llu\n", (unsigned long long) samples[i].count);
+        free (samples[i].frames);
+    }
+
+    fclose (callstack_fp);
+
+    if (sample_index)
+        hashtable_destroy (sample_index);
+
+    free (samples);
+
+    callstack_fp = NULL;
+    sample_index = NULL;
+    samples = NULL;
+    sample_count = sample_capacity = 0;
+}
@@ -0,0 +1,44 @@
+/*
+ * ARM emulator
+ * Luke Mitchell
+ *
+ */
+
+#ifndef CALLSTACK_H
+#define CALLSTACK_H
+
+#include <stdint.h>
+#include <signal.h>
+
+/* Deepest shadow call stack kept, deeper calls are not recorded */
+#define CALLSTACK_MAX 256
+
+/* Default samples per second of CPU time */
+#define CALLSTACK_HZ 1000
+
+// a call on the shadow stack
+typedef struct {
+    uint32_t entry;     // address called
+    uint32_t ret;       // address it returns to
+} call_frame;
+
+// a distinct stack seen by the sampler
+typedef struct {
+    uint32_t* frames;   // function entry addresses, outermost first
+    int depth;
+    uint64_t count;     // samples taken with this stack
+} stack_sample;
+
+/* Set by the timer, cleared when the sample is taken */
+extern volatile sig_atomic_t callstack_pending;
+
+// shadow stack
+void    callstack_jump      (uint32_t instr, uint8_t type, uint32_t from, uint32_t to);
+
+// sampling
+int     callstack_running   (void);
+int     callstack_start     (char* path, int hz, uint32_t entry);
+void    callstack_sample    (void);
+void    callstack_stop      (void);
+
+#endif
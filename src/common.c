@@ -6,38 +6,91 @@
 
 #include <stdint.h>
 #include <stdio.h>
-#include <math.h>
-#include "hash.h"
+#include <stdlib.h>
+#include <string.h>
+#include "common.h"
+#include "pagetable.h"
 #include "instructions.h"
+#include "device.h"
 
 #define DEBUG 1
 
 // stores a value in memory
-void store (hashtable* memory, uint32_t addr, int size, uint8_t* data)
+// the data is copied a page at a time
+void store (pagetable* memory, uint32_t addr, int size, uint8_t* data)
 {
-    int i;
+    int n;
+    uint32_t offset;
+    page* p;
 
-    for (i = 0; i < size; i++)
+    while (size > 0)
     {
-        node* n = hashtable_search (memory, addr + i);
+        p = pagetable_get (memory, addr);
 
-        if (n)
-             n->data = data[i];
-        else
-            hashtable_add_node (memory, addr + i, data[i]);
+        if (!p)
+            return;
+
+        offset = PAGE_OFFSET (addr);
+        n = PAGE_SIZE - offset;
+
+        if (n > size)
+            n = size;
+
+        if (p->flags & PAGE_WATCH)
+            memory->watcher (addr, n, 1);
+
+        // devices take the value a word at a time
+        if (p->flags & PAGE_DEVICE)
+        {
+            if (n > 4)
+                n = 4;
+
+            p->device->write (p->device, addr - p->device->base,
+                data[0] | (n > 1 ? data[1] << 8 : 0) | (n > 2 ? data[2] << 16 : 0)
+                | (n > 3 ? (uint32_t) data[3] << 24 : 0), n);
+
+            addr += n;
+            data += n;
+            size -= n;
+            continue;
+        }
+
+        // keep the contents at the checkpoint
+        if (memory->tracking && !(p->flags & PAGE_DIRTY))
+            pagetable_mark_dirty (memory, p);
+
+        memcpy (p->data + offset, data, n);
+
+        // decoded blocks may now be stale
+        if (p->flags & PAGE_CODE)
+            pagetable_code_write (memory, p);
+
+        // widen the written range of the page
+        if (offset < p->lo)
+            p->lo = offset;
+        if (offset + n > p->hi)
+            p->hi = offset + n;
+
+        addr += n;
+        data += n;
+        size -= n;
     }
 }
 
 // load an 8-bit value from memory
 // returns a random value if nothing exists in memory
 // simulating the meaningless data in physical memory
-uint8_t load (hashtable* memory, uint32_t addr)
+uint8_t load (pagetable* memory, uint32_t addr)
 {
-    node* n = hashtable_search (memory, addr);
+    page* p = pagetable_find (memory, addr);
 
-    if (n)
+    if (p && (p->flags & PAGE_DEVICE))
+    {
+        return p->device->read (p->device, addr - p->device->base, 1);
+    }
+    else if (p)
     {
-        return n->data;
+        return p->data[PAGE_OFFSET (addr)];
     }
     else
     {
@@ -49,24 +102,307 @@ uint8_t load (hashtable* memory, uint32_t addr)
     }
 }
 
-// load a 32-bit value from memory
-uint32_t load32 (hashtable* memory, unsigned int addr)
+// load an 8-bit value from memory, as the guest does
+uint8_t load8 (pagetable* memory, uint32_t addr)
+{
+    page* p = pagetable_find (memory, addr);
+
+    if (!p)
+        return 0;
+
+    if (p->flags & (PAGE_WATCH | PAGE_DEVICE))
+    {
+        if (p->flags & PAGE_WATCH)
+            memory->watcher (addr, 1, 0);
+
+        if (p->flags & PAGE_DEVICE)
+            return p->device->read (p->device, addr - p->device->base, 1);
+    }
+
+    return p->data[PAGE_OFFSET (addr)];
+}
+
+// load a 16-bit value from memory, as the guest does
+uint16_t load16 (pagetable* memory, uint32_t addr)
+{
+    uint32_t offset = PAGE_OFFSET (addr);
+    uint8_t bytes[2];
+    page* p;
+
+    // both bytes in one page
+    if (offset <= PAGE_SIZE - 2 && (p = pagetable_find (memory, addr)))
+    {
+        if (p->flags & (PAGE_WATCH | PAGE_DEVICE))
+        {
+            if (p->flags & PAGE_WATCH)
+                memory->watcher (addr, 2, 0);
+
+            if (p->flags & PAGE_DEVICE)
+                return p->device->read (p->device, addr - p->device->base, 2);
+        }
+
+        return p->data[offset] | (p->data[offset + 1] << 8);
+    }
+
+    // split across two pages, or not mapped
+    load_bytes (memory, addr, 2, bytes);
+
+    return bytes[0] | (bytes[1] << 8);
+}
+
+// load a 32-bit value from memory, as the guest does
+uint32_t load32 (pagetable* memory, unsigned int addr)
+{
+    uint32_t offset = PAGE_OFFSET (addr);
+    uint8_t bytes[4];
+    page* p;
+
+    // the common case, all four bytes in one page
+    if (offset <= PAGE_SIZE - 4 && (p = pagetable_find (memory, addr)))
+    {
+        // watched and device pages take the slow path
+        if (p->flags & (PAGE_WATCH | PAGE_DEVICE))
+        {
+            if (p->flags & PAGE_WATCH)
+                memory->watcher (addr, 4, 0);
+
+            if (p->flags & PAGE_DEVICE)
+                return p->device->read (p->device, addr - p->device->base, 4);
+        }
+
+        return p->data[offset] | (p->data[offset + 1] << 8)
+            | (p->data[offset + 2] << 16) | ((uint32_t) p->data[offset + 3] << 24);
+    }
+
+    // split across two pages, or not mapped, the watcher and devices
+    // see each page's part
+    load_bytes (memory, addr, 4, bytes);
+
+    return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((uint32_t) bytes[3] << 24);
+}
+
+// loads size bytes from memory, as the guest does
+// the data is copied a page at a time, unwritten memory reads as zero
+void load_bytes (pagetable* memory, uint32_t addr, int size, uint8_t* data)
+{
+    int i, n;
+    uint32_t offset;
+    page* p;
+
+    while (size > 0)
+    {
+        p = pagetable_find (memory, addr);
+        offset = PAGE_OFFSET (addr);
+        n = PAGE_SIZE - offset;
+
+        if (n > size)
+            n = size;
+
+        if (!p)
+        {
+            memset (data, 0, n);
+        }
+        else if (p->flags & (PAGE_WATCH | PAGE_DEVICE))
+        {
+            if (p->flags & PAGE_WATCH)
+                memory->watcher (addr, n, 0);
+
+            for (i = 0; i < n; i++)
+                data[i] = (p->flags & PAGE_DEVICE)
+                    ? p->device->read (p->device, addr + i - p->device->base, 1)
+                    : p->data[offset + i];
+        }
+        else
+        {
+            memcpy (data, p->data + offset, n);
+        }
+
+        addr += n;
+        data += n;
+        size -= n;
+    }
+}
+
+// returns where the host keeps memory at addr, so up to *size bytes can be
+// read from it directly, and cuts *size back to what's left of the page
+// returns NULL if the page hasn't been written, is watched or is a device,
+// in which case it has to be read with load_bytes
+const uint8_t* load_span (pagetable* memory, uint32_t addr, uint32_t* size)
+{
+    page* p = pagetable_find (memory, addr);
+
+    if (*size > PAGE_SIZE - PAGE_OFFSET (addr))
+        *size = PAGE_SIZE - PAGE_OFFSET (addr);
+
+    if (!p || (p->flags & (PAGE_WATCH | PAGE_DEVICE)))
+        return NULL;
+
+    return p->data + PAGE_OFFSET (addr);
+}
+
+// returns where the host keeps memory at addr, so up to *size bytes can be
+// written to it directly, and cuts *size back to what's left of the page
+// the page is kept as it was at the checkpoint, but the bytes aren't
+// treated as stored to until passed to store_commit
+// returns NULL if the page is watched, is a device or can't be allocated,
+// in which case it has to be written with store
+uint8_t* store_prepare (pagetable* memory, uint32_t addr, uint32_t* size)
+{
+    uint32_t offset = PAGE_OFFSET (addr);
+    page* p = pagetable_get (memory, addr);
+
+    if (*size > PAGE_SIZE - offset)
+        *size = PAGE_SIZE - offset;
+
+    if (!p || (p->flags & (PAGE_WATCH | PAGE_DEVICE)))
+        return NULL;
+
+    if (memory->tracking && !(p->flags & PAGE_DIRTY))
+        pagetable_mark_dirty (memory, p);
+
+    return p->data + offset;
+}
+
+// treats size bytes at addr, written through store_prepare, as stored to
+void store_commit (pagetable* memory, uint32_t addr, uint32_t size)
+{
+    uint32_t offset, n;
+    page* p;
+
+    while (size > 0)
+    {
+        offset = PAGE_OFFSET (addr);
+        n = (size < PAGE_SIZE - offset) ? size : PAGE_SIZE - offset;
+
+        if ((p = pagetable_find (memory, addr)))
+        {
+            if (p->flags & PAGE_CODE)
+                pagetable_code_write (memory, p);
+
+            if (offset < p->lo)
+                p->lo = offset;
+            if (offset + n > p->hi)
+                p->hi = offset + n;
+        }
+
+        addr += n;
+        size -= n;
+    }
+}
+
+// as store_prepare followed by store_commit of all *size bytes, in one
+// lookup for the guest's own stores
+uint8_t* store_span (pagetable* memory, uint32_t addr, uint32_t* size)
+{
+    uint32_t offset = PAGE_OFFSET (addr);
+    page* p = pagetable_get (memory, addr);
+
+    if (*size > PAGE_SIZE - offset)
+        *size = PAGE_SIZE - offset;
+
+    if (!p || (p->flags & (PAGE_WATCH | PAGE_DEVICE)))
+        return NULL;
+
+    if (memory->tracking && !(p->flags & PAGE_DIRTY))
+        pagetable_mark_dirty (memory, p);
+
+    if (p->flags & PAGE_CODE)
+        pagetable_code_write (memory, p);
+
+    if (offset < p->lo)
+        p->lo = offset;
+    if (offset + *size > p->hi)
+        p->hi = offset + *size;
+
+    return p->data + offset;
+}
+
+// store an 8-bit value in memory, as the guest does
+void store8 (pagetable* memory, uint32_t addr, uint8_t value)
+{
+    uint32_t n = 1;
+    uint8_t* data = store_span (memory, addr, &n);
+
+    if (data)
+        data[0] = value;
+    else
+        store (memory, addr, 1, &value);
+}
+
+// store a 16-bit value in memory, as the guest does
+void store16 (pagetable* memory, uint32_t addr, uint16_t value)
+{
+    uint32_t n = 2;
+    uint8_t bytes[2] = { value, value >> 8 };
+    uint8_t* data = store_span (memory, addr, &n);
+
+    if (data && n == 2)
+        memcpy (data, bytes, 2);
+    else
+        store (memory, addr, 2, bytes);
+}
+
+// store a 32-bit value in memory, as the guest does
+void store32 (pagetable* memory, uint32_t addr, uint32_t value)
+{
+    uint32_t n = 4;
+    uint8_t bytes[4] = { value, value >> 8, value >> 16, value >> 24 };
+    uint8_t* data = store_span (memory, addr, &n);
+
+    if (data && n == 4)
+        memcpy (data, bytes, 4);
+    else
+        store (memory, addr, 4, bytes);
+}
+
+// load a 32-bit instruction from memory
+// unlike load32, nothing watching the page sees it
+uint32_t fetch32 (pagetable* memory, uint32_t addr)
 {
     int i;
-    uint32_t val = 0;
+    uint32_t val = 0, offset = PAGE_OFFSET (addr);
+    page* p;
+
+    if (offset <= PAGE_SIZE - 4 && (p = pagetable_find (memory, addr)))
+    {
+        return p->data[offset] | (p->data[offset + 1] << 8)
+            | (p->data[offset + 2] << 16) | ((uint32_t) p->data[offset + 3] << 24);
+    }
 
     for (i = 3; i >= 0; i--)
-    {   
         val = (val << 8) | load (memory, addr + i);
-    }
 
     return val;
 }
 
+// parses a range of addresses "start:end", where end is exclusive,
+// into lo and hi, which are inclusive
+// returns 0 on success, -1 if arg isn't a valid range
+int parse_range (char* arg, uint32_t* lo, uint32_t* hi)
+{
+    char* end;
+    uint32_t start, stop;
+
+    start = strtoul (arg, &end, 0);
+
+    if (*end != ':')
+        return -1;
+
+    stop = strtoul (end + 1, &end, 0);
+
+    if (*end != '\0' || stop <= start)
+        return -1;
+
+    *lo = start;
+    *hi = stop - 1;
+
+    return 0;
+}
+
 // retrieves and returns bits n to n+size
 uint32_t get_bits (uint32_t instruction, uint8_t n, uint8_t size)
 {
-    uint32_t mask = (uint32_t) pow (2, size) - 1;
+    uint32_t mask = (size >= 32) ? 0xFFFFFFFF : (1u << size) - 1;
     return ((instruction >> n) & mask);
 }
 
@@ -92,17 +428,22 @@ uint8_t get_instruction_type (uint32_t instruction)
     switch (type)
     {
         // MUL/MLA has 1001 at bits 4 to 7
+        // LDRH/STRH/LDRSB/LDRSH have 1011, 1101 or 1111, with a 0 at bit 25
         case INSTR_DP:
             if (get_bits (instruction, 4, 4) == 9)
                 return INSTR_MUL;
+            else if (!get_bit (instruction, 25) && (get_bits (instruction, 4, 4) & 9) == 9)
+                return INSTR_LSH;
             else
                 return INSTR_DP;
 
         // Branch instructions have a 1 at bit 25
+        // LDM/STM have a 0 there
         case INSTR_B:
             if (get_bit (instruction, 25) == 1)
                 return INSTR_B;
-            break;
+            else
+                return INSTR_LSM;
 
         case INSTR_LS:
             return INSTR_LS;
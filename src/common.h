@@ -8,10 +8,23 @@
 #define COMMON_H
 
 #include <stdint.h>
+#include "pagetable.h"
 
-void store (hashtable* memory, uint32_t addr, int size, uint8_t* data);
-uint8_t load (hashtable* memory, uint32_t addr);
-uint32_t load32 (hashtable* memory, unsigned int addr);
+void store (pagetable* memory, uint32_t addr, int size, uint8_t* data);
+uint8_t load (pagetable* memory, uint32_t addr);
+uint8_t load8 (pagetable* memory, uint32_t addr);
+uint16_t load16 (pagetable* memory, uint32_t addr);
+uint32_t load32 (pagetable* memory, unsigned int addr);
+void load_bytes (pagetable* memory, uint32_t addr, int size, uint8_t* data);
+const uint8_t* load_span (pagetable* memory, uint32_t addr, uint32_t* size);
+uint8_t* store_prepare (pagetable* memory, uint32_t addr, uint32_t* size);
+void store_commit (pagetable* memory, uint32_t addr, uint32_t size);
+uint8_t* store_span (pagetable* memory, uint32_t addr, uint32_t* size);
+void store8 (pagetable* memory, uint32_t addr, uint8_t value);
+void store16 (pagetable* memory, uint32_t addr, uint16_t value);
+void store32 (pagetable* memory, uint32_t addr, uint32_t value);
+uint32_t fetch32 (pagetable* memory, uint32_t addr);
+int parse_range (char* arg, uint32_t* lo, uint32_t* hi);
 uint32_t get_bits (uint32_t instruction, uint8_t n, uint8_t size);
 uint8_t get_bit (uint32_t instruction, uint8_t n);
 uint8_t get_cond (uint32_t instruction);
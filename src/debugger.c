@@ -0,0 +1,448 @@
+/*
+ * ARM emulator
+ * Luke Mitchell
+ *
+ */
+
+// Breakpoints and watchpoints
+//
+// Neither costs anything on code or memory they don't cover. Decoding ends
+// a block before any breakpoint, so breakpoints only ever start blocks, and
+// a block starting at one is marked. The emulator looks at the mark as the
+// block is entered. Adding a breakpoint while running marks the code on its
+// page as written to, so the blocks built from that page are rebuilt.
+//
+// A watchpoint tags each page it covers with PAGE_WATCH. Loads and stores
+// already have the page in hand, and only call the page table's watcher
+// when the tag is set, which checks the access against each watchpoint.
+//
+// A script (-debug file) sets them up with one command per line:
+//
+//   break addr [stop|print]
+//   watch addr [length] [read|write|access] [stop|print]
+//
+// Both stop by default, and a watchpoint covers a word written by default.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "debugger.h"
+#include "emu.h"
+#include "io.h"
+#include "hash.h"
+#include "trace.h"
+#include "instructions.h"
+
+/* Longest line in a script */
+#define DEBUG_LINE_MAX 256
+
+/* Set when a hit has asked the emulator to stop */
+int debug_stopping;
+
+/* The hit that last stopped the emulator */
+int stop_event;
+uint32_t stop_pc, stop_addr;
+int stop_store;
+
+/* Breakpoints, address -> action */
+hashtable* breakpoints;
+int breakpoint_count;
+
+/* Instructions retired when a breakpoint last stopped the emulator, so
+   that it isn't hit again straight away when emulation resumes */
+uint64_t break_retired;
+uint32_t break_addr;
+int break_resuming;
+
+/* Watchpoints */
+watchpoint* watchpoints;
+int watchpoint_count;
+
+debug_handler handler;
+
+/* Helper functions not exposed in header file */
+
+// reports a hit to stdout, and asks for its action
+int debug_report (int event, uint32_t pc, uint32_t addr, int store, int action)
+{
+    // behind the trace, when it is written asynchronously
+    trace_flush ();
+
+    if (event == DEBUG_BREAK)
+        printf ("Breakpoint at 0x%08X\n", pc);
+    else
+        printf ("Watchpoint at 0x%08X %s by 0x%08X\n", addr, store ? "written" : "read", pc);
+
+    print_register_dump (registers);
+
+    return action;
+}
+
+// sets flags on every page from lo to hi
+void debug_flag_pages (pagetable* pt, uint32_t lo, uint32_t hi)
+{
+    uint32_t n = PAGE_NUMBER (lo), last = PAGE_NUMBER (hi);
+    page* p;
+
+    do
+    {
+        if ((p = pagetable_get (pt, n << PAGE_BITS)))
+            p->flags |= PAGE_WATCH;
+    }
+    while (n++ != last);
+}
+
+// clears the watch flag from every page from lo to hi
+void debug_unflag_pages (pagetable* pt, uint32_t lo, uint32_t hi)
+{
+    uint32_t n = PAGE_NUMBER (lo), last = PAGE_NUMBER (hi);
+    page* p;
+
+    do
+    {
+        if ((p = pagetable_find (pt, n << PAGE_BITS)))
+            p->flags &= ~PAGE_WATCH;
+    }
+    while (n++ != last);
+}
+
+// passes a hit to the handler, or reports it if there isn't one
+// and remembers it if it stops the emulator
+int debug_hit (int event, uint32_t pc, uint32_t addr, int store, int action)
+{
+    action = handler ? handler (event, pc, addr, store, action)
+        : debug_report (event, pc, addr, store, action);
+
+    if (action == DEBUG_STOP)
+    {
+        stop_event = event;
+        stop_pc = pc;
+        stop_addr = addr;
+        stop_store = store;
+    }
+
+    return action;
+}
+
+// page table watcher, called for accesses to PAGE_WATCH pages
+void debug_watch_hit (uint32_t addr, int size, int store)
+{
+    watchpoint* w;
+    int i;
+
+    for (i = 0; i < watchpoint_count; i++)
+    {
+        w = &watchpoints[i];
+
+        if (addr > w->hi || addr + size - 1 < w->lo)
+            continue;
+
+        if (!(w->kinds & (store ? WATCH_WRITE : WATCH_READ)))
+            continue;
+
+        // the PC is already past the access
+        if (debug_hit (DEBUG_WATCH, registers[R_PC] - 4, addr, store, w->action) == DEBUG_STOP)
+            debug_stopping = 1;
+    }
+}
+
+// parses the action at the end of a script command
+// returns DEBUG_* or -1 if it's not an action
+int debug_parse_action (char* word)
+{
+    if (strcmp (word, "stop") == 0)
+        return DEBUG_STOP;
+
+    if (strcmp (word, "print") == 0)
+        return DEBUG_CONTINUE;
+
+    return -1;
+}
+
+// runs one script command, already split into words
+// returns 0 on success, -1 if it isn't valid
+int debug_command (pagetable* pt, char** words, int n)
+{
+    uint32_t addr, length = 4;
+    int i = 2, kinds = WATCH_WRITE, action = DEBUG_STOP;
+    char* end;
+
+    if (n < 2)
+        return -1;
+
+    addr = strtoul (words[1], &end, 0);
+
+    if (*end)
+        return -1;
+
+    if (strcmp (words[0], "break") == 0)
+    {
+        if (n > 3 || (n == 3 && (action = debug_parse_action (words[2])) < 0))
+            return -1;
+
+        return debug_break_add (pt, addr, action);
+    }
+
+    if (strcmp (words[0], "watch") != 0)
+        return -1;
+
+    // optional length
+    if (i < n && words[i][0] >= '0' && words[i][0] <= '9')
+    {
+        length = strtoul (words[i++], &end, 0);
+
+        if (*end || length == 0)
+            return -1;
+    }
+
+    // optional kind
+    if (i < n && debug_parse_action (words[i]) < 0)
+    {
+        if (strcmp (words[i], "read") == 0)
+            kinds = WATCH_READ;
+        else if (strcmp (words[i], "write") == 0)
+            kinds = WATCH_WRITE;
+        else if (strcmp (words[i], "access") == 0)
+            kinds = WATCH_ACCESS;
+        else
+            return -1;
+
+        i++;
+    }
+
+    // optional action
+    if (i < n && (action = debug_parse_action (words[i++])) < 0)
+        return -1;
+
+    if (i < n)
+        return -1;
+
+    return debug_watch_add (pt, addr, addr + length - 1, kinds, action);
+}
+
+// throws away the blocks decoded from the page holding addr
+void debug_code_changed (pagetable* pt, uint32_t addr)
+{
+    page* p = pagetable_find (pt, addr);
+
+    if (p)
+        pagetable_code_write (pt, p);
+}
+
+/* Breakpoints */
+
+// adds a breakpoint at addr, replacing any already there
+// returns 0 on success, -1 if there's insufficient memory
+int debug_break_add (pagetable* pt, uint32_t addr, int action)
+{
+    if (!breakpoints && !(breakpoints = hashtable_create ()))
+        return -1;
+
+    if (hashtable_search (breakpoints, addr))
+        hashtable_remove_node (breakpoints, addr);
+    else
+        breakpoint_count++;
+
+    if (hashtable_add_node (breakpoints, addr, action) != 0)
+    {
+        breakpoint_count--;
+        return -1;
+    }
+
+    // decoded blocks may run over it
+    debug_code_changed (pt, addr);
+
+    return 0;
+}
+
+// removes the breakpoint at addr
+// returns 0 on success, -1 if there's no breakpoint there
+int debug_break_remove (pagetable* pt, uint32_t addr)
+{
+    if (!breakpoints || !hashtable_search (breakpoints, addr))
+        return -1;
+
+    hashtable_remove_node (breakpoints, addr);
+    breakpoint_count--;
+
+    // blocks decoded around it can be joined up again
+    debug_code_changed (pt, addr);
+
+    return 0;
+}
+
+// returns 1 if there's a breakpoint at addr, 0 otherwise
+int debug_breakpoint_at (uint32_t addr)
+{
+    return breakpoint_count && hashtable_search (breakpoints, addr) != NULL;
+}
+
+// hits the breakpoint at addr, which is about to run
+// returns 1 if the emulator should stop before it, 0 otherwise
+int debug_break (uint32_t addr)
+{
+    node* n;
+
+    // resuming from this breakpoint?
+    if (break_resuming && addr == break_addr && retired == break_retired)
+    {
+        break_resuming = 0;
+        return 0;
+    }
+
+    if (!breakpoints || !(n = hashtable_search (breakpoints, addr)))
+        return 0;
+
+    if (debug_hit (DEBUG_BREAK, addr, addr, 0, n->data) != DEBUG_STOP)
+        return 0;
+
+    break_addr = addr;
+    break_retired = retired;
+    break_resuming = 1;
+
+    return 1;
+}
+
+/* Watchpoints */
+
+// watches kinds of access to lo to hi inclusive
+// returns 0 on success, -1 if there's insufficient memory
+int debug_watch_add (pagetable* pt, uint32_t lo, uint32_t hi, int kinds, int action)
+{
+    watchpoint* w;
+
+    if (hi < lo)
+        return -1;
+
+    w = realloc (watchpoints, (watchpoint_count + 1) * sizeof (watchpoint));
+
+    if (!w)
+        return -1;
+
+    watchpoints = w;
+    w = &watchpoints[watchpoint_count++];
+
+    w->lo = lo;
+    w->hi = hi;
+    w->kinds = kinds;
+    w->action = action;
+
+    debug_flag_pages (pt, lo, hi);
+    pt->watcher = debug_watch_hit;
+
+    return 0;
+}
+
+// stops watching lo to hi
+// returns 0 on success, -1 if there's no such watchpoint
+int debug_watch_remove (pagetable* pt, uint32_t lo, uint32_t hi)
+{
+    int i, j = 0, found = 0;
+
+    for (i = 0; i < watchpoint_count; i++)
+    {
+        if (watchpoints[i].lo == lo && watchpoints[i].hi == hi)
+            found = 1;
+        else
+            watchpoints[j++] = watchpoints[i];
+    }
+
+    if (!found)
+        return -1;
+
+    watchpoint_count = j;
+
+    // pages may still be covered by another watchpoint
+    debug_unflag_pages (pt, lo, hi);
+
+    for (i = 0; i < watchpoint_count; i++)
+        debug_flag_pages (pt, watchpoints[i].lo, watchpoints[i].hi);
+
+    return 0;
+}
+
+/* Handling */
+
+// sets the function called for each hit, NULL restores the default which
+// prints the hit and the registers
+void debug_set_handler (debug_handler h)
+{
+    handler = h;
+}
+
+// writes the breakpoint or watchpoint that last stopped the emulator,
+// and where, to stderr
+void debug_report_stop (void)
+{
+    if (stop_event == DEBUG_BREAK)
+        fprintf (stderr, "Stopped at the breakpoint at 0x%08X.\n", stop_pc);
+    else
+        fprintf (stderr, "Stopped by the watchpoint at 0x%08X, %s by 0x%08X.\n",
+            stop_addr, stop_store ? "written" : "read", stop_pc);
+}
+
+/* Scripts */
+
+// runs the commands in the script at path
+// returns 0 on success, -1 if it can't be read or has an invalid command
+int debug_script (pagetable* pt, char* path)
+{
+    char line[DEBUG_LINE_MAX];
+    char* words[8];
+    int n, number = 0;
+    FILE* fp = fopen (path, "r");
+
+    if (!fp)
+        return -1;
+
+    while (fgets (line, sizeof (line), fp))
+    {
+        number++;
+
+        // comments and blank lines
+        if ((words[0] = strchr (line, '#')))
+            *words[0] = '\0';
+
+        for (n = 0; n < 8 && (words[n] = strtok (n ? NULL : line, " \t\r\n")); n++)
+            ;
+
+        if (n == 0)
+            continue;
+
+        if (debug_command (pt, words, n) != 0)
+        {
+            fprintf (stderr, "%s:%d: invalid command %s\n", path, number, words[0]);
+            fclose (fp);
+            return -1;
+        }
+    }
+
+    fclose (fp);
+
+    return 0;
+}
+
+/* Clean up */
+
+// removes every breakpoint and watchpoint
+void debug_clear (pagetable* pt)
+{
+    int i;
+
+    for (i = 0; i < watchpoint_count; i++)
+        debug_unflag_pages (pt, watchpoints[i].lo, watchpoints[i].hi);
+
+    if (breakpoints)
+        hashtable_destroy (breakpoints);
+
+    free (watchpoints);
+
+    breakpoints = NULL;
+    breakpoint_count = 0;
+    watchpoints = NULL;
+    watchpoint_count = 0;
+    break_resuming = 0;
+    debug_stopping = 0;
+    pt->watcher = NULL;
+}
@@ -0,0 +1,64 @@
+/*
+ * ARM emulator
+ * Luke Mitchell
+ *
+ */
+
+#ifndef DEBUGGER_H
+#define DEBUGGER_H
+
+#include <stdint.h>
+#include "pagetable.h"
+
+/* What happens when a breakpoint or watchpoint is hit */
+#define DEBUG_CONTINUE  0 // report it and carry on
+#define DEBUG_STOP      1 // report it and stop, emulate() returns EMU_BREAK
+
+/* Accesses a watchpoint is hit by */
+#define WATCH_READ      0x01
+#define WATCH_WRITE     0x02
+#define WATCH_ACCESS    (WATCH_READ | WATCH_WRITE)
+
+/* Events passed to a handler */
+#define DEBUG_BREAK     0
+#define DEBUG_WATCH     1
+
+// a watched range of guest memory
+typedef struct {
+    uint32_t lo, hi;    // inclusive
+    int kinds;          // WATCH_*
+    int action;         // DEBUG_*
+} watchpoint;
+
+// called for each breakpoint or watchpoint hit, with the address of the
+// instruction and, for a watchpoint, the address accessed
+// returns DEBUG_STOP to stop or DEBUG_CONTINUE to carry on
+typedef int (*debug_handler) (int event, uint32_t pc, uint32_t addr, int store, int action);
+
+/* Set when a hit has asked the emulator to stop */
+extern int debug_stopping;
+
+/* Number of breakpoints, decoding only looks for them when there are some */
+extern int breakpoint_count;
+
+// breakpoints
+int     debug_break_add         (pagetable*, uint32_t addr, int action);
+int     debug_break_remove      (pagetable*, uint32_t addr);
+int     debug_breakpoint_at     (uint32_t addr);
+int     debug_break             (uint32_t addr);
+
+// watchpoints
+int     debug_watch_add         (pagetable*, uint32_t lo, uint32_t hi, int kinds, int action);
+int     debug_watch_remove      (pagetable*, uint32_t lo, uint32_t hi);
+
+// handling
+void    debug_set_handler       (debug_handler);
+void    debug_report_stop       (void);
+
+// scripts
+int     debug_script            (pagetable*, char* path);
+
+// clean up
+void    debug_clear             (pagetable*);
+
+#endif
@@ -0,0 +1,630 @@
+/*
+ * ARM emulator
+ * Luke Mitchell
+ *
+ */
+
+// Memory mapped devices
+//
+// A device is attached by tagging each page of its range PAGE_DEVICE and
+// pointing the page at it. The loads and stores already look the page
+// up, so they pass accesses to tagged pages on to the device's read and
+// write, and ordinary memory never checks for devices at all.
+//
+// Devices are attached with -device name@addr[=arg]:
+//
+//   uart@addr          reads stdin and writes stdout
+//   timer@addr[=line]  counts instructions retired, expiring on line
+//   intc@addr          masks and reports interrupt lines
+//   fb@addr[=file]     320x240 framebuffer, saved to file as a PPM at exit
+//   blk@addr=file      512 byte sectors of file, read and written on command
+//
+// Devices never poll. A timer schedules its expiry on the event queue, and
+// raises its interrupt line from there.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "device.h"
+#include "emu.h"
+#include "events.h"
+
+// uart state
+typedef struct {
+    FILE* in;
+    FILE* out;
+} uart_state;
+
+// timer state
+typedef struct {
+    uint32_t latched_hi;    // high word as of the last low word read
+    uint32_t load;
+    uint32_t control;
+    uint32_t status;
+    int line;
+    uint64_t due;           // clock value of the next expiry, while enabled
+} timer_state;
+
+// framebuffer state
+typedef struct {
+    char* path;
+    uint8_t pixels[FB_WIDTH * FB_HEIGHT * 4];
+} framebuffer_state;
+
+// block device state
+typedef struct {
+    int fd;
+    uint32_t sector;
+    uint32_t status;
+    uint32_t sectors;
+    uint8_t buffer[BLK_SECTOR_SIZE];
+} blockdev_state;
+
+/* Attached devices */
+device* devices[DEVICE_MAX];
+int device_count;
+
+/* Helper functions not exposed in header file */
+
+// reads size bytes, little endian, from mem
+uint32_t device_get_bytes (uint8_t* mem, int size)
+{
+    uint32_t value = 0;
+
+    while (size--)
+        value = (value << 8) | mem[size];
+
+    return value;
+}
+
+// writes the low size bytes of value, little endian, to mem
+void device_put_bytes (uint8_t* mem, uint32_t value, int size)
+{
+    int i;
+
+    for (i = 0; i < size; i++)
+        mem[i] = value >> (8 * i);
+}
+
+// returns a new device, with no state yet
+// returns NULL if there's insufficient memory
+device* device_create (const char* name, uint32_t base, uint32_t size, size_t state)
+{
+    device* dev = calloc (1, sizeof (device));
+
+    if (!dev)
+        return NULL;
+
+    if (!(dev->state = calloc (1, state)))
+    {
+        free (dev);
+        return NULL;
+    }
+
+    dev->name = name;
+    dev->base = base;
+    dev->size = size;
+
+    return dev;
+}
+
+// frees a device with no resources of its own
+void device_free (device* dev)
+{
+    free (dev->state);
+    free (dev);
+}
+
+// uart
+uint32_t uart_read (device* dev, uint32_t offset, int size)
+{
+    uart_state* s = dev->state;
+    struct pollfd pfd = { fileno (s->in), POLLIN, 0 };
+    int ready = poll (&pfd, 1, 0) > 0;
+    int c;
+
+    if (offset == UART_STATUS)
+        return UART_TX_READY | (ready ? UART_RX_READY : 0);
+
+    // nothing to receive reads as zero, rather than waiting
+    if (offset == UART_DATA && ready && (c = fgetc (s->in)) != EOF)
+        return c;
+
+    return 0;
+}
+
+void uart_write (device* dev, uint32_t offset, uint32_t value, int size)
+{
+    uart_state* s = dev->state;
+
+    if (offset == UART_DATA)
+        fputc (value & 0xFF, s->out);
+}
+
+// timer
+uint32_t timer_read (device* dev, uint32_t offset, int size)
+{
+    timer_state* s = dev->state;
+
+    if (offset == TIMER_COUNT)
+    {
+        s->latched_hi = retired >> 32;
+        return (uint32_t) retired;
+    }
+
+    switch (offset)
+    {
+        case TIMER_COUNT_HI:
+            return s->latched_hi;
+
+        case TIMER_LOAD:
+            return s->load;
+
+        case TIMER_CONTROL:
+            return s->control;
+
+        case TIMER_STATUS:
+            return s->status;
+    }
+
+    return 0;
+}
+
+// raises the timer's line while it's expired with interrupts enabled
+void timer_update_line (timer_state* s)
+{
+    if (s->status && (s->control & TIMER_IRQ))
+        irq_raise (s->line);
+    else
+        irq_lower (s->line);
+}
+
+// called from the event queue when the timer's due
+void timer_expire (void* arg)
+{
+    device* dev = arg;
+    timer_state* s = dev->state;
+
+    s->status = 1;
+
+    // a load of 0 written while running would be due again at once,
+    // forever, so it stops the timer as it would one-shot
+    if ((s->control & TIMER_PERIODIC) && s->load)
+    {
+        s->due += s->load;
+        event_schedule (s->due, timer_expire, dev);
+    }
+    else
+    {
+        s->control &= ~TIMER_ENABLE;
+    }
+
+    timer_update_line (s);
+}
+
+void timer_write (device* dev, uint32_t offset, uint32_t value, int size)
+{
+    timer_state* s = dev->state;
+
+    switch (offset)
+    {
+        case TIMER_LOAD:
+            s->load = value;
+            break;
+
+        // enabling starts a count of load from now
+        case TIMER_CONTROL:
+            event_cancel (timer_expire, dev);
+            s->control = value;
+
+            if ((value & TIMER_ENABLE) && s->load)
+            {
+                s->due = retired + s->load;
+                event_schedule (s->due, timer_expire, dev);
+            }
+            else
+            {
+                s->control &= ~TIMER_ENABLE;
+            }
+
+            timer_update_line (s);
+            break;
+
+        case TIMER_STATUS:
+            if (value & 1)
+                s->status = 0;
+
+            timer_update_line (s);
+            break;
+    }
+}
+
+void timer_destroy (device* dev)
+{
+    timer_state* s = dev->state;
+
+    event_cancel (timer_expire, dev);
+    irq_lower (s->line);
+    device_free (dev);
+}
+
+// interrupt controller
+uint32_t intc_read (device* dev, uint32_t offset, int size)
+{
+    switch (offset)
+    {
+        case INTC_STATUS:
+            return irq_lines & irq_mask;
+
+        case INTC_RAW:
+            return irq_lines;
+
+        case INTC_ENABLE:
+            return irq_mask;
+    }
+
+    return 0;
+}
+
+void intc_write (device* dev, uint32_t offset, uint32_t value, int size)
+{
+    if (offset == INTC_ENABLE)
+    {
+        irq_mask = value;
+        events_recheck ();
+    }
+}
+
+// without a controller every line reaches the CPU
+void intc_destroy (device* dev)
+{
+    irq_mask = 0xFFFFFFFF;
+    device_free (dev);
+}
+
+// framebuffer
+uint32_t framebuffer_read (device* dev, uint32_t offset, int size)
+{
+    framebuffer_state* s = dev->state;
+
+    if (offset + size > sizeof (s->pixels))
+        return 0;
+
+    return device_get_bytes (&s->pixels[offset], size);
+}
+
+void framebuffer_write (device* dev, uint32_t offset, uint32_t value, int size)
+{
+    framebuffer_state* s = dev->state;
+
+    if (offset + size <= sizeof (s->pixels))
+        device_put_bytes (&s->pixels[offset], value, size);
+}
+
+// saves the framebuffer as a binary PPM
+void framebuffer_destroy (device* dev)
+{
+    framebuffer_state* s = dev->state;
+    uint8_t* p;
+    FILE* fp;
+    int i;
+
+    if (s->path && (fp = fopen (s->path, "wb")))
+    {
+        fprintf (fp, "P6\n%d %d\n255\n", FB_WIDTH, FB_HEIGHT);
+
+        // 0x00RRGGBB, stored little endian
+        for (i = 0; i < FB_WIDTH * FB_HEIGHT; i++)
+        {
+            p = &s->pixels[4 * i];
+            fputc (p[2], fp);
+            fputc (p[1], fp);
+            fputc (p[0], fp);
+        }
+
+        fclose (fp);
+    }
+
+    device_free (dev);
+}
+
+// block device
+uint32_t blockdev_read (device* dev, uint32_t offset, int size)
+{
+    blockdev_state* s = dev->state;
+
+    if (offset >= BLK_BUFFER && offset + size <= BLK_BUFFER + BLK_SECTOR_SIZE)
+        return device_get_bytes (&s->buffer[offset - BLK_BUFFER], size);
+
+    switch (offset)
+    {
+        case BLK_SECTOR:
+            return s->sector;
+
+        case BLK_STATUS:
+            return s->status;
+
+        case BLK_SECTORS:
+            return s->sectors;
+    }
+
+    return 0;
+}
+
+void blockdev_write (device* dev, uint32_t offset, uint32_t value, int size)
+{
+    blockdev_state* s = dev->state;
+    off_t at = (off_t) s->sector * BLK_SECTOR_SIZE;
+    ssize_t n;
+
+    if (offset >= BLK_BUFFER && offset + size <= BLK_BUFFER + BLK_SECTOR_SIZE)
+    {
+        device_put_bytes (&s->buffer[offset - BLK_BUFFER], value, size);
+        return;
+    }
+
+    if (offset == BLK_SECTOR)
+    {
+        s->sector = value;
+        return;
+    }
+
+    if (offset != BLK_COMMAND)
+        return;
+
+    s->status = BLK_ERROR;
+
+    if (s->sector >= s->sectors)
+        return;
+
+    if (value == BLK_READ)
+        n = pread (s->fd, s->buffer, BLK_SECTOR_SIZE, at);
+    else if (value == BLK_WRITE)
+        n = pwrite (s->fd, s->buffer, BLK_SECTOR_SIZE, at);
+    else
+        return;
+
+    if (n == BLK_SECTOR_SIZE)
+        s->status = BLK_OK;
+}
+
+void blockdev_destroy (device* dev)
+{
+    blockdev_state* s = dev->state;
+
+    close (s->fd);
+    device_free (dev);
+}
+
+/* Attaching */
+
+// tags the pages of dev so accesses to them are passed to it
+// returns 0 on success, -1 if it overlaps another device or there's
+// insufficient memory
+int device_attach (pagetable* pt, device* dev)
+{
+    uint32_t n, first = PAGE_NUMBER (dev->base),
+        last = PAGE_NUMBER (dev->base + dev->size - 1);
+    page* p;
+
+    if (device_count == DEVICE_MAX || dev->size == 0 || last < first)
+        return -1;
+
+    for (n = first; n <= last && n >= first; n++)
+    {
+        p = pagetable_find (pt, n << PAGE_BITS);
+
+        if (p && (p->flags & PAGE_DEVICE))
+            return -1;
+    }
+
+    for (n = first; n <= last && n >= first; n++)
+    {
+        if (!(p = pagetable_get (pt, n << PAGE_BITS)))
+            return -1;
+
+        p->flags |= PAGE_DEVICE;
+        p->device = dev;
+    }
+
+    devices[device_count++] = dev;
+
+    return 0;
+}
+
+// creates and attaches the device described by spec, "name@addr[=arg]"
+// returns 0 on success, -1 if spec is invalid or the device can't be
+// created or attached
+int device_attach_spec (pagetable* pt, char* spec)
+{
+    char* at = strchr (spec, '@');
+    char* arg;
+    char* end;
+    uint32_t base, line = 0;
+    device* dev = NULL;
+
+    if (!at)
+        return -1;
+
+    *at++ = '\0';
+
+    if ((arg = strchr (at, '=')))
+        *arg++ = '\0';
+
+    base = strtoul (at, &end, 0);
+
+    if (*end)
+        return -1;
+
+    if (strcmp (spec, "uart") == 0)
+        dev = device_uart (base, stdin, stdout);
+    else if (strcmp (spec, "timer") == 0)
+    {
+        if (arg && ((line = strtoul (arg, &end, 0)) >= IRQ_LINES || *end))
+            return -1;
+
+        dev = device_timer (base, line);
+    }
+    else if (strcmp (spec, "intc") == 0)
+        dev = device_intc (base);
+    else if (strcmp (spec, "fb") == 0)
+        dev = device_framebuffer (base, arg);
+    else if (strcmp (spec, "blk") == 0 && arg)
+        dev = device_block (base, arg);
+
+    if (!dev)
+        return -1;
+
+    if (device_attach (pt, dev) != 0)
+    {
+        dev->destroy (dev);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Detaching */
+
+// untags every device's pages and destroys the devices
+void device_detach_all (pagetable* pt)
+{
+    uint32_t n, first, last;
+    device* dev;
+    page* p;
+    int i;
+
+    for (i = 0; i < device_count; i++)
+    {
+        dev = devices[i];
+        first = PAGE_NUMBER (dev->base);
+        last = PAGE_NUMBER (dev->base + dev->size - 1);
+
+        for (n = first; n <= last && n >= first; n++)
+        {
+            if ((p = pagetable_find (pt, n << PAGE_BITS)))
+            {
+                p->flags &= ~PAGE_DEVICE;
+                p->device = NULL;
+            }
+        }
+
+        dev->destroy (dev);
+    }
+
+    device_count = 0;
+}
+
+/* Devices */
+
+// returns a uart at base, receiving from in and transmitting to out
+// returns NULL if there's insufficient memory
+device* device_uart (uint32_t base, FILE* in, FILE* out)
+{
+    device* dev = device_create ("uart", base, PAGE_SIZE, sizeof (uart_state));
+    uart_state* s;
+
+    if (!dev)
+        return NULL;
+
+    s = dev->state;
+    s->in = in;
+    s->out = out;
+
+    dev->read = uart_read;
+    dev->write = uart_write;
+    dev->destroy = device_free;
+
+    return dev;
+}
+
+// returns a timer at base, raising interrupt line when it expires
+// returns NULL if there's insufficient memory
+device* device_timer (uint32_t base, int line)
+{
+    device* dev = device_create ("timer", base, PAGE_SIZE, sizeof (timer_state));
+
+    if (!dev)
+        return NULL;
+
+    ((timer_state*) dev->state)->line = line;
+
+    dev->read = timer_read;
+    dev->write = timer_write;
+    dev->destroy = timer_destroy;
+
+    return dev;
+}
+
+// returns an interrupt controller at base, with every line disabled
+// returns NULL if there's insufficient memory
+device* device_intc (uint32_t base)
+{
+    device* dev = device_create ("intc", base, PAGE_SIZE, 1);
+
+    if (!dev)
+        return NULL;
+
+    irq_mask = 0;
+
+    dev->read = intc_read;
+    dev->write = intc_write;
+    dev->destroy = intc_destroy;
+
+    return dev;
+}
+
+// returns a framebuffer at base, saved to path (if not NULL) when it's
+// destroyed
+// returns NULL if there's insufficient memory
+device* device_framebuffer (uint32_t base, char* path)
+{
+    device* dev = device_create ("fb", base, FB_WIDTH * FB_HEIGHT * 4,
+        sizeof (framebuffer_state));
+
+    if (!dev)
+        return NULL;
+
+    ((framebuffer_state*) dev->state)->path = path;
+
+    dev->read = framebuffer_read;
+    dev->write = framebuffer_write;
+    dev->destroy = framebuffer_destroy;
+
+    return dev;
+}
+
+// returns a block device at base, backed by the file at path
+// returns NULL if path can't be opened or there's insufficient memory
+device* device_block (uint32_t base, char* path)
+{
+    device* dev;
+    blockdev_state* s;
+    struct stat st;
+    int fd = open (path, O_RDWR);
+
+    if (fd < 0)
+        return NULL;
+
+    if (fstat (fd, &st) != 0
+        || !(dev = device_create ("blk", base, PAGE_SIZE, sizeof (blockdev_state))))
+    {
+        close (fd);
+        return NULL;
+    }
+
+    s = dev->state;
+    s->fd = fd;
+    s->sectors = st.st_size / BLK_SECTOR_SIZE;
+
+    dev->read = blockdev_read;
+    dev->write = blockdev_write;
+    dev->destroy = blockdev_destroy;
+
+    return dev;
+}
@@ -0,0 +1,81 @@
+/*
+ * ARM emulator
+ * Luke Mitchell
+ *
+ */
+
+#ifndef DEVICE_H
+#define DEVICE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "pagetable.h"
+
+/* Most devices attached at once */
+#define DEVICE_MAX 16
+
+/* UART registers */
+#define UART_DATA       0x00 // write to transmit, read to receive
+#define UART_STATUS     0x04 // UART_RX_READY | UART_TX_READY
+#define UART_RX_READY   0x01
+#define UART_TX_READY   0x02
+
+/* Timer registers, counting instructions retired */
+#define TIMER_COUNT     0x00 // low word
+#define TIMER_COUNT_HI  0x04 // high word, as of the last read of the low word
+#define TIMER_LOAD      0x08 // instructions between expiries
+#define TIMER_CONTROL   0x0C // TIMER_ENABLE | TIMER_PERIODIC | TIMER_IRQ
+#define TIMER_STATUS    0x10 // 1 once expired, write 1 to clear
+#define TIMER_ENABLE    0x01
+#define TIMER_PERIODIC  0x02 // reload on expiry, rather than disabling
+#define TIMER_IRQ       0x04 // raise the timer's line while expired
+
+/* Interrupt controller registers */
+#define INTC_STATUS     0x00 // raised lines that are enabled
+#define INTC_RAW        0x04 // raised lines
+#define INTC_ENABLE     0x08 // lines passed on to the CPU
+
+/* Framebuffer geometry, 32-bit 0x00RRGGBB pixels */
+#define FB_WIDTH        320
+#define FB_HEIGHT       240
+
+/* Block device registers */
+#define BLK_SECTOR      0x00 // sector for the next command
+#define BLK_COMMAND     0x04 // write BLK_READ or BLK_WRITE to run a command
+#define BLK_STATUS      0x08 // BLK_OK or BLK_ERROR, for the last command
+#define BLK_SECTORS     0x0C // sectors in the backing file
+#define BLK_BUFFER      0x200 // BLK_SECTOR_SIZE bytes, read into or written from
+#define BLK_SECTOR_SIZE 512
+#define BLK_READ        1
+#define BLK_WRITE       2
+#define BLK_OK          0
+#define BLK_ERROR       1
+
+// a memory mapped device
+// accesses to its pages are passed to read and write, with the offset
+// from base and the size of the access in bytes
+typedef struct device {
+    const char* name;
+    uint32_t base;
+    uint32_t size;
+    uint32_t (*read) (struct device*, uint32_t offset, int size);
+    void (*write) (struct device*, uint32_t offset, uint32_t value, int size);
+    void (*destroy) (struct device*);
+    void* state;
+} device;
+
+// attaching
+int         device_attach           (pagetable*, device*);
+int         device_attach_spec      (pagetable*, char* spec);
+
+// detaching
+void        device_detach_all       (pagetable*);
+
+// devices
+device*     device_uart             (uint32_t base, FILE* in, FILE* out);
+device*     device_timer            (uint32_t base, int line);
+device*     device_intc             (uint32_t base);
+device*     device_framebuffer      (uint32_t base, char* path);
+device*     device_block            (uint32_t base, char* path);
+
+#endif
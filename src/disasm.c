@@ -0,0 +1,473 @@
+/*
+ * ARM emulator
+ * Luke Mitchell
+ *
+ */
+
+// Disassembler
+//
+// Instructions are written as text into a buffer supplied by the caller.
+// Nothing is allocated, no stdio is used and no emulator state is read,
+// so any number of threads may disassemble at once. Output that doesn't
+// fit is truncated, and the buffer is always terminated.
+
+#include <stdint.h>
+#include "disasm.h"
+#include "common.h"
+#include "instructions.h"
+
+// text being built in a caller's buffer
+typedef struct {
+    char* buffer;
+    int size;
+    int len;
+} text;
+
+/* Helper functions not exposed in header file */
+
+// appends a character, if there's room for it and the terminator
+void put_char (text* t, char c)
+{
+    if (t->len < t->size - 1)
+        t->buffer[t->len++] = c;
+}
+
+// appends a string
+void put_str (text* t, const char* s)
+{
+    while (*s)
+        put_char (t, *s++);
+}
+
+// appends an unsigned decimal number
+void put_unsigned (text* t, uint32_t value)
+{
+    char digits[10];
+    int n = 0;
+
+    do
+    {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+
+    while (n)
+        put_char (t, digits[--n]);
+}
+
+// appends a 32-bit value as 0x followed by eight hex digits
+void put_hex (text* t, uint32_t value)
+{
+    int i;
+
+    put_str (t, "0x");
+
+    for (i = 28; i >= 0; i -= 4)
+        put_char (t, "0123456789ABCDEF"[(value >> i) & 0xF]);
+}
+
+// appends a rotated immediate, which is unsigned, in decimal while it's
+// short and in hex once it isn't
+void put_imm (text* t, uint32_t value)
+{
+    if (value > 0xFFFF)
+        put_hex (t, value);
+    else
+        put_unsigned (t, value);
+}
+
+// appends a register name
+void put_reg (text* t, uint8_t r)
+{
+    put_char (t, 'R');
+    put_unsigned (t, r);
+}
+
+// appends the shifted register operand in bits 0 to 11
+void put_shifted_reg (text* t, uint32_t instr)
+{
+    static const char* shifts[] = { "LSL", "LSR", "ASR", "ROR" };
+    uint8_t type = get_bits (instr, 5, 2), amount = get_bits (instr, 7, 5);
+
+    put_reg (t, get_bits (instr, 0, 4));
+
+    // shifted by a register
+    if (get_bit (instr, 4))
+    {
+        put_str (t, ", ");
+        put_str (t, shifts[type]);
+        put_char (t, ' ');
+        put_reg (t, get_bits (instr, 8, 4));
+        return;
+    }
+
+    // LSL #0 is no shift, and ROR #0 is RRX
+    if (amount == 0 && type == 0)
+        return;
+
+    if (amount == 0 && type == 3)
+    {
+        put_str (t, ", RRX");
+        return;
+    }
+
+    // LSR and ASR #0 mean a shift of 32
+    put_str (t, ", ");
+    put_str (t, shifts[type]);
+    put_str (t, " #");
+    put_unsigned (t, amount ? amount : 32);
+}
+
+// appends an MRS or MSR instruction
+void put_psr (text* t, uint32_t instr)
+{
+    const char* psr = get_bit (instr, 22) ? "SPSR" : "CPSR";
+    uint32_t imm;
+    int i;
+
+    // MRS
+    if (!get_bit (instr, 21))
+    {
+        put_str (t, "MRS");
+        put_str (t, cond_to_string (get_cond (instr)));
+        put_char (t, ' ');
+        put_reg (t, get_bits (instr, 12, 4));
+        put_str (t, ", ");
+        put_str (t, psr);
+        return;
+    }
+
+    put_str (t, "MSR");
+    put_str (t, cond_to_string (get_cond (instr)));
+    put_char (t, ' ');
+    put_str (t, psr);
+
+    // the fields written, bits 19 to 16 are flags, status, extension, control
+    if (get_bits (instr, 16, 4))
+        put_char (t, '_');
+
+    for (i = 3; i >= 0; i--)
+        if (get_bit (instr, 16 + i))
+            put_char (t, "cxsf"[i]);
+
+    put_str (t, ", ");
+
+    if (get_bit (instr, 25))
+    {
+        imm = get_bits (instr, 0, 12);
+        put_char (t, '#');
+        put_hex (t, rotate_right (2 * (imm >> 8), imm & 0xFF));
+    }
+    else
+    {
+        put_reg (t, get_bits (instr, 0, 4));
+    }
+}
+
+// appends a data processing instruction
+void put_dp (text* t, uint32_t instr)
+{
+    uint8_t opcode = get_bits (instr, 21, 4), s = get_bit (instr, 20),
+        rn = get_bits (instr, 16, 4), rd = get_bits (instr, 12, 4);
+    uint32_t imm;
+
+    // MRS and MSR take the encodings of comparisons that don't set the flags
+    if ((instr & 0x0FBF0FFF) == 0x010F0000 || (instr & 0x0FB0FFF0) == 0x0120F000
+        || (instr & 0x0FB0F000) == 0x0320F000)
+    {
+        put_psr (t, instr);
+        return;
+    }
+
+    put_str (t, opcode_to_string (opcode));
+    put_str (t, cond_to_string (get_cond (instr)));
+
+    // comparisons always set the flags, and have no destination
+    if (opcode >= 8 && opcode <= 11)
+    {
+        put_char (t, ' ');
+        put_reg (t, rn);
+    }
+    else
+    {
+        if (s)
+            put_char (t, 'S');
+
+        put_char (t, ' ');
+        put_reg (t, rd);
+
+        // moves have no first operand
+        if (opcode != OP_MOV && opcode != 15)
+        {
+            put_str (t, ", ");
+            put_reg (t, rn);
+        }
+    }
+
+    put_str (t, ", ");
+
+    if (get_bit (instr, 25))
+    {
+        imm = get_bits (instr, 0, 12);
+        put_char (t, '#');
+        put_imm (t, rotate_right (2 * (imm >> 8), imm & 0xFF));
+    }
+    else
+    {
+        put_shifted_reg (t, instr);
+    }
+}
+
+// appends a multiply instruction
+void put_mul (text* t, uint32_t instr)
+{
+    uint8_t a = get_bit (instr, 21);
+
+    put_str (t, a ? "MLA" : "MUL");
+    put_str (t, cond_to_string (get_cond (instr)));
+
+    if (get_bit (instr, 20))
+        put_char (t, 'S');
+
+    put_char (t, ' ');
+    put_reg (t, get_bits (instr, 16, 4));
+    put_str (t, ", ");
+    put_reg (t, get_bits (instr, 0, 4));
+    put_str (t, ", ");
+    put_reg (t, get_bits (instr, 8, 4));
+
+    if (a)
+    {
+        put_str (t, ", ");
+        put_reg (t, get_bits (instr, 12, 4));
+    }
+}
+
+// appends a branch, with its target worked out from addr
+void put_branch (text* t, uint32_t addr, uint32_t instr)
+{
+    int32_t offset = (int32_t) (get_bits (instr, 0, 24) << 8) >> 6;
+
+    put_char (t, 'B');
+
+    if (get_bit (instr, 24))
+        put_char (t, 'L');
+
+    put_str (t, cond_to_string (get_cond (instr)));
+    put_char (t, ' ');
+
+    // the PC reads 8 bytes ahead
+    put_hex (t, addr + 8 + offset);
+}
+
+// appends a load or store
+void put_ls (text* t, uint32_t instr)
+{
+    uint8_t p = get_bit (instr, 24), u = get_bit (instr, 23), w = get_bit (instr, 21);
+    uint32_t offset = get_bits (instr, 0, 12);
+
+    put_str (t, get_bit (instr, 20) ? "LDR" : "STR");
+    put_str (t, cond_to_string (get_cond (instr)));
+
+    if (get_bit (instr, 22))
+        put_char (t, 'B');
+
+    put_char (t, ' ');
+    put_reg (t, get_bits (instr, 12, 4));
+    put_str (t, ", [");
+    put_reg (t, get_bits (instr, 16, 4));
+
+    // post-indexed offsets follow the brackets
+    if (!p)
+        put_char (t, ']');
+
+    if (get_bit (instr, 25))
+    {
+        put_str (t, u ? ", " : ", -");
+        put_shifted_reg (t, instr);
+    }
+    else if (offset || !p)
+    {
+        put_str (t, u ? ", #" : ", #-");
+        put_unsigned (t, offset);
+    }
+
+    if (p)
+        put_str (t, w ? "]!" : "]");
+}
+
+// appends a halfword or signed byte load or store
+void put_lsh (text* t, uint32_t instr)
+{
+    static const char* sizes[] = { "", "H", "SB", "SH" };
+    uint8_t p = get_bit (instr, 24), u = get_bit (instr, 23), w = get_bit (instr, 21);
+    uint32_t offset = (get_bits (instr, 8, 4) << 4) | get_bits (instr, 0, 4);
+
+    put_str (t, get_bit (instr, 20) ? "LDR" : "STR");
+    put_str (t, cond_to_string (get_cond (instr)));
+    put_str (t, sizes[get_bits (instr, 5, 2)]);
+    put_char (t, ' ');
+    put_reg (t, get_bits (instr, 12, 4));
+    put_str (t, ", [");
+    put_reg (t, get_bits (instr, 16, 4));
+
+    // post-indexed offsets follow the brackets
+    if (!p)
+        put_char (t, ']');
+
+    if (!get_bit (instr, 22))
+    {
+        put_str (t, u ? ", " : ", -");
+        put_reg (t, get_bits (instr, 0, 4));
+    }
+    else if (offset || !p)
+    {
+        put_str (t, u ? ", #" : ", #-");
+        put_unsigned (t, offset);
+    }
+
+    if (p)
+        put_str (t, w ? "]!" : "]");
+}
+
+// appends a load or store multiple, with its registers listed in full
+void put_lsm (text* t, uint32_t instr)
+{
+    static const char* modes[] = { "DA", "IA", "DB", "IB" };
+    int r, first = 1;
+
+    put_str (t, get_bit (instr, 20) ? "LDM" : "STM");
+    put_str (t, cond_to_string (get_cond (instr)));
+    put_str (t, modes[get_bits (instr, 23, 2)]);
+    put_char (t, ' ');
+    put_reg (t, get_bits (instr, 16, 4));
+
+    if (get_bit (instr, 21))
+        put_char (t, '!');
+
+    put_str (t, ", {");
+
+    for (r = 0; r < 16; r++)
+    {
+        if (get_bit (instr, r))
+        {
+            if (!first)
+                put_str (t, ", ");
+
+            put_reg (t, r);
+            first = 0;
+        }
+    }
+
+    put_char (t, '}');
+
+    // user mode registers, or a return restoring the CPSR
+    if (get_bit (instr, 22))
+        put_char (t, '^');
+}
+
+/* Disassembly */
+
+// writes the disassembly of instr, found at addr, to buffer
+// at most size bytes are written, including the terminator
+// returns the length of the text written
+int instr_to_string (uint32_t addr, uint32_t instr, char* buffer, int size)
+{
+    text t = { buffer, size, 0 };
+
+    if (size <= 0)
+        return 0;
+
+    switch (get_instruction_type (instr))
+    {
+        case INSTR_DP:
+            put_dp (&t, instr);
+            break;
+
+        case INSTR_MUL:
+            put_mul (&t, instr);
+            break;
+
+        case INSTR_B:
+            put_branch (&t, addr, instr);
+            break;
+
+        case INSTR_LS:
+            put_ls (&t, instr);
+            break;
+
+        case INSTR_LSM:
+            put_lsm (&t, instr);
+            break;
+
+        case INSTR_LSH:
+            put_lsh (&t, instr);
+            break;
+
+        case INSTR_SWI:
+            put_str (&t, "SVC");
+            put_str (&t, cond_to_string (get_cond (instr)));
+            put_char (&t, ' ');
+            put_unsigned (&t, get_bits (instr, 0, 24));
+            break;
+
+        default:
+            put_str (&t, ".word ");
+            put_hex (&t, instr);
+            break;
+    }
+
+    buffer[t.len] = '\0';
+
+    return t.len;
+}
+
+// writes a line of a listing to buffer: the address, the
+// instruction word and its disassembly, and a newline
+// at most size bytes are written, including the terminator
+// returns the length of the text written
+int disasm_line (uint32_t addr, uint32_t instr, char* buffer, int size)
+{
+    text t = { buffer, size, 0 };
+
+    if (size <= 0)
+        return 0;
+
+    put_hex (&t, addr);
+    put_char (&t, ' ');
+    put_hex (&t, instr);
+    put_char (&t, ' ');
+
+    if (t.len < size - 1)
+        t.len += instr_to_string (addr, instr, buffer + t.len, size - t.len);
+
+    put_char (&t, '\n');
+    buffer[t.len] = '\0';
+
+    return t.len;
+}
+
+/* Mnemonics */
+
+// returns the mnemonic of a data processing opcode
+const char* opcode_to_string (uint8_t opcode)
+{
+    static const char* names[] = {
+        "AND", "EOR", "SUB", "RSB", "ADD", "ADC", "SBC", "RSC",
+        "TST", "TEQ", "CMP", "CMN", "ORR", "MOV", "BIC", "MVN"
+    };
+
+    return names[opcode & 0xF];
+}
+
+// returns the suffix of a condition code
+// AL is left blank, as it's the default
+const char* cond_to_string (uint8_t cond)
+{
+    static const char* names[] = {
+        "EQ", "NE", "CS", "CC", "MI", "PL", "VS", "VC",
+        "HI", "LS", "GE", "LT", "GT", "LE", "", "NV"
+    };
+
+    return names[cond & 0xF];
+}
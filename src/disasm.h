@@ -0,0 +1,26 @@
+/*
+ * ARM emulator
+ * Luke Mitchell
+ *
+ */
+
+#ifndef DISASM_H
+#define DISASM_H
+
+#include <stdint.h>
+
+/* Buffer size that holds any disassembled instruction */
+#define DISASM_MAX 64
+
+/* Buffer size that holds any line of disasm_line */
+#define DISASM_LINE_MAX (DISASM_MAX + 32)
+
+// disassembly
+int instr_to_string (uint32_t addr, uint32_t instr, char* buffer, int size);
+int disasm_line (uint32_t addr, uint32_t instr, char* buffer, int size);
+
+// mnemonics
+const char* opcode_to_string (uint8_t opcode);
+const char* cond_to_string (uint8_t cond);
+
+#endif
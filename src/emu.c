@@ -7,11 +7,29 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdlib.h>
 #include <limits.h>
+#include <unistd.h>
+#include "emu.h"
 #include "io.h"
 #include "instructions.h"
-#include "hash.h"
+#include "pagetable.h"
 #include "common.h"
+#include "image.h"
+#include "serve.h"
+#include "trace.h"
+#include "block.h"
+#include "profile.h"
+#include "callstack.h"
+#include "metrics.h"
+#include "plugin.h"
+#include "timing.h"
+#include "cachesim.h"
+#include "memprof.h"
+#include "debugger.h"
+#include "device.h"
+#include "events.h"
+#include "semihost.h"
 
 /*
  * Global variables
@@ -24,8 +42,111 @@ uint32_t registers[16];
 /* Flags - N Z C V */
 uint8_t flags[4];
 
-/* Main memory - in 1 byte increments */
-hashtable* memory;
+/* Main memory - in pages of PAGE_SIZE bytes */
+pagetable* memory;
+
+/* Instructions retired since start-up */
+uint64_t retired;
+
+/* Mode and IRQ disable bit of the CPSR, reset leaves IRQs disabled */
+uint8_t cpu_mode = MODE_SVC;
+uint8_t irq_disabled = 1;
+
+/* Saved CPSR of IRQ mode */
+uint32_t spsr_irq;
+
+/* Blocks kept between runs, used by emulate in place of a new cache */
+blockcache* warm_blocks;
+
+/* R13 and R14 of whichever of IRQ mode and the other modes isn't live */
+uint32_t banked_registers[2];
+
+/*
+ * Status register functions
+ *
+ */
+
+// returns the CPSR, built from the flags, IRQ disable bit and mode
+uint32_t cpsr_read (void)
+{
+    return (flags[F_N] << 31) | (flags[F_Z] << 30) | (flags[F_C] << 29) | (flags[F_V] << 28)
+        | (irq_disabled ? CPSR_I : 0) | cpu_mode;
+}
+
+// changes mode, swapping R13 and R14 on entering or leaving IRQ mode
+void mode_set (uint8_t mode)
+{
+    uint32_t r;
+    int i;
+
+    if ((mode == MODE_IRQ) != (cpu_mode == MODE_IRQ))
+    {
+        for (i = 0; i < 2; i++)
+        {
+            r = registers[R_SP + i];
+            registers[R_SP + i] = banked_registers[i];
+            banked_registers[i] = r;
+        }
+    }
+
+    cpu_mode = mode;
+}
+
+// writes the CPSR fields selected by mask, the flags in the top byte
+// and the IRQ disable bit and mode in the bottom one
+void cpsr_write (uint32_t value, uint32_t mask)
+{
+    value &= mask;
+
+    if (mask & 0xFF000000)
+    {
+        flags[F_N] = (value >> 31) & 1;
+        flags[F_Z] = (value >> 30) & 1;
+        flags[F_C] = (value >> 29) & 1;
+        flags[F_V] = (value >> 28) & 1;
+    }
+
+    if (mask & 0x000000FF)
+    {
+        mode_set ((value & 0x1F) | MODE_USR);
+
+        // a waiting interrupt may now be taken
+        if (irq_disabled && !(value & CPSR_I))
+            events_recheck ();
+
+        irq_disabled = (value & CPSR_I) != 0;
+    }
+}
+
+// takes an IRQ, between blocks with the PC at the next instruction to run
+void irq_enter (void)
+{
+    uint32_t cpsr = cpsr_read ();
+
+    mode_set (MODE_IRQ);
+    spsr_irq = cpsr;
+    irq_disabled = 1;
+
+    // the handler returns with SUBS PC, LR, #4
+    registers[R_LR] = registers[R_PC] + 4;
+    registers[R_PC] = VECTOR_IRQ;
+}
+
+// returns from an exception by restoring the CPSR saved on entry
+void exception_return (void)
+{
+    if (cpu_mode == MODE_IRQ)
+        cpsr_write (spsr_irq, 0xFF0000FF);
+}
+
+// runs the events due and takes an IRQ if one is waiting and enabled
+void events_take (void)
+{
+    events_run (retired);
+
+    if (!irq_disabled && irq_asserted ())
+        irq_enter ();
+}
 
 /*
  * Data processing decoding functions
@@ -144,6 +265,49 @@ uint32_t shift_operand (uint32_t instruction)
     }
 }
 
+// decodes MRS and MSR, which are encoded as the compares without S
+// bit 22 picks the SPSR over the CPSR and bit 21 a write over a read
+void decode_psr (uint32_t instruction, uint32_t operand)
+{
+    uint32_t mask = 0;
+    uint8_t spsr = get_bit (instruction, 22);
+
+    if (!condition_passed (flags, get_cond (instruction)))
+        return;
+
+    // MRS
+    if (!get_bit (instruction, 21))
+    {
+        registers[get_bits (instruction, 12, 4)] =
+            (spsr && cpu_mode == MODE_IRQ) ? spsr_irq : cpsr_read ();
+        return;
+    }
+
+    // MSR, the field mask picks the control and flags bytes
+    if (get_bit (instruction, 16))
+        mask |= 0x000000FF;
+
+    if (get_bit (instruction, 19))
+        mask |= 0xFF000000;
+
+    if (!get_bit (instruction, 25))
+        operand = registers[get_bits (instruction, 0, 4)];
+
+    if (spsr)
+    {
+        if (cpu_mode == MODE_IRQ)
+            spsr_irq = (spsr_irq & ~mask) | (operand & mask);
+
+        return;
+    }
+
+    // user mode can only change the flags
+    if (cpu_mode == MODE_USR)
+        mask &= 0xFF000000;
+
+    cpsr_write (operand, mask);
+}
+
 // decodes the data processing instructions
 void decode_dp (uint32_t instruction)
 {
@@ -156,6 +320,14 @@ void decode_dp (uint32_t instruction)
         // update?
         s = get_bit (instruction, 20);
 
+        // TST, TEQ, CMP and CMN without S are the status register moves
+        if (!s && (op & 0xC) == 0x8)
+        {
+            decode_psr (instruction, get_bit (instruction, 25)
+                ? rotate_right (2 * get_bits (instruction, 8, 4), instruction & 0xFF) : 0);
+            return;
+        }
+
         // get Rn and Rd
         rn = get_bits (instruction, 16, 4);
         rd = get_bits (instruction, 12, 4);
@@ -184,6 +356,10 @@ void decode_dp (uint32_t instruction)
         {
             // do the damn thing!
             execute_dp_instruction (op, cond, s, rn, rd, operand);
+
+            // writing the PC with S returns from an exception
+            if (s && rd == R_PC && op != OP_CMP)
+                exception_return ();
         }
 }
 
@@ -263,8 +439,9 @@ void decode_branch (uint32_t instruction)
     // EXECUTE
     if (condition_passed (flags, cond))
     {
+        // the PC has already moved past the BL
         if (l)
-            registers[R_LR] = registers[R_PC] + 4;
+            registers[R_LR] = registers[R_PC];
 
         // add 4 to generate correct address
         // this seemes to work but it wasn't present in ARM ARM
@@ -277,38 +454,64 @@ void decode_branch (uint32_t instruction)
  *
  */
 
-// decodes the LDR/STR instructions
-void decode_ls (uint32_t instruction)
+// returns the offset of a load or store, the immediate in bits 0 to 11,
+// or when I is set, the register in bits 0 to 3 shifted by the amount
+// in bits 7 to 11 with the shift type in bits 5 and 6
+uint32_t ls_offset (uint32_t instruction)
+{
+    uint8_t rm = get_bits (instruction, 0, 4), amount = get_bits (instruction, 7, 5);
+    uint32_t val;
+
+    if (!get_bit (instruction, 25))
+        return get_bits (instruction, 0, 12);
+
+    // the PC reads 8 bytes ahead, and has already moved past this by 4
+    val = (rm == R_PC) ? registers[R_PC] + 4 : registers[rm];
+
+    switch (get_bits (instruction, 5, 2))
+    {
+        // LSL
+        case 0:
+            return val << amount;
+
+        // LSR and ASR #0 mean a shift of 32
+        case 1:
+            return amount ? val >> amount : 0;
+
+        case 2:
+            return (uint32_t) ((int32_t) val >> (amount ? amount : 31));
+
+        // ROR #0 is RRX
+        default:
+            return amount ? rotate_right (amount, val)
+                : ((uint32_t) flags[F_C] << 31) | (val >> 1);
+    }
+}
+
+// decodes the LDR/STR/LDRB/STRB instructions
+// returns 1 if a watchpoint stopped the emulator
+// returns 0 otherwise
+int decode_ls (uint32_t instruction)
 {
     uint32_t addr = 0, offset;
-    uint8_t rn, rd, cond, i, p, u, b, w, l,
-        shift;
+    uint8_t rn, rd, cond, p, u, b, w, l;
 
     cond = get_cond (instruction);
     rn = get_bits (instruction, 16, 4);
     rd = get_bits (instruction, 12, 4);
 
-    i = get_bit (instruction, 25);
     p = get_bit (instruction, 24);
     u = get_bit (instruction, 23);
     b = get_bit (instruction, 22);
     w = get_bit (instruction, 21);
     l = get_bit (instruction, 20);
 
+    // immediate, or scaled register
+    offset = ls_offset (instruction);
+
     // Offset
     if (p && !w)
     {
-        offset = get_bits (instruction, 0, 12);
-
-        // register?
-        if (i)
-        {
-            if (offset == R_PC)
-                offset = registers[R_PC] + 8;
-            else
-                offset = registers[offset];
-        }
-
         // add/sub?
         if (u)
             addr = registers[rn] + offset;
@@ -316,17 +519,9 @@ void decode_ls (uint32_t instruction)
             addr = registers[rn] - offset;
     }
 
-    // Scaled register offset
-    // TODO - how do I distinguish this from Offset? 
-
     // Pre-indexed
     if (p && w)
     {
-        offset = get_bits (instruction, 0, 12);
-
-        if (i)
-            offset = registers[offset];
-
         if (u)
             addr = registers[rn] + offset;
         else
@@ -336,44 +531,260 @@ void decode_ls (uint32_t instruction)
             registers[rn] = addr;
     }
 
-    // Scaled pre-indexed
-    // TODO - how do I distinguish this from Pre-indexed?
-
     // Post-indexed
     if (!p && !w)
     {
-        offset = get_bits (instruction, 0, 12);
-        addr = rn;
+        addr = registers[rn];
 
         if (condition_passed (flags, cond))
         {
             if (u)
-                rn = rn + offset;
+                registers[rn] = addr + offset;
             else
-                rn = rn - offset;
+                registers[rn] = addr - offset;
         }
     }
 
-    // Scaled register post-indexed
-    // TODO
+    // tell the plugins, before memory changes
+    if (hook_memory)
+    {
+        hook_memory = 0;
+
+        if (condition_passed (flags, cond))
+            plugin_event (EMU_EVENT_MEMORY, registers[R_PC] - 4, addr, !l);
+    }
 
     // EXECUTE
     if (condition_passed (flags, cond))
     {
+        if (dcache)
+            cachesim_access (dcache, registers[R_PC] - 4, addr);
+
+        if (memprof_recording)
+            memprof_access (registers[R_PC] - 4, addr, !l);
+
         // TODO - there looks like there may be a rotation here
         // if CP15_reg1_Ubit == 0 (what is that?!)
         if (l)
         {
-            registers[rd] = load32 (memory, addr);
+            registers[rd] = b ? load8 (memory, addr) : load32 (memory, addr);
 
             if (rd == R_PC)
                 registers[R_PC] &= 0xFFFFFFFC;
         }
+        else if (b)
+        {
+            store8 (memory, addr, registers[rd]);
+        }
         else
         {
-            store (memory, addr, 4, &rd);
+            // the PC is stored 8 bytes ahead, as it's read
+            store32 (memory, addr, (rd == R_PC) ? registers[R_PC] + 4 : registers[rd]);
         }
     }
+
+    return debug_stopping;
+}
+
+// decodes the LDRH/STRH/LDRSB/LDRSH instructions
+// returns 1 if a watchpoint stopped the emulator
+// returns 0 otherwise
+int decode_lsh (uint32_t instruction)
+{
+    uint32_t addr, base, offset;
+    uint8_t rn, rd, sh, p, u, w, l;
+
+    rn = get_bits (instruction, 16, 4);
+    rd = get_bits (instruction, 12, 4);
+
+    // 1 for H, 2 for SB and 3 for SH
+    sh = get_bits (instruction, 5, 2);
+
+    p = get_bit (instruction, 24);
+    u = get_bit (instruction, 23);
+    w = get_bit (instruction, 21);
+    l = get_bit (instruction, 20);
+
+    if (!condition_passed (flags, get_cond (instruction)))
+    {
+        hook_memory = 0;
+        return 0;
+    }
+
+    // an immediate split either side of the SH bits, or Rm
+    if (get_bit (instruction, 22))
+        offset = (get_bits (instruction, 8, 4) << 4) | get_bits (instruction, 0, 4);
+    else
+        offset = registers[get_bits (instruction, 0, 4)];
+
+    base = registers[rn];
+    offset = u ? base + offset : base - offset;
+
+    // pre-indexed uses the new base, post-indexed the old one
+    addr = p ? offset : base;
+
+    if (!p || w)
+        registers[rn] = offset;
+
+    // tell the plugins, before memory changes
+    if (hook_memory)
+    {
+        hook_memory = 0;
+        plugin_event (EMU_EVENT_MEMORY, registers[R_PC] - 4, addr, !l);
+    }
+
+    if (dcache)
+        cachesim_access (dcache, registers[R_PC] - 4, addr);
+
+    if (memprof_recording)
+        memprof_access (registers[R_PC] - 4, addr, !l);
+
+    if (l)
+    {
+        switch (sh)
+        {
+            case 1:
+                registers[rd] = load16 (memory, addr);
+                break;
+
+            case 2:
+                registers[rd] = (int8_t) load8 (memory, addr);
+                break;
+
+            case 3:
+                registers[rd] = (int16_t) load16 (memory, addr);
+                break;
+        }
+    }
+    else if (sh == 1)
+    {
+        store16 (memory, addr, registers[rd]);
+    }
+
+    return debug_stopping;
+}
+
+/*
+ * Load/Store multiple decoding functions
+ *
+ */
+
+// decodes the LDM/STM instructions
+// the registers are moved as one run of memory, so each page it
+// covers is only looked up once
+// returns 1 if a watchpoint stopped the emulator
+// returns 0 otherwise
+int decode_lsm (uint32_t instruction)
+{
+    uint8_t data[64];
+    uint32_t start, base, value, list;
+    uint8_t rn, p, u, s, w, l;
+    int i, j, n = 0, user;
+
+    list = get_bits (instruction, 0, 16);
+    rn = get_bits (instruction, 16, 4);
+
+    p = get_bit (instruction, 24);
+    u = get_bit (instruction, 23);
+    s = get_bit (instruction, 22);
+    w = get_bit (instruction, 21);
+    l = get_bit (instruction, 20);
+
+    if (!condition_passed (flags, get_cond (instruction)))
+    {
+        hook_memory = 0;
+        return 0;
+    }
+
+    for (i = 0; i < 16; i++)
+        n += (list >> i) & 1;
+
+    // the lowest register is at the lowest address, whichever
+    // way the base moves
+    base = registers[rn];
+
+    if (u)
+        start = p ? base + 4 : base;
+    else
+        start = p ? base - 4 * n : base - 4 * n + 4;
+
+    start &= 0xFFFFFFFC;
+
+    // tell the plugins, before memory changes
+    if (hook_memory)
+    {
+        hook_memory = 0;
+        plugin_event (EMU_EVENT_MEMORY, registers[R_PC] - 4, start, !l);
+    }
+
+    if (dcache || memprof_recording)
+    {
+        for (i = 0; i < n; i++)
+        {
+            if (dcache)
+                cachesim_access (dcache, registers[R_PC] - 4, start + 4 * i);
+
+            if (memprof_recording)
+                memprof_access (registers[R_PC] - 4, start + 4 * i, !l);
+        }
+    }
+
+    // S, unless the PC is loaded, moves the user mode R13 and R14
+    user = s && !(l && (list & (1 << R_PC))) && cpu_mode == MODE_IRQ;
+
+    if (user)
+        mode_set (MODE_SYS);
+
+    if (l)
+    {
+        load_bytes (memory, start, 4 * n, data);
+
+        for (i = 0, j = 0; i < 16; i++)
+        {
+            if (list & (1 << i))
+            {
+                registers[i] = data[j] | (data[j + 1] << 8)
+                    | (data[j + 2] << 16) | ((uint32_t) data[j + 3] << 24);
+                j += 4;
+            }
+        }
+    }
+    else
+    {
+        for (i = 0, j = 0; i < 16; i++)
+        {
+            if (list & (1 << i))
+            {
+                // the PC is stored 8 bytes ahead, as it's read
+                value = (i == R_PC) ? registers[R_PC] + 4 : registers[i];
+
+                data[j++] = value;
+                data[j++] = value >> 8;
+                data[j++] = value >> 16;
+                data[j++] = value >> 24;
+            }
+        }
+
+        store (memory, start, j, data);
+    }
+
+    if (user)
+        mode_set (MODE_IRQ);
+
+    // a loaded base keeps the value loaded
+    if (w && !(l && (list & (1 << rn))))
+        registers[rn] = u ? base + 4 * n : base - 4 * n;
+
+    // a load of the PC with S returns from an exception
+    if (l && (list & (1 << R_PC)))
+    {
+        registers[R_PC] &= 0xFFFFFFFC;
+
+        if (s)
+            exception_return ();
+    }
+
+    return debug_stopping;
 }
 
 /*
@@ -382,7 +793,7 @@ void decode_ls (uint32_t instruction)
  */
 
 // decodes the SWI instructions
-// returns 1 if the emulator should halt
+// returns 1 if the emulator should halt, or a watchpoint stopped it
 // returns 0 otherwise
 int decode_swi(uint32_t instruction)
 {
@@ -393,7 +804,7 @@ int decode_swi(uint32_t instruction)
     immed = get_bits (instruction, 0, 24);
     
     if (condition_passed (flags, cond))
-        return SVC (registers, immed);
+        return SVC (registers, memory, immed) || debug_stopping;
     else
         return 0;
 }
@@ -403,102 +814,286 @@ int decode_swi(uint32_t instruction)
  *
  */
 
+// executes a decoded instruction, with the PC already advanced past it
+// returns 1 if the emulator should halt, or a watchpoint stopped it
+// returns 0 otherwise
+int execute (uint32_t instruction, uint8_t type)
+{
+    // DECODE and EXECUTE
+    // Note that these two stage have been grouped into
+    // the same function for optimisation
+    switch (type)
+    {
+        case INSTR_DP:
+            decode_dp (instruction);
+            break;
+
+        case INSTR_MUL:
+            decode_multiplication (instruction);
+            break;
+
+        case INSTR_B:
+            decode_branch (instruction);
+            break;
+
+        case INSTR_LS:
+            return decode_ls (instruction);
+
+        case INSTR_LSM:
+            return decode_lsm (instruction);
+
+        case INSTR_LSH:
+            return decode_lsh (instruction);
+
+        case INSTR_SWI:
+            return decode_swi (instruction);
+    }
+
+    return 0;
+}
+
+// returns 1 if the instruction passes the trace's condition filter
+// returns 0 otherwise
+int trace_cond_passed (decoded_instruction* d)
+{
+    if (trace_filters.cond == TRACE_COND_ANY)
+        return 1;
+
+    return condition_passed (flags, d->cond) == (trace_filters.cond == TRACE_COND_PASS);
+}
+
 // main emulation loop
-void emulate (int trace, int before, int after)
+// instructions are run a decoded block at a time
+// a limit of 0 runs until the guest halts
+// returns EMU_HALTED if the guest halted
+// returns EMU_LIMIT if the instruction limit was reached first
+int emulate (int trace, int before, int after, uint64_t limit)
 {
-    uint32_t instruction;
-    uint8_t type, halt = 0;
+    uint32_t pc;
+    uint64_t sampled = 0, cost = 0;
+    int i, j, n, traced, profiling = guest_profile != NULL, calls = callstack_running (),
+        timed = cycle_model != NULL, halt = 0, status = EMU_HALTED;
+    decoded_instruction* d;
+    blockcache* blocks;
+    sim_cache* fetch = icache;
+    block* b;
 
     // need to show memory dump?
     if (before)
     {
+        metrics_begin (PHASE_DUMP);
         print_memory_dump (memory);
-        printf ("\n");
+
+        if (dump_settings.format != DUMP_RAW)
+            printf ("\n");
+
+        metrics_end (PHASE_DUMP);
     }
 
-    for (;;)
+    metrics_begin (PHASE_EXECUTE);
+
+    // start from the blocks kept by the caller, if there are any
+    blocks = warm_blocks ? warm_blocks : blockcache_create ();
+
+    while (!halt)
     {
+        // out of instructions?
+        if (limit && retired >= limit)
+        {
+            status = EMU_LIMIT;
+            break;
+        }
+
+        // events are due, or an interrupt might be waiting
+        if (retired >= next_event)
+            events_take ();
+
+        // a store hit code that has been decoded
+        if (memory->code_written)
+        {
+            if (profiling)
+                profile_harvest (guest_profile, blocks);
+
+            blockcache_invalidate (blocks, memory);
+        }
+
         // FETCH
-        // request instruction
-        instruction = load32 (memory, registers[R_PC]);
+        // request the block of instructions at the PC
+        b = blocks ? blockcache_find (blocks, memory, registers[R_PC]) : NULL;
+
+        if (!b)
+        {
+            fprintf (stderr, "Insufficient memory to decode 0x%08X\n", registers[R_PC]);
+            break;
+        }
+
+        // stop before a breakpoint?
+        if (b->breakpoint && debug_break (b->start))
+        {
+            status = EMU_BREAK;
+            break;
+        }
+
+        n = b->length;
+
+        if (b->hooks & HOOK_BLOCK)
+            plugin_event (EMU_EVENT_BLOCK, b->start, b->length, 0);
 
-        // print the trace?
-        if (trace)
-            print_trace (registers, instruction);
+        if (limit && limit - retired < (uint64_t) n)
+            n = limit - retired;
 
-        // increment PC
-        registers[R_PC] += 4;
+        // decide once whether any of the block is traced
+        traced = trace && b->trace
+            && (trace_filters.sample <= 1 || sampled++ % trace_filters.sample == 0);
 
-        // DECODE and EXECUTE
-        // Note that these two stage have been grouped into
-        // the same function for optimisation
-        type = get_instruction_type (instruction);
+        // left at the last instruction run
+        d = b->instr;
+        pc = b->start;
+        cost = 0;
 
-        switch (type)
+        for (i = 0; i < n; )
         {
-            case INSTR_DP:
-                decode_dp (instruction);
-                break;
+            d = &b->instr[i++];
+            pc = registers[R_PC];
 
-            case INSTR_MUL:
-                decode_multiplication (instruction);
-                break;
+            // count conditions before the instruction changes the flags
+            if (profiling && d->cond != COND_AL && condition_passed (flags, d->cond))
+                d->passed++;
 
-            case INSTR_B:
-                decode_branch (instruction);
-                break;
+            if (fetch)
+                cachesim_access (fetch, pc, pc);
 
-            case INSTR_LS:
-                decode_ls (instruction);
-                break;
+            // estimate cycles from the state the instruction sees
+            if (timed)
+                cost += timing_cost (d->word, d->type, condition_passed (flags, d->cond));
 
-            case INSTR_SWI:
-                if (decode_swi (instruction))
-                    halt = 1;
+            // print the trace?
+            if (traced && d->trace && trace_cond_passed (d))
+                trace_record (registers, flags, d->word);
+
+            // plugin hooks decided when the block was built
+            if (d->hooks)
+            {
+                if (d->hooks & HOOK_SVC && condition_passed (flags, d->cond))
+                    plugin_event (EMU_EVENT_SVC, pc, d->word & 0x00FFFFFF, 0);
+
+                hook_memory = d->hooks & HOOK_MEMORY;
+            }
+
+            // increment PC
+            registers[R_PC] += 4;
+
+            halt = execute (d->word, d->type);
+
+            // leave the block if it branched, halted or wrote to code
+            if (halt || registers[R_PC] != pc + 4 || memory->code_written)
                 break;
         }
 
-        // halt the emulator?
-        if (halt)
-            break;
-    }
+        retired += i;
 
-    // need to show memory dump?
-    if (after)
-        print_memory_dump (memory);
-}
+        if (timed)
+        {
+            b->cycles += cost;
+            cycles += cost;
+        }
 
-void read_file (FILE* fp)
-{
-    uint32_t mem, instr;
-    int pc_set = 0;
+        if (b->hooks)
+        {
+            // the last instruction wrote the PC
+            if (d->hooks & HOOK_BRANCH && registers[R_PC] != pc + 4)
+                plugin_event (EMU_EVENT_BRANCH, pc, registers[R_PC],
+                    d->type == INSTR_B && get_bit (d->word, 24));
+
+            // plugin counters
+            for (j = 0; j < b->counter_count; j++)
+                *b->counters[j] += (b->counter_kinds[j] == EMU_COUNT_BLOCKS) ? 1 : i;
+        }
 
-    rewind (fp);
+        // follow calls and returns for the call stack sampler
+        if (calls)
+        {
+            if (registers[R_PC] != pc + 4)
+                callstack_jump (d->word, d->type, pc, registers[R_PC]);
 
-    // format is memory address `space` instruction
-    while (fscanf (fp, "%X", &mem) != EOF)
-    {
-        if (fscanf (fp, "%X", &instr) != 1)
-            break;
+            if (callstack_pending)
+                callstack_sample ();
+        }
 
-        // store in 'memory'
-        store (memory, mem, sizeof(instr), (uint8_t*) &instr);
+        // time to rewrite the metrics file?
+        if (metrics_pending)
+            metrics_write ();
 
-        // initialise the program counter
-        if (!pc_set)
+        // count whole runs of the block, and how far the others got
+        if (profiling)
         {
-            registers[R_PC] = mem;
-            pc_set = 1;
+            if (i == b->length)
+                b->executions++;
+            else
+                for (j = 0; j < i; j++)
+                    b->instr[j].partial++;
         }
+    }
+
+    // a watchpoint stopped it after the access
+    if (debug_stopping)
+    {
+        debug_stopping = 0;
+        status = EMU_BREAK;
+    }
 
+    if (blocks)
+    {
+        if (profiling)
+            profile_harvest (guest_profile, blocks);
+
+        if (blocks != warm_blocks)
+            blockcache_destroy (blocks);
+    }
+
+    // let the trace catch up
+    trace_flush ();
+    metrics_end (PHASE_EXECUTE);
+
+    // need to show memory dump?
+    // not when stopped part way, the run isn't over yet
+    if (after && status != EMU_BREAK)
+    {
+        metrics_begin (PHASE_DUMP);
+        print_memory_dump (memory);
+        metrics_end (PHASE_DUMP);
     }
+
+    return status;
 }
 
 // code entry point
 int main (int argc, char** argv)
 {
-    FILE *fp = NULL;
-    int i, trace = 0, before = 0, after = 0;
+    int i, trace = 0, trace_options = 0, before = 0, after = 0, cache = 1, binary = 0, res,
+        disasm = 0, diff = 0, profiling = 0, callstack_hz = CALLSTACK_HZ,
+        metrics_interval = METRICS_INTERVAL, workers = SERVE_WORKERS;
+    uint32_t load_addr = 0, ram_addr = 0, ram_size = 0;
+    uint64_t limit = 0;
+    char* socket_path = NULL;
+    char* filename = NULL;
+    char* ram_path = NULL;
+    char* trace_path = NULL;
+    char* callstack_path = NULL;
+    char* metrics_path = NULL;
+    char* icache_spec = NULL;
+    char* dcache_spec = NULL;
+    char* l2cache_spec = NULL;
+    char* device_specs[DEVICE_MAX];
+    int device_specs_count = 0;
+    char* debug_path = NULL;
+    char* memprof_path = NULL;
+    uint64_t memprof_interval = MEMPROF_INTERVAL;
+    char* plugin_specs[PLUGIN_MAX];
+    int plugin_specs_count = 0;
+
+    // guest output is buffered from the start
+    console_open ();
 
     // arguments?
     if (argc > 1)
@@ -508,7 +1103,71 @@ int main (int argc, char** argv)
             // options
             if (strcmp (argv[i], "-trace") == 0)
             {
-                trace = 1;
+                trace = TRACE_TEXT;
+                continue;
+            }
+
+            if (strcmp (argv[i], "-trace-bin") == 0 && i + 1 < argc)
+            {
+                trace = TRACE_BINARY;
+                trace_path = argv[++i];
+                continue;
+            }
+
+            if (strcmp (argv[i], "-trace-async") == 0)
+            {
+                trace_options |= TRACE_ASYNC;
+                continue;
+            }
+
+            if (strcmp (argv[i], "-trace-drop") == 0)
+            {
+                trace_options |= TRACE_DROP;
+                continue;
+            }
+
+            if (strcmp (argv[i], "-trace-compress") == 0)
+            {
+                trace_options |= TRACE_COMPRESS;
+                continue;
+            }
+
+            if (strcmp (argv[i], "-trace-range") == 0 && i + 1 < argc)
+            {
+                if (trace_parse_range (argv[++i], &trace_filters) != 0)
+                    fprintf (stderr, "The trace range %s is not valid.\n", argv[i]);
+                continue;
+            }
+
+            if (strcmp (argv[i], "-trace-class") == 0 && i + 1 < argc)
+            {
+                if (trace_parse_classes (argv[++i], &trace_filters) != 0)
+                    fprintf (stderr, "The trace classes %s are not valid.\n", argv[i]);
+                continue;
+            }
+
+            if (strcmp (argv[i], "-trace-cond") == 0 && i + 1 < argc)
+            {
+                i++;
+
+                if (strcmp (argv[i], "pass") == 0)
+                    trace_filters.cond = TRACE_COND_PASS;
+                else if (strcmp (argv[i], "fail") == 0)
+                    trace_filters.cond = TRACE_COND_FAIL;
+                else
+                    fprintf (stderr, "The trace condition %s is not valid.\n", argv[i]);
+                continue;
+            }
+
+            if (strcmp (argv[i], "-trace-sample") == 0 && i + 1 < argc)
+            {
+                trace_filters.sample = strtoul (argv[++i], NULL, 0);
+                continue;
+            }
+
+            if (strcmp (argv[i], "-disasm") == 0)
+            {
+                disasm = 1;
                 continue;
             }
 
@@ -524,35 +1183,335 @@ int main (int argc, char** argv)
                 continue;
             }
 
-            // assume this is a (.emu) file
-            fp = fopen(argv[i], "r");
+            if (strcmp (argv[i], "-dump-range") == 0 && i + 1 < argc)
+            {
+                if (parse_range (argv[++i], &dump_settings.lo, &dump_settings.hi) != 0)
+                    fprintf (stderr, "The dump range %s is not valid.\n", argv[i]);
+                continue;
+            }
+
+            if (strcmp (argv[i], "-dump-format") == 0 && i + 1 < argc)
+            {
+                if ((res = parse_dump_format (argv[++i])) < 0)
+                    fprintf (stderr, "The dump format %s is not valid.\n", argv[i]);
+                else
+                    dump_settings.format = res;
+                continue;
+            }
+
+            if (strcmp (argv[i], "-profile") == 0)
+            {
+                profiling = 1;
+                continue;
+            }
+
+            if (strcmp (argv[i], "-cycles") == 0 && i + 1 < argc)
+            {
+                if (timing_select (argv[++i]) != 0)
+                    fprintf (stderr, "There is no cycle model %s.\n", argv[i]);
+
+                continue;
+            }
+
+            if (strcmp (argv[i], "-icache") == 0 && i + 1 < argc)
+            {
+                icache_spec = argv[++i];
+                continue;
+            }
+
+            if (strcmp (argv[i], "-dcache") == 0 && i + 1 < argc)
+            {
+                dcache_spec = argv[++i];
+                continue;
+            }
+
+            if (strcmp (argv[i], "-l2cache") == 0 && i + 1 < argc)
+            {
+                l2cache_spec = argv[++i];
+                continue;
+            }
+
+            if (strcmp (argv[i], "-device") == 0 && i + 1 < argc)
+            {
+                i++;
+
+                if (device_specs_count < DEVICE_MAX)
+                    device_specs[device_specs_count++] = argv[i];
+                else
+                    fprintf (stderr, "Only %d devices can be attached.\n", DEVICE_MAX);
+
+                continue;
+            }
+
+            if (strcmp (argv[i], "-debug") == 0 && i + 1 < argc)
+            {
+                debug_path = argv[++i];
+                continue;
+            }
+
+            if (strcmp (argv[i], "-memprof") == 0 && i + 1 < argc)
+            {
+                memprof_path = argv[++i];
+                continue;
+            }
+
+            if (strcmp (argv[i], "-memprof-interval") == 0 && i + 1 < argc)
+            {
+                memprof_interval = strtoull (argv[++i], NULL, 0);
+                continue;
+            }
+
+            if (strcmp (argv[i], "-callstack") == 0 && i + 1 < argc)
+            {
+                callstack_path = argv[++i];
+                continue;
+            }
+
+            if (strcmp (argv[i], "-callstack-hz") == 0 && i + 1 < argc)
+            {
+                callstack_hz = atoi (argv[++i]);
+                continue;
+            }
+
+            if (strcmp (argv[i], "-metrics") == 0 && i + 1 < argc)
+            {
+                metrics_path = argv[++i];
+                continue;
+            }
+
+            if (strcmp (argv[i], "-metrics-interval") == 0 && i + 1 < argc)
+            {
+                metrics_interval = atoi (argv[++i]);
+                continue;
+            }
+
+            if (strcmp (argv[i], "-plugin") == 0 && i + 1 < argc)
+            {
+                i++;
+
+                if (plugin_specs_count < PLUGIN_MAX)
+                    plugin_specs[plugin_specs_count++] = argv[i];
+                else
+                    fprintf (stderr, "Only %d plugins can be loaded.\n", PLUGIN_MAX);
+
+                continue;
+            }
+
+            if (strcmp (argv[i], "-diff") == 0)
+            {
+                diff = 1;
+                continue;
+            }
+
+            if (strcmp (argv[i], "-nocache") == 0)
+            {
+                cache = 0;
+                continue;
+            }
+
+            if (strcmp (argv[i], "-bin") == 0 && i + 1 < argc)
+            {
+                binary = 1;
+                load_addr = strtoul (argv[++i], NULL, 0);
+                continue;
+            }
+
+            if (strcmp (argv[i], "-ram-file") == 0 && i + 3 < argc)
+            {
+                ram_path = argv[++i];
+                ram_addr = strtoul (argv[++i], NULL, 0);
+                ram_size = strtoul (argv[++i], NULL, 0);
+                continue;
+            }
+
+            if (strcmp (argv[i], "-limit") == 0 && i + 1 < argc)
+            {
+                limit = strtoull (argv[++i], NULL, 0);
+                continue;
+            }
+
+            if (strcmp (argv[i], "-serve") == 0 && i + 1 < argc)
+            {
+                socket_path = argv[++i];
+                continue;
+            }
+
+            if (strcmp (argv[i], "-workers") == 0 && i + 1 < argc)
+            {
+                workers = atoi (argv[++i]);
+                continue;
+            }
 
+            // assume this is a (.emu) file
             // if the file is valid, stop parsing arguments
-            if (fp)
+            if (access (argv[i], R_OK) == 0)
+            {
+                filename = argv[i];
                 break;
+            }
 
             // print an error, file not found
             fprintf (stderr, "The file %s was not found.\n", argv[i]);
         }
     }
 
+    // daemon mode, images arrive over the socket
+    if (socket_path)
+        return serve (socket_path, workers);
+
     // valid file
-    if (fp == NULL)
+    if (filename == NULL)
         return 1;
 
+    // long runs report on themselves as they go
+    if (metrics_path && metrics_start (metrics_path, metrics_interval) != 0)
+    {
+        fprintf (stderr, "The metrics for %s could not be started.\n", metrics_path);
+        return 1;
+    }
+
     // initialise memory
-    memory = hashtable_create ();
+    metrics_begin (PHASE_LOAD);
+    memory = pagetable_create ();
 
-    // load .emu into memory
-    read_file (fp);
+    // load .emu, ELF or binary into memory
+    if (binary)
+        res = image_load_binary (memory, filename, load_addr, &registers[R_PC]);
+    else
+        res = image_load (memory, filename, cache, &registers[R_PC]);
+
+    if (res != 0)
+    {
+        fprintf (stderr, "The file %s could not be read.\n", filename);
+        return 1;
+    }
+
+    // persistent RAM, mapped over whatever the image put there
+    if (ram_path && image_map_ram (memory, ram_path, ram_addr, ram_size) != 0)
+    {
+        fprintf (stderr, "The file %s could not be mapped at 0x%08X.\n",
+            ram_path, ram_addr);
+        return 1;
+    }
+
+    metrics_end (PHASE_LOAD);
+
+    // list the image rather than run it
+    if (disasm)
+    {
+        print_disassembly (memory);
+        pagetable_destroy (memory);
+        return 0;
+    }
+
+    // binary trace starts from the loaded state
+    if (trace && trace_open (trace, trace_path, trace_options, registers, flags) != 0)
+    {
+        fprintf (stderr, "The file %s could not be created.\n", trace_path);
+        return 1;
+    }
+
+    // track the changes made from the loaded state
+    if (diff)
+        pagetable_checkpoint (memory);
+
+    // cycle estimates are gathered per block with the profile
+    if (profiling || cycle_model)
+        guest_profile = profile_create ();
+
+    if (callstack_path && callstack_start (callstack_path, callstack_hz, registers[R_PC]) != 0)
+    {
+        fprintf (stderr, "The file %s could not be created.\n", callstack_path);
+        return 1;
+    }
+
+    // memory mapped devices, over whatever the image put there
+    for (i = 0; i < device_specs_count; i++)
+    {
+        if (device_attach_spec (memory, device_specs[i]) != 0)
+        {
+            fprintf (stderr, "The device %s could not be attached.\n", device_specs[i]);
+            return 1;
+        }
+    }
+
+    // breakpoints and watchpoints
+    if (debug_path && debug_script (memory, debug_path) != 0)
+    {
+        fprintf (stderr, "The script %s could not be run.\n", debug_path);
+        return 1;
+    }
+
+    if (memprof_path && memprof_start (memprof_path, memprof_interval) != 0)
+    {
+        fprintf (stderr, "The file %s could not be created.\n", memprof_path);
+        return 1;
+    }
 
-    // close the file
-    fclose (fp);
+    // simulated caches, L1 misses going on to the L2
+    if ((icache_spec && !(icache = cachesim_create ("L1I", icache_spec)))
+        || (dcache_spec && !(dcache = cachesim_create ("L1D", dcache_spec)))
+        || (l2cache_spec && !(l2cache = cachesim_create ("L2", l2cache_spec))))
+    {
+        fprintf (stderr, "The cache must be given as size:ways:line[:lru|fifo|random].\n");
+        return 1;
+    }
+
+    if (icache)
+        icache->next = l2cache;
+
+    if (dcache)
+        dcache->next = l2cache;
+
+    // plugins see the loaded state
+    for (i = 0; i < plugin_specs_count; i++)
+    {
+        if (plugin_load (plugin_specs[i]) != 0)
+        {
+            fprintf (stderr, "The plugin %s could not be loaded.\n", plugin_specs[i]);
+            return 1;
+        }
+    }
 
     // emulate!
-    emulate (trace, before, after);
+    // a breakpoint or watchpoint that stops the run is reported, and the
+    // exit status is 2 rather than 0
+    if ((res = emulate (trace, before, after, limit)) == EMU_BREAK)
+        debug_report_stop ();
+
+    callstack_stop ();
+    memprof_stop ();
+    plugin_unload_all ();
+
+    if (diff)
+    {
+        metrics_begin (PHASE_DUMP);
+        print_memory_diff (memory);
+        metrics_end (PHASE_DUMP);
+    }
+
+    metrics_stop ();
+
+    if (guest_profile)
+    {
+        if (profiling)
+            profile_report (guest_profile);
+
+        if (cycle_model)
+            timing_report (guest_profile);
+
+        profile_destroy (guest_profile);
+    }
+
+    cachesim_report ();
+    cachesim_destroy_all ();
+    debug_clear (memory);
+    device_detach_all (memory);
+    semihost_close_all ();
+
+    trace_close ();
 
     // clean up
-    hashtable_destroy (memory);
-    return 0;
+    pagetable_destroy (memory);
+    return (res == EMU_BREAK) ? 2 : 0;
 }
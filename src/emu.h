@@ -0,0 +1,45 @@
+/*
+ * ARM emulator
+ * Luke Mitchell
+ *
+ */
+
+#ifndef EMU_H
+#define EMU_H
+
+#include <stdint.h>
+#include "pagetable.h"
+#include "block.h"
+
+/* Emulation results */
+#define EMU_LIMIT   0 // instruction limit reached
+#define EMU_HALTED  1 // guest executed SVC 0
+#define EMU_BREAK   2 // a breakpoint or watchpoint stopped it
+
+/* Processor modes, as in the CPSR */
+#define MODE_USR    0x10
+#define MODE_IRQ    0x12
+#define MODE_SVC    0x13
+#define MODE_SYS    0x1F
+
+/* CPSR bits besides the flags and mode */
+#define CPSR_I      0x80 // IRQs disabled
+
+/* Exception vectors */
+#define VECTOR_IRQ  0x18
+
+/* CPU state, owned by emu.c */
+extern uint32_t registers[16];
+extern uint8_t flags[4];
+extern pagetable* memory;
+extern uint64_t retired;
+extern uint8_t cpu_mode;
+extern uint8_t irq_disabled;
+extern uint32_t spsr_irq;
+
+/* Blocks kept between runs, used by emulate in place of a new cache */
+extern blockcache* warm_blocks;
+
+int emulate (int trace, int before, int after, uint64_t limit);
+
+#endif
@@ -0,0 +1,70 @@
+/*
+ * ARM emulator
+ * Luke Mitchell
+ *
+ */
+
+// Plugin interface
+//
+// A plugin is a shared library loaded with -plugin lib.so[=args]. It
+// exports emu_plugin_init, which is called once the image is loaded, and
+// optionally emu_plugin_exit, called when the guest halts:
+//
+//   int emu_plugin_init (emu_plugin_api* api, const char* args);
+//   void emu_plugin_exit (void);
+//
+// From init, a plugin subscribes to events in an address range, or asks
+// for counters. Subscriptions are matched against code as it's decoded,
+// so code no plugin is interested in runs exactly as without plugins.
+// Counters are incremented directly by the emulator, with no call into
+// the plugin.
+
+#ifndef EMU_PLUGIN_H
+#define EMU_PLUGIN_H
+
+#include <stdint.h>
+
+/* Interface version, checked against api->version */
+#define EMU_PLUGIN_VERSION 1
+
+/* Events */
+#define EMU_EVENT_BLOCK     0 // a block starting in the range is about to run
+#define EMU_EVENT_MEMORY    1 // a load or store in the range is about to run
+#define EMU_EVENT_SVC       2 // an SVC in the range is about to run
+#define EMU_EVENT_BRANCH    3 // an instruction in the range wrote the PC
+#define EMU_EVENT_COUNT     4
+
+/* Counters */
+#define EMU_COUNT_BLOCKS        0 // runs of blocks starting in the range
+#define EMU_COUNT_INSTRUCTIONS  1 // instructions retired by those blocks
+
+// an event passed to a callback
+typedef struct {
+    int kind;           // EMU_EVENT_*
+    uint32_t pc;        // address of the block or instruction
+    uint32_t value;     // block length, load/store address, SVC number or branch target
+    uint32_t flags;     // 1 for a store or a branch with link, otherwise 0
+    uint32_t* registers;
+} emu_event;
+
+typedef void (*emu_callback) (void* user, const emu_event* event);
+
+// what the emulator offers a plugin
+typedef struct {
+    int version;
+
+    // calls callback with user for each event of kind in lo to hi inclusive
+    // returns 0 on success, -1 on failure
+    int (*subscribe) (int kind, uint32_t lo, uint32_t hi, emu_callback callback, void* user);
+
+    // returns a counter of kind for code in lo to hi inclusive,
+    // which is valid until the plugin exits, or NULL on failure
+    uint64_t* (*counter) (int kind, uint32_t lo, uint32_t hi);
+
+    // guest state
+    uint32_t* registers;
+    uint8_t* flags;
+    uint32_t (*read32) (uint32_t addr);
+} emu_plugin_api;
+
+#endif
@@ -0,0 +1,195 @@
+/*
+ * ARM emulator
+ * Luke Mitchell
+ *
+ */
+
+// Event queue
+//
+// The clock is the count of instructions retired. Devices schedule events
+// for a clock value, and the queue keeps them in a binary heap ordered by
+// when they're due. next_event holds the earliest, so the emulator only
+// compares the clock against it between blocks, and looks at the queue
+// when it's reached. An event due part way through a block runs once the
+// block finishes.
+//
+// Raising an interrupt line, or anything else that might let a waiting
+// interrupt be taken, sets next_event to 0 so the next block boundary
+// looks again.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include "events.h"
+
+/* Clock value at which the emulator next has to look at the queue */
+uint64_t next_event = EVENT_NEVER;
+
+/* Interrupt lines raised by devices, and those the controller passes on */
+uint32_t irq_lines;
+uint32_t irq_mask = 0xFFFFFFFF;
+
+/* Pending events, as a heap ordered by when */
+event* events;
+int event_count;
+int event_capacity;
+
+/* Helper functions not exposed in header file */
+
+// swaps two events in the heap
+void event_swap (int a, int b)
+{
+    event e = events[a];
+
+    events[a] = events[b];
+    events[b] = e;
+}
+
+// moves the event at i up the heap until its parent is due no later
+void event_sift_up (int i)
+{
+    while (i > 0 && events[(i - 1) / 2].when > events[i].when)
+    {
+        event_swap (i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+// moves the event at i down the heap until its children are due no earlier
+void event_sift_down (int i)
+{
+    int child;
+
+    while ((child = 2 * i + 1) < event_count)
+    {
+        if (child + 1 < event_count && events[child + 1].when < events[child].when)
+            child++;
+
+        if (events[i].when <= events[child].when)
+            break;
+
+        event_swap (i, child);
+        i = child;
+    }
+}
+
+// removes the event at i from the heap
+void event_remove (int i)
+{
+    events[i] = events[--event_count];
+
+    if (i < event_count)
+    {
+        event_sift_down (i);
+        event_sift_up (i);
+    }
+}
+
+// sets next_event to the earliest event, unless something's waiting
+// to be looked at sooner
+void event_update (void)
+{
+    uint64_t first = event_count ? events[0].when : EVENT_NEVER;
+
+    if (first < next_event)
+        next_event = first;
+}
+
+/* Scheduling */
+
+// schedules fn to be called with arg once the clock reaches when
+// returns 0 on success, -1 if there's insufficient memory
+int event_schedule (uint64_t when, event_fn fn, void* arg)
+{
+    event* e;
+
+    if (event_count == event_capacity)
+    {
+        e = realloc (events, (event_capacity ? 2 * event_capacity : 16) * sizeof (event));
+
+        if (!e)
+            return -1;
+
+        events = e;
+        event_capacity = event_capacity ? 2 * event_capacity : 16;
+    }
+
+    e = &events[event_count];
+    e->when = when;
+    e->fn = fn;
+    e->arg = arg;
+
+    event_sift_up (event_count++);
+    event_update ();
+
+    return 0;
+}
+
+// cancels every event calling fn with arg
+void event_cancel (event_fn fn, void* arg)
+{
+    int i = 0;
+
+    while (i < event_count)
+    {
+        if (events[i].fn == fn && events[i].arg == arg)
+            event_remove (i);
+        else
+            i++;
+    }
+}
+
+// runs the events due by now, including any they schedule that are due,
+// and works out when the queue is next needed
+void events_run (uint64_t now)
+{
+    event e;
+
+    while (event_count && events[0].when <= now)
+    {
+        e = events[0];
+        event_remove (0);
+        e.fn (e.arg);
+    }
+
+    next_event = EVENT_NEVER;
+    event_update ();
+}
+
+// asks the emulator to look at the queue and interrupts at the next block
+void events_recheck (void)
+{
+    next_event = 0;
+}
+
+// cancels every event and lowers every interrupt line
+void events_clear (void)
+{
+    free (events);
+
+    events = NULL;
+    event_count = event_capacity = 0;
+    next_event = EVENT_NEVER;
+    irq_lines = 0;
+    irq_mask = 0xFFFFFFFF;
+}
+
+/* Interrupts */
+
+// raises an interrupt line, it stays raised until lowered
+void irq_raise (int line)
+{
+    irq_lines |= 1u << line;
+    events_recheck ();
+}
+
+// lowers an interrupt line
+void irq_lower (int line)
+{
+    irq_lines &= ~(1u << line);
+}
+
+// returns 1 if a raised line is passed on by the controller, 0 otherwise
+int irq_asserted (void)
+{
+    return (irq_lines & irq_mask) != 0;
+}
@@ -0,0 +1,46 @@
+/*
+ * ARM emulator
+ * Luke Mitchell
+ *
+ */
+
+#ifndef EVENTS_H
+#define EVENTS_H
+
+#include <stdint.h>
+
+/* Clock value of an event that never comes */
+#define EVENT_NEVER UINT64_MAX
+
+/* Interrupt lines */
+#define IRQ_LINES 32
+
+typedef void (*event_fn) (void* arg);
+
+// something due to happen when the clock reaches when
+typedef struct {
+    uint64_t when;
+    event_fn fn;
+    void* arg;
+} event;
+
+/* Clock value at which the emulator next has to look at the queue */
+extern uint64_t next_event;
+
+/* Interrupt lines raised by devices, and those the controller passes on */
+extern uint32_t irq_lines;
+extern uint32_t irq_mask;
+
+// scheduling
+int         event_schedule          (uint64_t when, event_fn, void* arg);
+void        event_cancel            (event_fn, void* arg);
+void        events_run              (uint64_t now);
+void        events_recheck          (void);
+void        events_clear            (void);
+
+// interrupts
+void        irq_raise               (int line);
+void        irq_lower               (int line);
+int         irq_asserted            (void);
+
+#endif
@@ -5,6 +5,10 @@
 #include <stdlib.h>
 #include "hash.h"
 
+/* Counters, across every table */
+uint64_t hashtable_resizes;
+int hashtable_max_chain;
+
 /* Helper functions not exposed in header file */
 
 // creates an array of linked lists of specified size
@@ -80,6 +84,7 @@ int resize_table (hashtable* h, int size)
 
 	// free memory from old table
 	free (old_table);
+	hashtable_resizes++;
 
 	// and return success
 	return 0;
@@ -109,9 +114,10 @@ int adjacent_prime (int current, int higher)
 	{
                 if (primes[i] == current)
 		{
-			if (higher == 1)			
+			// stay put at either end of the list
+			if (higher == 1 && i < 20)
                         	return primes[++i];
-			else
+			else if (higher != 1 && i > 0)
 				return primes[--i];
 		}
 	}
@@ -153,14 +159,15 @@ uint32_t hash (int table_size, unsigned int a)
 
 // adds a new node to the hashtable, h, with the data specified, data
 // returns the call to list_add_node (see list.c)
-int hashtable_add_node (hashtable* h, uint32_t addr, uint8_t data)
+int hashtable_add_node (hashtable* h, uint32_t addr, uint32_t data)
 {
 	// does the table need resizing?
         float empty = (h->size - h->in_use);
 
         float utilised = (1 - (empty / h->size)) * 100;
 	
-	if (utilised >= h->threshold)
+	// there's nothing to gain once the largest size is reached
+	if (utilised >= h->threshold && next_prime (h->size) != h->size)
 		resize_table (h, next_prime (h->size));
 
 	// compute the hash for the data
@@ -176,7 +183,14 @@ int hashtable_add_node (hashtable* h, uint32_t addr, uint8_t data)
 		h->in_use++;
 	}
 
-	return list_add_node (h->table[hash_value], addr, data);	
+	if (list_add_node (h->table[hash_value], addr, data) != 0)
+		return -1;
+
+	// keep track of the longest chain
+	if (h->table[hash_value]->size > hashtable_max_chain)
+		hashtable_max_chain = h->table[hash_value]->size;
+
+	return 0;
 }
 
 // removes a node from the hashtable, h, where the node contains data from addr
@@ -191,7 +205,7 @@ int hashtable_remove_node (hashtable* h, uint32_t addr)
         float utilised = (1 - (empty / h->size)) * 100; // note that empty is float to ensure fp divis
 	
 	// we use (100 - threshold)% as the lower bound 
-	if (utilised <= (100 - h->threshold))
+	if (utilised <= (100 - h->threshold) && previous_prime (h->size) != h->size)
 		resize_table (h, previous_prime (h->size));
 
 	// compute the hash value
@@ -213,6 +227,7 @@ int hashtable_remove_node (hashtable* h, uint32_t addr)
 	{
 		// empty, free the memory
 		free (l);
+		h->table[hash_value] = NULL;
 
 		// and decrement counter
 		h->in_use--;
@@ -22,8 +22,12 @@ typedef struct {
 	list** table;	
 } hashtable;
 
+// counters, across every table
+extern uint64_t hashtable_resizes;
+extern int hashtable_max_chain;
+
 // add/remove nodes
-int 		hashtable_add_node 		(hashtable*, uint32_t, uint8_t);
+int 		hashtable_add_node 		(hashtable*, uint32_t, uint32_t);
 int		hashtable_remove_node		(hashtable*, uint32_t);
 
 // search table
@@ -0,0 +1,683 @@
+/*
+ * ARM emulator
+ * Luke Mitchell
+ *
+ */
+
+// Image loading
+//
+// .emu images are text, one address and word per line. They are parsed
+// in parallel from a private mapping of the file, but this is still
+// slow for large images, so the first load of an image also writes a
+// compiled copy alongside it (.emuc) holding its pages, keyed by the
+// source's device, inode, size and modification time, so checking it
+// costs one stat rather than a read of the source. Later loads map the
+// compiled copy privately and point guest pages straight at it, so
+// guest writes are copy-on-write and never reach the file.
+//
+// Flat binaries and ELF32 ARM executables are mapped from the file and
+// registered as lazy regions of guest memory, so only the pages the
+// guest touches are ever copied in.
+//
+// A range of guest memory can also be backed by a host file, mapped
+// shared, so the guest's stores persist in the file once it exits.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <elf.h>
+#include "image.h"
+#include "common.h"
+#include "pagetable.h"
+
+// an address/word pair parsed from a .emu image
+typedef struct {
+    uint32_t addr;
+    uint32_t word;
+} emu_record;
+
+// a run of whole lines of a .emu image, parsed by one thread
+typedef struct {
+    const char* start;
+    const char* end;
+    emu_record* records;
+    size_t count;
+    size_t capacity;
+    int truncated;      // parsing stopped at malformed input
+} emu_chunk;
+
+/* Helper functions not exposed in header file */
+
+// fills in the key of the .emu at path
+// returns 0 on success, -1 if the file can't be found
+int emuc_source_key (char* path, emuc_source* key)
+{
+    struct stat st;
+
+    if (stat (path, &st) != 0)
+        return -1;
+
+    memset (key, 0, sizeof (emuc_source));
+    key->dev = st.st_dev;
+    key->ino = st.st_ino;
+    key->size = st.st_size;
+    key->mtime = st.st_mtim.tv_sec;
+    key->mtime_nsec = st.st_mtim.tv_nsec;
+
+    return 0;
+}
+
+// maps the compiled image at path into memory
+// returns 0 on success
+// returns -1 if it doesn't exist, is damaged or was compiled from another source
+int emuc_load (pagetable* memory, char* path, emuc_source* source, uint32_t* entry)
+{
+    int fd;
+    uint32_t i;
+    struct stat st;
+    uint8_t* base;
+    emuc_header* header;
+    emuc_segment* seg;
+    page* p;
+
+    fd = open (path, O_RDONLY);
+
+    if (fd < 0)
+        return -1;
+
+    if (fstat (fd, &st) != 0 || st.st_size < (off_t) sizeof (emuc_header))
+    {
+        close (fd);
+        return -1;
+    }
+
+    // private and writable, so guest stores are copy-on-write
+    base = mmap (NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close (fd);
+
+    if (base == MAP_FAILED)
+        return -1;
+
+    header = (emuc_header*) base;
+    seg = (emuc_segment*) (base + sizeof (emuc_header));
+
+    if (header->magic != EMUC_MAGIC || header->version != EMUC_VERSION
+        || memcmp (&header->source, source, sizeof (emuc_source)) != 0
+        || header->segments > (st.st_size - sizeof (emuc_header)) / sizeof (emuc_segment))
+    {
+        munmap (base, st.st_size);
+        return -1;
+    }
+
+    for (i = 0; i < header->segments; i++)
+    {
+        // a damaged cache is parsed again rather than mapped
+        if (PAGE_OFFSET (seg[i].addr) || seg[i].offset % PAGE_SIZE != 0
+            || (uint64_t) seg[i].offset + PAGE_SIZE > (uint64_t) st.st_size
+            || seg[i].hi > PAGE_SIZE)
+        {
+            munmap (base, st.st_size);
+            return -1;
+        }
+    }
+
+    for (i = 0; i < header->segments; i++)
+    {
+        p = pagetable_map (memory, seg[i].addr, base + seg[i].offset, 0);
+
+        if (p)
+        {
+            p->lo = seg[i].lo;
+            p->hi = seg[i].hi;
+        }
+    }
+
+    pagetable_add_mapping (memory, base, st.st_size);
+    *entry = header->entry;
+
+    return 0;
+}
+
+// writes the pages in memory to a compiled image at path
+// the image is written to a temporary file first, so a concurrent
+// reader never sees it half written
+// returns 0 on success, -1 on failure
+int emuc_write (pagetable* memory, char* path, emuc_source* source, uint32_t entry)
+{
+    int i, size, ok = 1;
+    long offset;
+    char tmp[PATH_MAX];
+    FILE* fp;
+    page** pages;
+    emuc_header header;
+    emuc_segment seg;
+
+    if (snprintf (tmp, sizeof (tmp), "%s.%d", path, (int) getpid ()) >= (int) sizeof (tmp))
+        return -1;
+
+    fp = fopen (tmp, "wb");
+
+    if (!fp)
+        return -1;
+
+    pages = pagetable_sorted (memory, &size);
+
+    memset (&header, 0, sizeof (header));
+    header.magic = EMUC_MAGIC;
+    header.version = EMUC_VERSION;
+    header.source = *source;
+    header.entry = entry;
+    header.segments = size;
+
+    ok &= fwrite (&header, sizeof (header), 1, fp) == 1;
+
+    // page data starts on the first page boundary after the table
+    offset = sizeof (header) + size * sizeof (emuc_segment);
+    offset = (offset + PAGE_SIZE - 1) & ~(long) (PAGE_SIZE - 1);
+
+    for (i = 0; i < size; i++)
+    {
+        seg.addr = pages[i]->number << PAGE_BITS;
+        seg.lo = pages[i]->lo;
+        seg.hi = pages[i]->hi;
+        seg.offset = offset + (long) i * PAGE_SIZE;
+
+        ok &= fwrite (&seg, sizeof (seg), 1, fp) == 1;
+    }
+
+    ok &= fseek (fp, offset, SEEK_SET) == 0;
+
+    for (i = 0; i < size; i++)
+        ok &= fwrite (pages[i]->data, PAGE_SIZE, 1, fp) == 1;
+
+    free (pages);
+
+    if (fclose (fp) != 0 || !ok || rename (tmp, path) != 0)
+    {
+        unlink (tmp);
+        return -1;
+    }
+
+    return 0;
+}
+
+// parses a hexadecimal number, with optional 0x prefix, at *pos
+// leading whitespace is skipped and *pos is left after the number
+// returns 1 on success, 0 at the end of the input
+// returns -1 if the next token isn't a number
+int parse_hex (const char** pos, const char* end, uint32_t* value)
+{
+    const char* p = *pos;
+    uint32_t v = 0;
+    int digits = 0;
+    char c;
+
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+        p++;
+
+    if (p == end)
+    {
+        *pos = p;
+        return 0;
+    }
+
+    if (end - p > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X'))
+        p += 2;
+
+    for (; p < end; p++, digits++)
+    {
+        c = *p;
+
+        if (c >= '0' && c <= '9')
+            v = (v << 4) | (c - '0');
+        else if (c >= 'A' && c <= 'F')
+            v = (v << 4) | (c - 'A' + 10);
+        else if (c >= 'a' && c <= 'f')
+            v = (v << 4) | (c - 'a' + 10);
+        else
+            break;
+    }
+
+    *pos = p;
+    *value = v;
+
+    return (digits > 0) ? 1 : -1;
+}
+
+// parses the address/word pairs in a chunk, thread entry point
+void* parse_chunk (void* arg)
+{
+    emu_chunk* c = arg;
+    const char* pos = c->start;
+    emu_record* records;
+    uint32_t addr, word;
+    size_t capacity;
+    int res;
+
+    for (;;)
+    {
+        res = parse_hex (&pos, c->end, &addr);
+
+        if (res == 0)
+            break;
+
+        if (res < 0 || parse_hex (&pos, c->end, &word) != 1)
+        {
+            c->truncated = 1;
+            break;
+        }
+
+        if (c->count == c->capacity)
+        {
+            capacity = c->capacity ? 2 * c->capacity : 16;
+            records = realloc (c->records, capacity * sizeof (emu_record));
+
+            if (!records)
+            {
+                c->truncated = 1;
+                break;
+            }
+
+            c->records = records;
+            c->capacity = capacity;
+        }
+
+        c->records[c->count].addr = addr;
+        c->records[c->count].word = word;
+        c->count++;
+    }
+
+    return NULL;
+}
+
+// writes parsed records to memory in image order
+// runs of consecutive words are gathered and stored together,
+// costing one page lookup per page rather than one per word
+void merge_records (pagetable* memory, emu_record* records, size_t count)
+{
+    uint32_t run[PAGE_SIZE / 4];
+    uint32_t base = 0;
+    size_t i, n = 0;
+
+    for (i = 0; i < count; i++)
+    {
+        if (n && (n == PAGE_SIZE / 4 || records[i].addr != base + 4 * n))
+        {
+            store (memory, base, 4 * n, (uint8_t*) run);
+            n = 0;
+        }
+
+        if (n == 0)
+            base = records[i].addr;
+
+        run[n++] = records[i].word;
+    }
+
+    if (n)
+        store (memory, base, 4 * n, (uint8_t*) run);
+}
+
+// maps the .emu image at path and parses it in chunks split on
+// line boundaries, one thread per chunk, then merges the results
+// parsing stops at the first malformed pair, as image_read_emu does
+// returns 0 on success, -1 if the file can't be read
+int image_parse_emu (pagetable* memory, char* path, uint32_t* entry)
+{
+    int fd, i, threads, started[IMAGE_PARSE_THREADS];
+    long cpus;
+    struct stat st;
+    const char *data, *end, *split;
+    pthread_t tid[IMAGE_PARSE_THREADS];
+    emu_chunk chunk[IMAGE_PARSE_THREADS];
+    int pc_set = 0;
+
+    fd = open (path, O_RDONLY);
+
+    if (fd < 0)
+        return -1;
+
+    if (fstat (fd, &st) != 0)
+    {
+        close (fd);
+        return -1;
+    }
+
+    // nothing to load
+    if (st.st_size == 0)
+    {
+        close (fd);
+        return 0;
+    }
+
+    data = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close (fd);
+
+    if (data == MAP_FAILED)
+        return -1;
+
+    end = data + st.st_size;
+
+    // one thread per IMAGE_CHUNK_MIN bytes, up to one per CPU
+    cpus = sysconf (_SC_NPROCESSORS_ONLN);
+    threads = st.st_size / IMAGE_CHUNK_MIN + 1;
+
+    if (threads > cpus)
+        threads = cpus;
+    if (threads > IMAGE_PARSE_THREADS)
+        threads = IMAGE_PARSE_THREADS;
+    if (threads < 1)
+        threads = 1;
+
+    // split on line boundaries
+    split = data;
+
+    for (i = 0; i < threads; i++)
+    {
+        memset (&chunk[i], 0, sizeof (emu_chunk));
+        chunk[i].start = split;
+
+        if (i == threads - 1)
+        {
+            split = end;
+        }
+        else
+        {
+            split = data + (st.st_size / threads) * (i + 1);
+
+            if (split < chunk[i].start)
+                split = chunk[i].start;
+
+            while (split < end && *split != '\n')
+                split++;
+
+            if (split < end)
+                split++;
+        }
+
+        chunk[i].end = split;
+        chunk[i].capacity = (split - chunk[i].start) / 16 + 16;
+        chunk[i].records = malloc (chunk[i].capacity * sizeof (emu_record));
+
+        if (!chunk[i].records)
+            chunk[i].capacity = 0;
+    }
+
+    // the first chunk is parsed on this thread
+    for (i = 1; i < threads; i++)
+        started[i] = pthread_create (&tid[i], NULL, parse_chunk, &chunk[i]) == 0;
+
+    parse_chunk (&chunk[0]);
+
+    for (i = 1; i < threads; i++)
+    {
+        if (started[i])
+            pthread_join (tid[i], NULL);
+        else
+            parse_chunk (&chunk[i]);
+    }
+
+    // merge in file order so later pairs overwrite earlier ones
+    for (i = 0; i < threads; i++)
+    {
+        if (!pc_set && chunk[i].count)
+        {
+            *entry = chunk[i].records[0].addr;
+            pc_set = 1;
+        }
+
+        merge_records (memory, chunk[i].records, chunk[i].count);
+
+        // nothing after malformed input is loaded
+        if (chunk[i].truncated)
+            break;
+    }
+
+    for (i = 0; i < threads; i++)
+        free (chunk[i].records);
+
+    munmap ((void*) data, st.st_size);
+
+    return 0;
+}
+
+// maps the whole of the file at path read-only, for lazy regions
+// the mapping is released along with memory
+// returns the mapping, or NULL on failure, updating size
+const uint8_t* map_image (pagetable* memory, char* path, size_t* size)
+{
+    int fd;
+    struct stat st;
+    uint8_t* data;
+
+    fd = open (path, O_RDONLY);
+
+    if (fd < 0)
+        return NULL;
+
+    if (fstat (fd, &st) != 0 || st.st_size == 0)
+    {
+        close (fd);
+        return NULL;
+    }
+
+    data = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close (fd);
+
+    if (data == MAP_FAILED)
+        return NULL;
+
+    pagetable_add_mapping (memory, data, st.st_size);
+    *size = st.st_size;
+
+    return data;
+}
+
+// returns 1 if the file at path starts with the ELF magic number
+int is_elf (char* path)
+{
+    unsigned char ident[SELFMAG];
+    FILE* fp = fopen (path, "rb");
+    int res = 0;
+
+    if (fp)
+    {
+        res = fread (ident, SELFMAG, 1, fp) == 1 && memcmp (ident, ELFMAG, SELFMAG) == 0;
+        fclose (fp);
+    }
+
+    return res;
+}
+
+/* Exposed functions */
+
+// reads a .emu image from a stream into memory
+// the first address in the image becomes the entry point
+// files on disk are loaded faster by image_load
+// the image ends at the end of the stream, or at a '.' as sent by clients
+// returns 0 on success, -1 if it's malformed or empty
+int image_read_emu (pagetable* memory, FILE* fp, uint32_t* entry)
+{
+    uint32_t mem, instr;
+    int pc_set = 0, res;
+    char end;
+
+    // format is memory address `space` instruction
+    while ((res = fscanf (fp, "%X", &mem)) == 1)
+    {
+        if (fscanf (fp, "%X", &instr) != 1)
+            return -1;
+
+        // store in 'memory'
+        store (memory, mem, sizeof(instr), (uint8_t*) &instr);
+
+        // initialise the program counter
+        if (!pc_set)
+        {
+            *entry = mem;
+            pc_set = 1;
+        }
+
+    }
+
+    // stopped at something other than the end
+    if (res != EOF && (fscanf (fp, " %c", &end) != 1 || end != '.'))
+        return -1;
+
+    return pc_set ? 0 : -1;
+}
+
+// loads a flat binary image at path into memory at addr, lazily
+// execution starts at addr
+// returns 0 on success, -1 if the image can't be read
+int image_load_binary (pagetable* memory, char* path, uint32_t addr, uint32_t* entry)
+{
+    size_t size;
+    const uint8_t* data = map_image (memory, path, &size);
+
+    // the image has to fit below 4GB, worked out in 64 bits so that a
+    // load at 0 doesn't wrap
+    if (!data || size > 0xFFFFFFFFu || (uint64_t) addr + size > 0x100000000ULL)
+        return -1;
+
+    if (pagetable_add_lazy (memory, addr, size, size, data) != 0)
+        return -1;
+
+    *entry = addr;
+
+    return 0;
+}
+
+// loads the PT_LOAD segments of the ELF32 ARM executable at path
+// into memory, lazily, with bytes past each segment's file size
+// reading as zero
+// returns 0 on success, -1 if the file isn't a little-endian ARM executable
+int image_load_elf (pagetable* memory, char* path, uint32_t* entry)
+{
+    int i;
+    size_t size;
+    const uint8_t* data = map_image (memory, path, &size);
+    const Elf32_Ehdr* eh;
+    const Elf32_Phdr* ph;
+
+    if (!data || size < sizeof (Elf32_Ehdr))
+        return -1;
+
+    eh = (const Elf32_Ehdr*) data;
+
+    if (memcmp (eh->e_ident, ELFMAG, SELFMAG) != 0
+        || eh->e_ident[EI_CLASS] != ELFCLASS32
+        || eh->e_ident[EI_DATA] != ELFDATA2LSB
+        || eh->e_machine != EM_ARM
+        || eh->e_phentsize != sizeof (Elf32_Phdr)
+        || eh->e_phoff + (uint64_t) eh->e_phnum * sizeof (Elf32_Phdr) > size)
+    {
+        return -1;
+    }
+
+    ph = (const Elf32_Phdr*) (data + eh->e_phoff);
+
+    for (i = 0; i < eh->e_phnum; i++)
+    {
+        if (ph[i].p_type != PT_LOAD || ph[i].p_memsz == 0)
+            continue;
+
+        if ((uint64_t) ph[i].p_offset + ph[i].p_filesz > size
+            || (uint64_t) ph[i].p_vaddr + ph[i].p_memsz > 0x100000000ULL)
+        {
+            return -1;
+        }
+
+        if (pagetable_add_lazy (memory, ph[i].p_vaddr, ph[i].p_memsz,
+            ph[i].p_filesz, data + ph[i].p_offset) != 0)
+        {
+            return -1;
+        }
+    }
+
+    *entry = eh->e_entry;
+
+    return 0;
+}
+
+// loads the image at path into memory
+// ELF executables are recognised by their header, anything else is
+// taken to be .emu text, loaded through the compiled image cache when
+// use_cache is set
+// returns 0 on success, -1 if the image can't be read
+int image_load (pagetable* memory, char* path, int use_cache, uint32_t* entry)
+{
+    emuc_source source;
+    char cache_path[PATH_MAX];
+
+    if (is_elf (path))
+        return image_load_elf (memory, path, entry);
+
+    if (use_cache)
+    {
+        if (emuc_source_key (path, &source) != 0
+            || snprintf (cache_path, sizeof (cache_path), "%s%s", path, EMUC_SUFFIX)
+                >= (int) sizeof (cache_path))
+        {
+            use_cache = 0;
+        }
+        else if (emuc_load (memory, cache_path, &source, entry) == 0)
+        {
+            return 0;
+        }
+    }
+
+    if (image_parse_emu (memory, path, entry) != 0)
+        return -1;
+
+    // failing to write the cache isn't fatal, the next load parses again
+    if (use_cache)
+        emuc_write (memory, cache_path, &source, *entry);
+
+    return 0;
+}
+
+// backs size bytes of guest memory at addr with the file at path,
+// creating or extending the file as needed
+// stores to the range land directly in the file, and are visible to
+// other processes mapping it
+// returns 0 on success, -1 on failure
+int image_map_ram (pagetable* memory, char* path, uint32_t addr, uint32_t size)
+{
+    int fd;
+    struct stat st;
+    uint8_t* data;
+
+    if (size == 0 || PAGE_OFFSET (addr) || PAGE_OFFSET (size)
+        || (uint64_t) addr + size > 0x100000000ULL)
+    {
+        return -1;
+    }
+
+    fd = open (path, O_RDWR | O_CREAT, 0644);
+
+    if (fd < 0)
+        return -1;
+
+    if (fstat (fd, &st) != 0 || (st.st_size < size && ftruncate (fd, size) != 0))
+    {
+        close (fd);
+        return -1;
+    }
+
+    data = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close (fd);
+
+    if (data == MAP_FAILED)
+        return -1;
+
+    pagetable_add_mapping (memory, data, size);
+
+    return pagetable_add_shared (memory, addr, size, data);
+}
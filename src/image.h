@@ -0,0 +1,56 @@
+/*
+ * ARM emulator
+ * Luke Mitchell
+ *
+ */
+
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "pagetable.h"
+
+/* Parallel .emu parsing */
+#define IMAGE_PARSE_THREADS 8           // most threads used to parse an image
+#define IMAGE_CHUNK_MIN     (1 << 20)   // fewest bytes worth a thread
+
+/* Compiled image (.emuc) format */
+#define EMUC_MAGIC      0x43554D45 // "EMUC"
+#define EMUC_VERSION    2
+#define EMUC_SUFFIX     "c"        // prog.emu is compiled to prog.emuc
+
+// identifies the .emu a compiled image was made from, taken from stat
+typedef struct {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime;          // seconds
+    int64_t mtime_nsec;
+} emuc_source;
+
+// the header at the start of a compiled image
+// it is followed by the segment table, then by the page
+// data of each segment at a PAGE_SIZE aligned offset
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    emuc_source source;     // the .emu it was compiled from
+    uint32_t entry;         // initial PC
+    uint32_t segments;
+} emuc_header;
+
+// a page of guest memory held in a compiled image
+typedef struct {
+    uint32_t addr;          // guest address of the page
+    uint16_t lo, hi;        // range of offsets written by the image
+    uint32_t offset;        // file offset of the page data
+} emuc_segment;
+
+int image_read_emu (pagetable* memory, FILE* fp, uint32_t* entry);
+int image_load (pagetable* memory, char* path, int use_cache, uint32_t* entry);
+int image_load_binary (pagetable* memory, char* path, uint32_t addr, uint32_t* entry);
+int image_load_elf (pagetable* memory, char* path, uint32_t* entry);
+int image_map_ram (pagetable* memory, char* path, uint32_t addr, uint32_t size);
+
+#endif
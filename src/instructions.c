@@ -6,9 +6,13 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include "io.h"
 #include "instructions.h"
 #include "common.h"
+#include "trace.h"
+#include "pagetable.h"
+#include "semihost.h"
 
 // performs conditional analysis of the operands
 // returns a 1 for passed
@@ -262,26 +266,217 @@ uint32_t MLA (uint8_t* flags, uint8_t s, uint8_t rm, uint8_t rs, uint8_t rn)
     return res;
 }
 
-// SVC instruction, used for debugging
+// the guest memory SVCs work a page at a time, as the guest's loops
+// would, but with a host memcpy for each page
+
+// writes size bytes of memory at addr to the console
+void svc_write (pagetable* memory, uint32_t addr, uint32_t size)
+{
+    uint8_t buffer[PAGE_SIZE];
+    uint32_t n;
+
+    while (size > 0)
+    {
+        n = (size < PAGE_SIZE) ? size : PAGE_SIZE;
+
+        load_bytes (memory, addr, n, buffer);
+
+        // behind the trace, when it is written asynchronously
+        trace_drain ();
+        console_write (buffer, n);
+
+        addr += n;
+        size -= n;
+    }
+}
+
+// reads up to size bytes of input to memory at addr
+// returns the number of bytes read, fewer at the end of the input
+uint32_t svc_read (pagetable* memory, uint32_t addr, uint32_t size)
+{
+    uint8_t buffer[PAGE_SIZE];
+    uint32_t total = 0, n, got;
+
+    // prompts are seen before the guest waits
+    console_flush ();
+
+    while (total < size)
+    {
+        n = (size - total < PAGE_SIZE) ? size - total : PAGE_SIZE;
+        got = fread (buffer, 1, n, stdin);
+
+        store (memory, addr + total, got, buffer);
+        total += got;
+
+        if (got < n)
+            break;
+    }
+
+    return total;
+}
+
+// copies size bytes of memory from src to dst, the ranges may overlap
+void svc_memcpy (pagetable* memory, uint32_t dst, uint32_t src, uint32_t size)
+{
+    uint8_t buffer[PAGE_SIZE];
+    uint32_t n, at;
+
+    // copy from the end when dst is ahead of src, as memmove does
+    int backwards = dst - src < size;
+
+    while (size > 0)
+    {
+        n = (size < PAGE_SIZE) ? size : PAGE_SIZE;
+        at = backwards ? size - n : 0;
+
+        load_bytes (memory, src + at, n, buffer);
+        store (memory, dst + at, n, buffer);
+
+        if (!backwards)
+        {
+            src += n;
+            dst += n;
+        }
+
+        size -= n;
+    }
+}
+
+// sets size bytes of memory at dst to value
+void svc_memset (pagetable* memory, uint32_t dst, uint8_t value, uint32_t size)
+{
+    uint8_t buffer[PAGE_SIZE];
+    uint32_t n;
+
+    memset (buffer, value, (size < PAGE_SIZE) ? size : PAGE_SIZE);
+
+    while (size > 0)
+    {
+        n = (size < PAGE_SIZE) ? size : PAGE_SIZE;
+
+        store (memory, dst, n, buffer);
+
+        dst += n;
+        size -= n;
+    }
+}
+
+// compares size bytes of memory at a and b
+// returns the difference of the first bytes that differ, 0 if none do
+int32_t svc_memcmp (pagetable* memory, uint32_t a, uint32_t b, uint32_t size)
+{
+    uint8_t left[PAGE_SIZE], right[PAGE_SIZE];
+    uint32_t i, n;
+
+    while (size > 0)
+    {
+        n = (size < PAGE_SIZE) ? size : PAGE_SIZE;
+
+        load_bytes (memory, a, n, left);
+        load_bytes (memory, b, n, right);
+
+        if (memcmp (left, right, n) != 0)
+        {
+            for (i = 0; left[i] == right[i]; i++)
+                ;
+
+            return left[i] - right[i];
+        }
+
+        a += n;
+        b += n;
+        size -= n;
+    }
+
+    return 0;
+}
+
+// returns the length of the string in memory at addr
+uint32_t svc_strlen (pagetable* memory, uint32_t addr)
+{
+    uint8_t buffer[PAGE_SIZE];
+    uint8_t* end;
+    uint32_t len = 0, n;
+
+    // a page at a time, unwritten memory ends the string
+    while (len <= UINT32_MAX - PAGE_SIZE)
+    {
+        n = PAGE_SIZE - PAGE_OFFSET (addr + len);
+
+        load_bytes (memory, addr + len, n, buffer);
+
+        if ((end = memchr (buffer, 0, n)))
+            return len + (end - buffer);
+
+        len += n;
+    }
+
+    return len;
+}
+
+// SVC instruction, used for debugging and for the guest's I/O
 // returns 0 for most instructions, when no halt is required
 // returns 1 when the CPU has been halted
-uint8_t SVC (uint32_t registers[], uint32_t operand)
+uint8_t SVC (uint32_t registers[], pagetable* memory, uint32_t operand)
 {
     switch (operand)
     {
-        // halt CPU
-        case 0:
+        // halt CPU, with the console written out
+        case SVC_HALT:
+            console_flush ();
             return 1;
 
         // print out all register values
-        case 1:
-            print_register_dump (registers);
-            printf ("\n");
+        // or R0 followed by \n
+        // behind the trace, when it is written asynchronously
+        case SVC_DUMP:
+        case SVC_PRINT:
+            if (!trace_svc (registers, operand))
+                print_svc (registers, operand);
+            break;
+
+        // print the memory changed since the last checkpoint
+        // and take a new one, when changes are being tracked
+        case SVC_DIFF:
+            if (memory->tracking)
+            {
+                trace_flush ();
+                print_memory_diff (memory);
+                pagetable_checkpoint (memory);
+            }
+            break;
+
+        case SVC_WRITE:
+            svc_write (memory, registers[R_0], registers[R_1]);
+            break;
+
+        case SVC_WRITE_STR:
+            svc_write (memory, registers[R_0], svc_strlen (memory, registers[R_0]));
+            break;
+
+        case SVC_READ:
+            registers[R_0] = svc_read (memory, registers[R_0], registers[R_1]);
+            break;
+
+        // memcpy and memset return the destination, as in C
+        case SVC_MEMCPY:
+            svc_memcpy (memory, registers[R_0], registers[R_1], registers[R_2]);
+            break;
+
+        case SVC_MEMSET:
+            svc_memset (memory, registers[R_0], registers[R_1], registers[R_2]);
+            break;
+
+        case SVC_MEMCMP:
+            registers[R_0] = svc_memcmp (memory, registers[R_0], registers[R_1], registers[R_2]);
+            break;
+
+        case SVC_STRLEN:
+            registers[R_0] = svc_strlen (memory, registers[R_0]);
             break;
 
-        // print out R0 followed by \n
-        case 2:
-            printf ("%08X\n\n", registers[R_0]);
+        case SVC_SEMIHOST:
+            registers[R_0] = semihost_call (memory, registers[R_0], registers[R_1]);
             break;
     }
 
@@ -8,6 +8,7 @@
 #define INSTRUCTIONS_H
 
 #include <stdint.h>
+#include "pagetable.h"
 
 /* Non-general purpose register indexes */
 #define R_0 0
@@ -40,6 +41,8 @@
 #define INSTR_B         2 // Branch/with link
 #define INSTR_SWI       3 // Software interrupt
 #define INSTR_MUL       4
+#define INSTR_LSM       5 // Load and store multiple
+#define INSTR_LSH       6 // Load and store halfword and signed byte
 #define INSTR_UNKNOWN   -1
 
 /* OpCode definitions */
@@ -73,6 +76,20 @@
 #define SHIFT_ROR_I 6
 #define SHIFT_ROR_R 7
 
+/* SVC numbers, results are returned in R0 */
+#define SVC_HALT        0
+#define SVC_DUMP        1  // print every register
+#define SVC_PRINT       2  // print R0
+#define SVC_DIFF        3  // print the memory changed since the last SVC_DIFF
+#define SVC_WRITE       4  // write R1 bytes at R0 to the console
+#define SVC_WRITE_STR   5  // write the string at R0 to the console
+#define SVC_READ        6  // read up to R1 bytes of input to R0, returns the count
+#define SVC_MEMCPY      7  // copy R2 bytes from R1 to R0, which may overlap
+#define SVC_MEMSET      8  // set R2 bytes at R0 to R1
+#define SVC_MEMCMP      9  // compare R2 bytes at R0 and R1, as memcmp
+#define SVC_STRLEN      10 // length of the string at R0
+#define SVC_SEMIHOST    0x123456 // semihosting operation R0, parameters at R1
+
 /* Function prototypes */
 uint8_t condition_passed (uint8_t* flags, uint8_t cond);
 
@@ -91,6 +108,6 @@ void CMP (uint8_t* flags, uint32_t rn, uint32_t operand);
 uint32_t MUL (uint8_t* flags, uint8_t s, uint8_t rm, uint8_t rs);
 uint32_t MLA (uint8_t* flags, uint8_t s, uint8_t rm, uint8_t rs, uint8_t rn);
 
-uint8_t SVC (uint32_t r[], uint32_t operand);
+uint8_t SVC (uint32_t r[], pagetable* memory, uint32_t operand);
 
 #endif
@@ -6,279 +6,453 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include "io.h"
 #include "common.h"
 #include "instructions.h"
-#include "hash.h"
+#include "pagetable.h"
+#include "serve.h"
+#include "disasm.h"
+#include "callstack.h"
+#include "metrics.h"
+#include "memprof.h"
 
-// prints the usage of the program to stdout
-void print_usage (char* name)
+/* Memory dump settings, every byte on a line of its own by default */
+dump_options dump_settings = { DUMP_BYTES, 0, 0xFFFFFFFF };
+
+/* Buffer behind stdout, so guest output isn't written a call at a time */
+char console_buffer[CONSOLE_BUFFER];
+
+/* Helper functions not exposed in header file */
+
+// writes value to buffer as the given number of hex digits
+// returns the number of characters written
+int format_hex (char* buffer, uint32_t value, int digits)
 {
-    printf ("Usage: %s [options] filename.emu\n", name);
-    printf ("\t-trace - show instruction trace\n");
-    printf ("\t-before - show memory dump before execution\n");
-    printf ("\t-after - show memory dump after execution\n");
+    int i;
+
+    for (i = 0; i < digits; i++)
+        buffer[i] = "0123456789ABCDEF"[(value >> (4 * (digits - 1 - i))) & 0xF];
+
+    return digits;
 }
 
-// prints a memory dump to stdout
-void print_memory_dump (hashtable* memory)
+// finds the written part of page p within the dump range
+// sets lo and hi to the offsets of the first and one past the last byte
+// returns 1 if there is anything to dump, 0 otherwise
+int dump_extent (page* p, uint32_t* lo, uint32_t* hi)
 {
-    int i, j, size, first_run;
-    uint32_t previous, lowest, lowest_index;
-    node* n;
-    node** contents;
-    node** assembled;
-
-    // get contents of memory
-    contents = hashtable_get_values (memory, &size);
-    
-    // allocate array to store assembled values in
-    assembled = calloc (size, sizeof (node));
-
-    // assemble into order
-    previous = 0;
-    lowest_index = 0;
-    first_run = 1;
+    uint32_t base = p->number << PAGE_BITS;
 
-    for (i = 0; i < size; i++)
+    if (p->lo >= p->hi || base + p->hi - 1 < dump_settings.lo
+        || base + p->lo > dump_settings.hi)
     {
-        lowest = 0xFFFFFFFF;
+        return 0;
+    }
 
-        for (j = 0; j < size; j++)
-        {
-            n = contents[j];
+    *lo = (base + p->lo < dump_settings.lo) ? dump_settings.lo - base : p->lo;
+    *hi = (base + p->hi - 1 > dump_settings.hi) ? dump_settings.hi - base + 1 : p->hi;
+
+    return 1;
+}
+
+// returns the number of bytes shown by a line of the dump
+int line_bytes (void)
+{
+    switch (dump_settings.format)
+    {
+        case DUMP_WORDS:
+            return 4;
 
-            if (((n->addr > previous) || (first_run)) && (n->addr <= lowest))
+        case DUMP_HEX:
+            return 16;
+    }
+
+    return 1;
+}
+
+// returns the offset of the first line showing the byte at offset lo
+int first_line (uint32_t lo)
+{
+    return lo & ~(line_bytes () - 1);
+}
+
+// writes the line of the dump starting at offset j of page p
+// to buffer, showing only bytes from lo to hi
+// returns the number of characters written, at most DUMP_LINE_MAX
+int format_dump_line (char* buffer, page* p, int j, uint32_t lo, uint32_t hi)
+{
+    int k, len = 0;
+    uint8_t* d = p->data + j;
+    uint8_t c;
+
+    buffer[len++] = '0';
+    buffer[len++] = 'x';
+    len += format_hex (buffer + len, (p->number << PAGE_BITS) | j, 8);
+    buffer[len++] = ' ';
+
+    switch (dump_settings.format)
+    {
+        case DUMP_WORDS:
+            buffer[len++] = '0';
+            buffer[len++] = 'x';
+            len += format_hex (buffer + len,
+                d[0] | (d[1] << 8) | (d[2] << 16) | ((uint32_t) d[3] << 24), 8);
+            break;
+
+        case DUMP_HEX:
+            for (k = 0; k < 16; k++)
             {
-                lowest_index = j;
-                lowest = contents[j]->addr;
+                buffer[len++] = ' ';
+
+                if (j + k >= lo && j + k < hi)
+                    len += format_hex (buffer + len, d[k], 2);
+                else
+                    buffer[len++] = ' ', buffer[len++] = ' ';
             }
-        }
-        
-        if (first_run)
-            first_run = 0;
 
-        assembled[i] = contents[lowest_index];
-        previous = contents[lowest_index]->addr;
+            buffer[len++] = ' ';
+            buffer[len++] = ' ';
+            buffer[len++] = '|';
+
+            for (k = 0; k < 16; k++)
+            {
+                c = d[k];
+
+                if (j + k >= lo && j + k < hi)
+                    buffer[len++] = (c >= 0x20 && c < 0x7F) ? c : '.';
+                else
+                    buffer[len++] = ' ';
+            }
+
+            buffer[len++] = '|';
+            break;
+
+        default:
+            buffer[len++] = '0';
+            buffer[len++] = 'x';
+            len += format_hex (buffer + len, d[0], 8);
+            break;
     }
 
-    // print memory
-    for (i = 0; i < size; i++)
-        printf ("0x%08X 0x%08X\n", assembled[i]->addr, assembled[i]->data);
+    buffer[len++] = '\n';
 
-    // free the memory
-    free (contents);
-    free (assembled);
+    return len;
 }
 
-// prints a register dump to stdout
-void print_register_dump (uint32_t r[])
+// writes a line of a memory diff to buffer, for the bytes
+// from offset lo to hi of page p
+// returns the number of characters written, at most DIFF_LINE_MAX
+int format_diff_line (char* buffer, page* p, int lo, int hi)
 {
-    printf ("R0=%08X R1=%08X R2=%08X R3=%08X R4=%08X R5=%08X R6=%08X R7=%08X\n",
-        r[R_0], r[R_1], r[R_2], r[R_3], r[R_4], r[R_5], r[R_6], r[R_7]);
-    printf ("R8=%08X R9=%08X R10=%08X R11=%08X R12=%08X SP=%08X LR=%08X PC=%08X\n",
-        r[R_8], r[R_9], r[R_10], r[R_11], r[R_12], r[R_SP], r[R_LR], r[R_PC]);
+    int j, len = 0;
+
+    buffer[len++] = '0';
+    buffer[len++] = 'x';
+    len += format_hex (buffer + len, (p->number << PAGE_BITS) | lo, 8);
+    buffer[len++] = ' ';
+
+    for (j = lo; j < hi; j++)
+        len += format_hex (buffer + len, p->snapshot[j], 2);
+
+    buffer[len++] = ' ';
+
+    for (j = lo; j < hi; j++)
+        len += format_hex (buffer + len, p->data[j], 2);
+
+    buffer[len++] = '\n';
+
+    return len;
 }
 
-char* opcode_to_string (uint8_t opcode)
+// writes n zero bytes to stdout, filling a gap in a raw dump
+void write_zeros (uint64_t n)
+{
+    static const uint8_t zeros[PAGE_SIZE];
+
+    while (n > 0)
+    {
+        fwrite (zeros, 1, (n < PAGE_SIZE) ? n : PAGE_SIZE, stdout);
+        n -= (n < PAGE_SIZE) ? n : PAGE_SIZE;
+    }
+}
+
+// prints the usage of the program to stdout
+void print_usage (char* name)
 {
-    if (opcode == OP_AND) return "AND";
-    if (opcode == OP_EOR) return "EOR";
-    if (opcode == OP_SUB) return "SUB";
-    if (opcode == OP_ADD) return "ADD";
-    if (opcode == OP_CMP) return "CMP";
-    if (opcode == OP_ORR) return "ORR";
-    if (opcode == OP_MOV) return "MOV";
-    if (opcode == OP_BIC) return "BIC";
-
-    return "UNKNOWN";
+    printf ("Usage: %s [options] filename.emu|elf\n", name);
+    printf ("\t-trace - show instruction trace\n");
+    printf ("\t-trace-bin file - write a compact binary trace, see emu-tracedump\n");
+    printf ("\t-trace-async - write the trace and SVC output from a separate thread\n");
+    printf ("\t-trace-drop - with -trace-async, drop trace entries rather than wait\n");
+    printf ("\t-trace-compress - gzip the binary trace\n");
+    printf ("\t-trace-range start:end - only trace instructions in [start, end)\n");
+    printf ("\t-trace-class list - only trace these classes: dp,ls,b,swi,mul,lsm,lsh,unknown\n");
+    printf ("\t-trace-cond pass|fail - only trace instructions whose condition passes/fails\n");
+    printf ("\t-trace-sample n - only trace every nth block\n");
+    printf ("\t-disasm - print a disassembly of the loaded image and exit\n");
+    printf ("\t-before - show memory dump before execution\n");
+    printf ("\t-after - show memory dump after execution\n");
+    printf ("\t-dump-range start:end - only dump memory in [start, end)\n");
+    printf ("\t-dump-format bytes|words|hex|raw - layout of memory dumps (default bytes)\n");
+    printf ("\t-profile - report where execution went when the guest halts\n");
+    printf ("\t-cycles model - estimate cycles and CPI per block for arm7 or arm9\n");
+    printf ("\t-icache size:ways:line[:policy] - simulate an L1 instruction cache, e.g. 16k:4:32:lru\n");
+    printf ("\t-dcache size:ways:line[:policy] - simulate an L1 data cache, policy lru, fifo or random\n");
+    printf ("\t-l2cache size:ways:line[:policy] - simulate a unified L2 behind the L1 caches\n");
+    printf ("\t-device name@addr[=arg] - attach uart, timer[=irq line], intc, fb[=file.ppm] or blk=file, may be repeated\n");
+    printf ("\t-debug script - set breakpoints and watchpoints, \"break addr [stop|print]\" or\n");
+    printf ("\t\t\"watch addr [length] [read|write|access] [stop|print]\" per line\n");
+    printf ("\t-memprof file - write per page and per site access counts, strides and working sets to file\n");
+    printf ("\t-memprof-interval n - instructions in each working set interval (default %d)\n", MEMPROF_INTERVAL);
+    printf ("\t-callstack file - sample guest call stacks into file, as folded stacks\n");
+    printf ("\t-callstack-hz n - call stack samples per second of CPU time (default %d)\n", CALLSTACK_HZ);
+    printf ("\t-metrics file - write the emulator's own counters to file as it runs\n");
+    printf ("\t-metrics-interval n - seconds between writes of the metrics (default %d)\n", METRICS_INTERVAL);
+    printf ("\t-plugin lib.so[=args] - load an instrumentation plugin, may be repeated\n");
+    printf ("\t-diff - show the memory changed by execution, SVC 3 shows it so far\n");
+    printf ("\t-nocache - don't read or write the compiled image (.emuc)\n");
+    printf ("\t-bin addr - load the file as a flat binary at addr\n");
+    printf ("\t-ram-file file addr size - back guest memory at addr with file\n");
+    printf ("\t-limit n - stop after n instructions\n");
+    printf ("\t-serve socket - run as a daemon accepting jobs on a Unix socket\n");
+    printf ("\t-workers n - number of daemon worker processes (default %d)\n", SERVE_WORKERS);
 }
 
-char* cond_to_string (uint8_t cond)
+// returns the DUMP_* format with the given name, or -1 if there's none
+int parse_dump_format (char* name)
 {
-    if (cond == COND_EQ) return "EQ";
-    if (cond == COND_NE) return "NE";
-    if (cond == COND_MI) return "MI";
-    if (cond == COND_PL) return "PL";
-    if (cond == COND_GE) return "GE";
-    if (cond == COND_LT) return "LT";
-    if (cond == COND_GT) return "GT";
-    if (cond == COND_LE) return "LE";
-
-    // leave blank for AL, as its default
-    if (cond == COND_AL) return "";
-
-    return "UNKNOWN";
+    static const char* names[] = { "bytes", "words", "hex", "raw" };
+    int i;
+
+    for (i = 0; i < 4; i++)
+        if (strcmp (name, names[i]) == 0)
+            return i;
+
+    return -1;
 }
 
-void print_instruction (uint32_t registers[], uint32_t instr)
+// prints a memory dump to stdout, as set by dump_settings
+// pages are visited in address order, printing the bytes
+// that have been written within each
+void print_memory_dump (pagetable* memory)
 {
-    uint8_t type, cond;
+    int i, j, size;
+    uint32_t lo, hi;
+    uint64_t next = 0;
+    size_t len = 0;
+    char* buffer;
+    page** pages;
+
+    buffer = malloc (IO_BATCH_BYTES);
 
-    uint8_t opcode, s, shift_val, shift, shift_by;
-    uint32_t rd, rn, rs, rm, tmp;
-    char operand[32], buffer[32];
+    if (!buffer)
+        return;
 
-    int32_t signed_addr;
-    uint32_t addr;
-    uint8_t l;
+    // bring in any image pages not yet accessed
+    pagetable_populate (memory);
+    pages = pagetable_sorted (memory, &size);
 
-    uint8_t p, u, w, i;
-    type = get_instruction_type (instr);
-    cond = get_cond (instr);
-    
-    switch (type)
+    for (i = 0; i < size; i++)
     {
-        case INSTR_MUL:
-            s = get_bit (instr, 20);
-            rd = get_bits (instr, 16, 4);
-            rn = get_bits (instr, 12, 4);
-            rs = get_bits (instr, 8, 4);
-            rm = get_bits (instr, 0, 4);
-
-            if (get_bit (instr, 21))
-                printf ("MLA%s%s R%d, R%d, R%d, R%d", cond_to_string (cond), ((s) ? "S" : ""), rd, rm, rs, rn);
-            else
-                printf ("MUL%s%s R%d, R%d, R%d", cond_to_string (cond), ((s) ? "S" : ""), rd, rm, rs);
-            break;
+        if (!dump_extent (pages[i], &lo, &hi))
+            continue;
 
-        case INSTR_DP:
-            opcode = get_bits (instr, 21, 4);
-            s = get_bit (instr, 20);
-            rn = get_bits (instr, 16, 4);
-            rd = get_bits (instr, 12, 4);
+        // raw dumps are the bytes themselves
+        if (dump_settings.format == DUMP_RAW)
+        {
+            if (next)
+                write_zeros (((uint64_t) pages[i]->number << PAGE_BITS) + lo - next);
+
+            fwrite (pages[i]->data + lo, 1, hi - lo, stdout);
+            next = ((uint64_t) pages[i]->number << PAGE_BITS) + hi;
+            continue;
+        }
 
-            if (get_bit (instr, 25))
+        for (j = first_line (lo); j < hi; j += line_bytes ())
+        {
+            if (len > IO_BATCH_BYTES - DUMP_LINE_MAX)
             {
-                tmp = get_bits (instr, 0, 12);
-                sprintf(operand, "#%d", rotate_right (2 * (tmp >> 8), tmp & 0xFF));
+                fwrite (buffer, 1, len, stdout);
+                len = 0;
             }
-            else
+
+            len += format_dump_line (buffer + len, pages[i], j, lo, hi);
+        }
+    }
+
+    fwrite (buffer, 1, len, stdout);
+
+    free (pages);
+    free (buffer);
+}
+
+// prints the memory changed since the last checkpoint to stdout
+// each line is an address, then the bytes there at the checkpoint
+// and now, in hex, for a run of up to DIFF_RUN_MAX changed bytes
+// the diff ends with an empty line, and honours the dump range
+void print_memory_diff (pagetable* memory)
+{
+    int i, j, k, end, size;
+    uint32_t lo, hi, base;
+    size_t len = 0;
+    char* buffer;
+    page** pages;
+    page* p;
+
+    buffer = malloc (IO_BATCH_BYTES);
+
+    if (!buffer)
+        return;
+
+    pages = pagetable_dirty (memory, &size);
+
+    for (i = 0; i < size; i++)
+    {
+        p = pages[i];
+        base = p->number << PAGE_BITS;
+
+        // the part of the page in the dump range
+        if (base + PAGE_SIZE - 1 < dump_settings.lo || base > dump_settings.hi)
+            continue;
+
+        lo = (base < dump_settings.lo) ? dump_settings.lo - base : 0;
+        hi = (base + PAGE_SIZE - 1 > dump_settings.hi) ? dump_settings.hi - base + 1 : PAGE_SIZE;
+
+        for (j = lo; j < hi; )
+        {
+            if (p->snapshot[j] == p->data[j])
             {
-                switch (get_bits (instr, 4, 3))
-                {
-                   case SHIFT_LSL_I:
-                        shift_val = get_bits (instr, 0, 4);
-                        shift_by = get_bits (instr, 7, 5);
-
-                        if (registers[shift_by] != 0)
-                            sprintf (operand, "#%d LSL R%d", shift_val, shift_by);
-                        else
-                           sprintf (operand, "#%d", shift_val);
-                        break;
-
-                   case SHIFT_LSL_R:
-                        shift_val = get_bits (instr, 8, 4);
-                        shift_by = get_bits (instr, 0, 4);
-                             
-                        if (registers[shift_by] != 0)
-                            sprintf(operand, "R%d LSL R%d", shift_val, shift_by);
-                        else
-                            sprintf (operand, "R%d", shift_val);
-                        break;
-
-                   case SHIFT_LSR_I:
-                        shift_by = get_bits (instr, 7, 5);
-                        shift_val = get_bits (instr, 0, 4);
-
-                        if (registers[shift_by] != 0)
-                            sprintf (operand, "#%d LSR R%d", shift_val, shift_by);
-                        else
-                            sprintf (operand, "#%d", shift_val);
-                        break;
-
-                   case SHIFT_LSR_R:
-                        shift_by = get_bits (instr, 8, 4);
-                        shift_val = get_bits (instr, 0, 4);
-
-                        if (registers[shift_by] != 0)
-                            sprintf(operand, "R%d LSR R%d", shift_val, shift_by);
-                        else
-                            sprintf (operand, "R%d", shift_val);
-                        break;
-
-                    default:
-                        sprintf(operand, "R%d", (get_bits (instr, 0, 4)));
-                    }
-                }
-
-                switch (opcode)
-                {
-                    case OP_CMP:
-                        printf ("CMP%s R%d, %s", cond_to_string (cond), rn, operand);
-                        break;
-
-                    case OP_MOV:
-                        printf ("MOV%s%s R%d, %s", cond_to_string (cond),
-                            ((s) ? "S" : ""), rd, operand);
-                        break;
-
-                    default:                    
-                        printf ("%s%s%s R%d, R%d, %s", opcode_to_string (opcode),
-                            cond_to_string (cond), ((s) ? "S" : ""), rd, rn,
-                            operand);
-                        break;
-                }
-                break;
-
-       case INSTR_B:
-            l = get_bit (instr, 24);
-                
-            signed_addr = (int32_t) get_bits (instr, 0, 24);
-             
-            if (get_bit (signed_addr, 23))
-                addr = 0xFF000000;
-            else
-                addr = 0x00000000;
-            addr |= ((signed_addr) << 2);
-
-            // note that 8 is added as the trace is executed before
-            // PC is update
-            addr += (registers[R_PC] + 8);
-                
-            printf ("B%s%s 0x%08X", ((l) ? "L" : ""), cond_to_string (cond), addr);
-            break;
+                j++;
+                continue;
+            }
+
+            // extend the run over short gaps of unchanged bytes
+            for (end = k = j + 1; k < hi && k - j < DIFF_RUN_MAX && k - end < DIFF_GAP; k++)
+                if (p->snapshot[k] != p->data[k])
+                    end = k + 1;
 
-        case INSTR_LS:
-            rn = get_bits (instr, 16, 4);
-            rd = get_bits (instr, 12, 4);
-            addr = get_bits (instr, 0, 12);
-            i = get_bit (instr, 25);
-            u = get_bit (instr, 23);
-            p = get_bit (instr, 24);
-            w = get_bit (instr, 21);
-            l = get_bit (instr, 20);
-
-            if (i)
+            if (len > IO_BATCH_BYTES - DIFF_LINE_MAX)
             {
-                if (p && !w && (addr == R_PC))
-                    addr = registers[R_PC] + 8;     
-                else
-                    addr = registers[addr];
+                fwrite (buffer, 1, len, stdout);
+                len = 0;
+            }
+
+            len += format_diff_line (buffer + len, p, j, end);
+            j = end;
+        }
+    }
+
+    fwrite (buffer, 1, len, stdout);
+    printf ("\n");
+
+    free (buffer);
+}
+
+// prints a listing of every written word of memory to stdout
+// lines are gathered into a large buffer and written in batches
+void print_disassembly (pagetable* memory)
+{
+    int i, size;
+    uint32_t offset, addr;
+    size_t len = 0;
+    char* buffer;
+    uint8_t* d;
+    page* p;
+    page** pages;
+
+    buffer = malloc (IO_BATCH_BYTES);
+
+    if (!buffer)
+        return;
+
+    // bring in any image pages not yet accessed
+    pagetable_populate (memory);
+    pages = pagetable_sorted (memory, &size);
+
+    for (i = 0; i < size; i++)
+    {
+        p = pages[i];
+
+        for (offset = p->lo & ~3; offset < p->hi; offset += 4)
+        {
+            if (len > IO_BATCH_BYTES - DISASM_LINE_MAX)
+            {
+                fwrite (buffer, 1, len, stdout);
+                len = 0;
             }
 
-            if (u)
-                addr = rn + addr;
-            else
-                addr = rn - addr;            
+            addr = (p->number << PAGE_BITS) | offset;
+            d = p->data + offset;
+
+            len += disasm_line (addr, d[0] | (d[1] << 8) | (d[2] << 16) | ((uint32_t) d[3] << 24),
+                buffer + len, DISASM_LINE_MAX);
+        }
+    }
+
+    fwrite (buffer, 1, len, stdout);
+
+    free (pages);
+    free (buffer);
+}
+
+// prints a register dump to stdout
+void print_register_dump (uint32_t r[])
+{
+    printf ("R0=%08X R1=%08X R2=%08X R3=%08X R4=%08X R5=%08X R6=%08X R7=%08X\n",
+        r[R_0], r[R_1], r[R_2], r[R_3], r[R_4], r[R_5], r[R_6], r[R_7]);
+    printf ("R8=%08X R9=%08X R10=%08X R11=%08X R12=%08X SP=%08X LR=%08X PC=%08X\n",
+        r[R_8], r[R_9], r[R_10], r[R_11], r[R_12], r[R_SP], r[R_LR], r[R_PC]);
+}
 
-            if (l)
-                printf ("LDR%s R%d 0x%08X", cond_to_string (cond), rd, addr);
-            else
-                printf ("STR%s R%d 0x%08X", cond_to_string (cond), rd, addr);
+// prints the output of the debugging SVCs
+void print_svc (uint32_t r[], uint32_t operand)
+{
+    switch (operand)
+    {
+        // all register values
+        case SVC_DUMP:
+            print_register_dump (r);
+            printf ("\n");
             break;
 
-        case INSTR_SWI:
-            printf ("SVC%s %d", cond_to_string (cond), get_bits (instr, 0, 24));
+        // R0 followed by \n
+        case SVC_PRINT:
+            printf ("%08X\n\n", r[R_0]);
             break;
     }
 }
 
+// prints the state before an instruction executes,
+// with the PC pointing at the instruction
 void print_trace (uint32_t r[], uint32_t instr)
 {
+    char text[DISASM_MAX];
+
+    instr_to_string (r[R_PC], instr, text, sizeof (text));
+
     print_register_dump (r);
-    printf ("Next Instruction=");
-    print_instruction (r, instr);
-    printf ("\n\n");
+    printf ("Next Instruction=%s\n\n", text);
+}
+
+// gives stdout the console buffer, before anything is written to it
+// a terminal still sees each line as it's finished
+void console_open (void)
+{
+    setvbuf (stdout, console_buffer, isatty (STDOUT_FILENO) ? _IOLBF : _IOFBF,
+        CONSOLE_BUFFER);
+}
+
+// writes guest output to the console
+void console_write (const uint8_t* data, uint32_t size)
+{
+    fwrite (data, 1, size, stdout);
+}
+
+// writes out everything the console is holding
+void console_flush (void)
+{
+    fflush (stdout);
 }
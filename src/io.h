@@ -8,16 +8,49 @@
 #define IO_H
 
 #include <stdint.h>
-#include "hash.h"
+#include "pagetable.h"
+
+/* Listings and dumps are written in batches of this size */
+#define IO_BATCH_BYTES (1 << 16)
+
+/* Memory dump formats, each page is shown from its lowest to its highest
+   written byte, so unwritten bytes between the two show as they read */
+#define DUMP_BYTES  0 // a "0xADDR 0xBYTE" line per byte
+#define DUMP_WORDS  1 // a "0xADDR 0xWORD" line per word
+#define DUMP_HEX    2 // rows of 16 bytes followed by their characters
+#define DUMP_RAW    3 // the bytes themselves, with gaps filled by zeros
+
+/* Longest line of a text dump */
+#define DUMP_LINE_MAX 96
+
+// what a memory dump shows
+typedef struct {
+    int format;         // DUMP_*
+    uint32_t lo, hi;    // address range, inclusive
+} dump_options;
+
+/* Memory diffs */
+#define DIFF_RUN_MAX    32  // most bytes shown on one line
+#define DIFF_GAP        4   // unchanged bytes that split two runs
+#define DIFF_LINE_MAX   (12 + 4 * DIFF_RUN_MAX + 2)
+
+/* Console output is buffered until this much is waiting, or the guest halts */
+#define CONSOLE_BUFFER (1 << 20)
+
+extern dump_options dump_settings;
 
 void print_usage (char* name);
+int parse_dump_format (char* name);
 
-void print_memory_dump (hashtable* memory);
+void print_memory_dump (pagetable* memory);
+void print_memory_diff (pagetable* memory);
+void print_disassembly (pagetable* memory);
 void print_register_dump (uint32_t r[]);
 void print_trace (uint32_t r[], uint32_t instr);
+void print_svc (uint32_t r[], uint32_t operand);
 
-char* instr_to_string (uint32_t instr);
-char* opcode_to_string (uint8_t opcode);
-char* cond_to_string (uint8_t cond);
+void console_open (void);
+void console_write (const uint8_t* data, uint32_t size);
+void console_flush (void);
 
 #endif
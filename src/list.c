@@ -46,7 +46,7 @@ void list_reset (list* l)
 // the new element will contain the instruction and its address
 // returns -1 on failure
 // returns 0 on success
-int list_add_node (list* l, uint32_t addr, uint8_t data)
+int list_add_node (list* l, uint32_t addr, uint32_t data)
 {
 	node* n = calloc (1, sizeof(node));
 
@@ -86,7 +86,7 @@ int list_add_node (list* l, uint32_t addr, uint8_t data)
 // see list_add_node for details of workings
 // returns -1 on failure
 // returns 0 on success
-int list_add_node_rear (list* l, uint32_t addr, uint8_t data)
+int list_add_node_rear (list* l, uint32_t addr, uint32_t data)
 {
 	node* n = calloc (1, sizeof(node));
 
@@ -124,6 +124,23 @@ int list_remove_node (list* l, node* n)
 	k = l->start;
 	j = n->next;
 
+	// the first node has no preceeding node
+	if (k == n)
+	{
+		l->start = j;
+
+		if (l->current == n)
+			l->current = j;
+		if (l->end == n)
+			l->end = NULL;
+
+		free (n);
+
+		l->size--;
+
+		return 0;
+	}
+
 	// search list for preceeding node, k, to n
 	while (k->next != n && k != l->end)
                 k = k->next;
@@ -210,13 +227,14 @@ list* list_create (void)
 // destroys the specified list and frees all memory it occupied
 void list_destroy (list* l)
 {
+	node *n, *next;
+
 	// free each item in the list
-	list_reset (l);
-	
-	// remove (and free) each node individually
-	do {
-		list_remove_node (l, l->current);
-	} while (list_advance(l) != -1);
+	for (n = l->start; n; n = next)
+	{
+		next = n->next;
+		free (n);
+	}
 
 	// free the list structure itself
 	free (l);
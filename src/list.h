@@ -18,7 +18,7 @@
 
 typedef struct node {
         uint32_t    addr;
-	uint8_t   data;
+	uint32_t  data;
 	struct node*    next;
 } node;
 
@@ -34,8 +34,8 @@ typedef struct list {
 node*	list_search		(list*, uint32_t);
 int	list_is_empty 		(list*);
 void	list_reset		(list*);
-int	list_add_node 		(list*, uint32_t, uint8_t);
-int	list_add_node_rear 	(list*, uint32_t, uint8_t);
+int	list_add_node 		(list*, uint32_t, uint32_t);
+int	list_add_node_rear 	(list*, uint32_t, uint32_t);
 int	list_remove_node	(list*, node*);
 int 	list_advance 		(list*);
 int	list_retreat		(list*);
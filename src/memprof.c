@@ -0,0 +1,318 @@
+/*
+ * ARM emulator
+ * Luke Mitchell
+ *
+ */
+
+// Guest memory access profiler
+//
+// Every load and store whose condition passes is counted against its page
+// and against the instruction that made it. Each site also keeps the
+// difference between its last two addresses: an access that repeats the
+// difference before it confirms the stride, so an array walk reports its
+// element size with a confidence near 100%.
+//
+// Execution is split into intervals of a fixed number of instructions, and
+// the distinct pages touched in each are its working set. Intervals with no
+// accesses are left out.
+//
+// When recording stops, everything is written as one record per line,
+// tagged with its kind so each can be pulled out for plotting:
+//
+//   page 0x00010 reads writes
+//   site 0x00000014 reads writes stride confidence%
+//   ws instructions pages
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "memprof.h"
+#include "emu.h"
+#include "hash.h"
+
+/* Set while accesses are being recorded */
+int memprof_recording;
+
+/* Output */
+FILE* memprof_fp;
+
+/* Pages and sites, found through their indexes */
+hashtable* memprof_page_index;      // page number -> position in memprof_pages
+memprof_page* memprof_pages;
+int memprof_page_count;
+int memprof_page_capacity;
+
+hashtable* memprof_site_index;      // pc -> position in memprof_sites
+memprof_site* memprof_sites;
+int memprof_site_count;
+int memprof_site_capacity;
+
+/* Last page and site found, as accesses come in runs */
+int memprof_last_page = -1;
+int memprof_last_site = -1;
+
+/* Working set */
+uint64_t memprof_interval_length;
+uint64_t memprof_interval_number;   // current interval, plus one
+memprof_interval* memprof_intervals;
+int memprof_interval_count;
+int memprof_interval_capacity;
+
+/* Helper functions not exposed in header file */
+
+// grows a table of records of size bytes to hold at least one more
+// returns the table, which may have moved
+// returns NULL if there's insufficient memory, leaving the table as it was
+void* memprof_grow (void* table, int count, int* capacity, size_t size)
+{
+    void* t;
+
+    if (count < *capacity)
+        return table;
+
+    t = realloc (table, (*capacity ? 2 * *capacity : 64) * size);
+
+    if (!t)
+        return NULL;
+
+    *capacity = *capacity ? 2 * *capacity : 64;
+
+    return t;
+}
+
+// returns the counts for page, adding them if necessary
+// returns NULL if there's insufficient memory
+memprof_page* memprof_find_page (uint32_t page)
+{
+    node* n;
+    memprof_page* p;
+
+    if (memprof_last_page >= 0 && memprof_pages[memprof_last_page].page == page)
+        return &memprof_pages[memprof_last_page];
+
+    if ((n = hashtable_search (memprof_page_index, page)))
+    {
+        memprof_last_page = n->data;
+        return &memprof_pages[n->data];
+    }
+
+    p = memprof_grow (memprof_pages, memprof_page_count,
+        &memprof_page_capacity, sizeof (memprof_page));
+
+    if (!p)
+        return NULL;
+
+    memprof_pages = p;
+
+    if (hashtable_add_node (memprof_page_index, page, memprof_page_count) != 0)
+        return NULL;
+
+    p = &memprof_pages[memprof_page_count];
+    memset (p, 0, sizeof (memprof_page));
+    p->page = page;
+    memprof_last_page = memprof_page_count++;
+
+    return p;
+}
+
+// returns the counts for the site at pc, adding them if necessary
+// returns NULL if there's insufficient memory
+memprof_site* memprof_find_site (uint32_t pc)
+{
+    node* n;
+    memprof_site* s;
+
+    if (memprof_last_site >= 0 && memprof_sites[memprof_last_site].pc == pc)
+        return &memprof_sites[memprof_last_site];
+
+    if ((n = hashtable_search (memprof_site_index, pc)))
+    {
+        memprof_last_site = n->data;
+        return &memprof_sites[n->data];
+    }
+
+    s = memprof_grow (memprof_sites, memprof_site_count,
+        &memprof_site_capacity, sizeof (memprof_site));
+
+    if (!s)
+        return NULL;
+
+    memprof_sites = s;
+
+    if (hashtable_add_node (memprof_site_index, pc, memprof_site_count) != 0)
+        return NULL;
+
+    s = &memprof_sites[memprof_site_count];
+    memset (s, 0, sizeof (memprof_site));
+    s->pc = pc;
+    memprof_last_site = memprof_site_count++;
+
+    return s;
+}
+
+// returns the current working set interval, starting a new one if the
+// instructions retired have moved past the last
+memprof_interval* memprof_current_interval (void)
+{
+    uint64_t number = retired / memprof_interval_length + 1;
+    memprof_interval* t;
+
+    if (number != memprof_interval_number)
+    {
+        t = memprof_grow (memprof_intervals, memprof_interval_count,
+            &memprof_interval_capacity, sizeof (memprof_interval));
+
+        if (!t)
+            return NULL;
+
+        memprof_intervals = t;
+
+        memprof_interval_number = number;
+        memprof_intervals[memprof_interval_count].start = (number - 1) * memprof_interval_length;
+        memprof_intervals[memprof_interval_count].pages = 0;
+        memprof_interval_count++;
+    }
+
+    return &memprof_intervals[memprof_interval_count - 1];
+}
+
+// orders pages by page number, for qsort
+int memprof_page_compare (const void* a, const void* b)
+{
+    uint32_t x = ((memprof_page*) a)->page;
+    uint32_t y = ((memprof_page*) b)->page;
+
+    return (x > y) - (x < y);
+}
+
+// orders sites by address, for qsort
+int memprof_site_compare (const void* a, const void* b)
+{
+    uint32_t x = ((memprof_site*) a)->pc;
+    uint32_t y = ((memprof_site*) b)->pc;
+
+    return (x > y) - (x < y);
+}
+
+/* Recording */
+
+// starts recording accesses, to be written to path when recording stops
+// interval is the instructions in each working set interval
+// returns 0 on success, -1 if path can't be created
+int memprof_start (char* path, uint64_t interval)
+{
+    if (!(memprof_fp = fopen (path, "w")))
+        return -1;
+
+    memprof_page_index = hashtable_create ();
+    memprof_site_index = hashtable_create ();
+    memprof_interval_length = interval ? interval : MEMPROF_INTERVAL;
+    memprof_recording = 1;
+
+    return 0;
+}
+
+// records an access to addr by the instruction at pc
+void memprof_access (uint32_t pc, uint32_t addr, int store)
+{
+    memprof_page* p = memprof_find_page (PAGE_NUMBER (addr));
+    memprof_site* s = memprof_find_site (pc);
+    memprof_interval* in = memprof_current_interval ();
+    int32_t stride;
+
+    if (p)
+    {
+        if (store)
+            p->writes++;
+        else
+            p->reads++;
+
+        // first touch in this interval?
+        if (in && p->interval != memprof_interval_number)
+        {
+            p->interval = memprof_interval_number;
+            in->pages++;
+        }
+    }
+
+    if (s)
+    {
+        // a stride needs two accesses before it
+        if (s->reads + s->writes > 0)
+        {
+            stride = (int32_t) (addr - s->last);
+
+            if (s->reads + s->writes > 1 && stride == s->stride)
+                s->repeats++;
+
+            s->stride = stride;
+        }
+
+        if (store)
+            s->writes++;
+        else
+            s->reads++;
+
+        s->last = addr;
+    }
+}
+
+// stops recording and writes out the pages, sites and working sets
+void memprof_stop (void)
+{
+    uint64_t accesses;
+    int i;
+
+    if (!memprof_fp)
+        return;
+
+    // heatmap, in address order
+    qsort (memprof_pages, memprof_page_count, sizeof (memprof_page), memprof_page_compare);
+
+    for (i = 0; i < memprof_page_count; i++)
+        fprintf (memprof_fp, "page 0x%05X %llu %llu\n", memprof_pages[i].page,
+            (unsigned long long) memprof_pages[i].reads,
+            (unsigned long long) memprof_pages[i].writes);
+
+    // sites, with the stride most recently seen and how often it repeated
+    qsort (memprof_sites, memprof_site_count, sizeof (memprof_site), memprof_site_compare);
+
+    for (i = 0; i < memprof_site_count; i++)
+    {
+        accesses = memprof_sites[i].reads + memprof_sites[i].writes;
+
+        fprintf (memprof_fp, "site 0x%08X %llu %llu %d %.2f\n", memprof_sites[i].pc,
+            (unsigned long long) memprof_sites[i].reads,
+            (unsigned long long) memprof_sites[i].writes, memprof_sites[i].stride,
+            (accesses > 2) ? 100.0 * memprof_sites[i].repeats / (accesses - 2) : 0.0);
+    }
+
+    for (i = 0; i < memprof_interval_count; i++)
+        fprintf (memprof_fp, "ws %llu %d\n", (unsigned long long) memprof_intervals[i].start,
+            memprof_intervals[i].pages);
+
+    fclose (memprof_fp);
+
+    if (memprof_page_index)
+        hashtable_destroy (memprof_page_index);
+
+    if (memprof_site_index)
+        hashtable_destroy (memprof_site_index);
+
+    free (memprof_pages);
+    free (memprof_sites);
+    free (memprof_intervals);
+
+    memprof_fp = NULL;
+    memprof_recording = 0;
+    memprof_page_index = memprof_site_index = NULL;
+    memprof_pages = NULL;
+    memprof_sites = NULL;
+    memprof_intervals = NULL;
+    memprof_page_count = memprof_page_capacity = 0;
+    memprof_site_count = memprof_site_capacity = 0;
+    memprof_interval_count = memprof_interval_capacity = 0;
+    memprof_last_page = memprof_last_site = -1;
+    memprof_interval_number = 0;
+}
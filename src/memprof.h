@@ -0,0 +1,47 @@
+/*
+ * ARM emulator
+ * Luke Mitchell
+ *
+ */
+
+#ifndef MEMPROF_H
+#define MEMPROF_H
+
+#include <stdint.h>
+
+/* Default instructions in each working set interval */
+#define MEMPROF_INTERVAL 1000000
+
+// accesses to one guest page
+typedef struct {
+    uint32_t page;          // page number
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t interval;      // last working set interval it was touched in, plus one
+} memprof_page;
+
+// accesses made by one load or store
+typedef struct {
+    uint32_t pc;
+    uint64_t reads;
+    uint64_t writes;
+    uint32_t last;          // address last accessed
+    int32_t stride;         // difference between the last two addresses
+    uint64_t repeats;       // accesses that repeated the stride before them
+} memprof_site;
+
+// the pages touched in one working set interval
+typedef struct {
+    uint64_t start;         // instructions retired when it started
+    int pages;
+} memprof_interval;
+
+/* Set while accesses are being recorded */
+extern int memprof_recording;
+
+// recording
+int     memprof_start       (char* path, uint64_t interval);
+void    memprof_access      (uint32_t pc, uint32_t addr, int store);
+void    memprof_stop        (void);
+
+#endif
@@ -0,0 +1,210 @@
+/*
+ * ARM emulator
+ * Luke Mitchell
+ *
+ */
+
+// Emulator metrics
+//
+// The counters themselves live with the code they count: page lookups in
+// the page table, rehashes in hash.c, blocks in block.c and trace bytes in
+// trace.c. emu_get_metrics() gathers them into one snapshot, along with
+// the time spent in each phase of the run.
+//
+// With a metrics file, a timer thread sets metrics_pending once every
+// interval. The emulator sees it between blocks and rewrites the file, so
+// the counters are only ever read from the thread that updates them. The
+// file is written beside its final name and renamed over it, so readers
+// always find a complete set of "key value" lines.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "metrics.h"
+#include "emu.h"
+#include "hash.h"
+#include "block.h"
+#include "trace.h"
+
+/* Set when the metrics file is due to be written */
+atomic_int metrics_pending;
+
+/* Phase timing */
+double phase_total[PHASE_COUNT];
+double phase_started[PHASE_COUNT];    // 0 while the phase isn't running
+
+/* Periodic export */
+char* metrics_path;
+int metrics_interval;
+pthread_t metrics_thread;
+pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t metrics_wake = PTHREAD_COND_INITIALIZER;
+int metrics_stopping;
+
+/* Helper functions not exposed in header file */
+
+// returns the time in seconds from an arbitrary start
+double now (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// timer thread entry point
+// asks for the file to be written every interval until stopped
+void* metrics_timer (void* arg)
+{
+    struct timespec deadline;
+
+    pthread_mutex_lock (&metrics_lock);
+
+    while (!metrics_stopping)
+    {
+        clock_gettime (CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += metrics_interval;
+
+        // only woken early to stop
+        while (!metrics_stopping)
+            if (pthread_cond_timedwait (&metrics_wake, &metrics_lock, &deadline) == ETIMEDOUT)
+                break;
+
+        if (!metrics_stopping)
+            atomic_store (&metrics_pending, 1);
+    }
+
+    pthread_mutex_unlock (&metrics_lock);
+
+    return NULL;
+}
+
+/* Reading */
+
+// fills m with the current value of every counter
+void emu_get_metrics (emu_metrics* m)
+{
+    double t = now ();
+    int i;
+
+    memset (m, 0, sizeof (emu_metrics));
+
+    m->instructions = retired;
+
+    if (memory)
+    {
+        m->memory_lookups = memory->lookups;
+        m->tlb_misses = memory->tlb_misses;
+        m->pages = memory->count;
+        m->dirty_pages = memory->dirty_count;
+    }
+
+    m->blocks = blocks_built;
+    m->hash_resizes = hashtable_resizes;
+    m->hash_max_chain = hashtable_max_chain;
+    m->trace_bytes = atomic_load_explicit (&trace_bytes, memory_order_relaxed);
+
+    // including the time so far of a phase still running
+    for (i = 0; i < PHASE_COUNT; i++)
+        m->phase_seconds[i] = phase_total[i] + (phase_started[i] ? t - phase_started[i] : 0);
+
+    if (m->phase_seconds[PHASE_EXECUTE] > 0)
+        m->mips = m->instructions / m->phase_seconds[PHASE_EXECUTE] / 1e6;
+}
+
+/* Phases */
+
+// starts timing a phase
+void metrics_begin (int phase)
+{
+    phase_started[phase] = now ();
+}
+
+// stops timing a phase, adding the time to its total
+void metrics_end (int phase)
+{
+    if (phase_started[phase])
+        phase_total[phase] += now () - phase_started[phase];
+
+    phase_started[phase] = 0;
+}
+
+/* Periodic export */
+
+// starts writing the metrics to path every interval seconds
+// returns 0 on success, -1 if the timer can't be started
+int metrics_start (char* path, int interval)
+{
+    metrics_path = path;
+    metrics_interval = (interval > 0) ? interval : METRICS_INTERVAL;
+    metrics_stopping = 0;
+
+    if (pthread_create (&metrics_thread, NULL, metrics_timer, NULL) != 0)
+    {
+        metrics_path = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+// writes the metrics file now
+void metrics_write (void)
+{
+    static const char* phases[] = { "load", "execute", "dump" };
+    char tmp[4096];
+    emu_metrics m;
+    FILE* fp;
+    int i;
+
+    atomic_store (&metrics_pending, 0);
+
+    if (!metrics_path)
+        return;
+
+    emu_get_metrics (&m);
+    snprintf (tmp, sizeof (tmp), "%s.tmp", metrics_path);
+
+    if (!(fp = fopen (tmp, "w")))
+        return;
+
+    fprintf (fp, "instructions %llu\n", (unsigned long long) m.instructions);
+    fprintf (fp, "mips %.3f\n", m.mips);
+    fprintf (fp, "memory_lookups %llu\n", (unsigned long long) m.memory_lookups);
+    fprintf (fp, "tlb_misses %llu\n", (unsigned long long) m.tlb_misses);
+    fprintf (fp, "pages %llu\n", (unsigned long long) m.pages);
+    fprintf (fp, "dirty_pages %llu\n", (unsigned long long) m.dirty_pages);
+    fprintf (fp, "blocks %llu\n", (unsigned long long) m.blocks);
+    fprintf (fp, "hash_resizes %llu\n", (unsigned long long) m.hash_resizes);
+    fprintf (fp, "hash_max_chain %d\n", m.hash_max_chain);
+    fprintf (fp, "trace_bytes %llu\n", (unsigned long long) m.trace_bytes);
+
+    for (i = 0; i < PHASE_COUNT; i++)
+        fprintf (fp, "%s_seconds %.6f\n", phases[i], m.phase_seconds[i]);
+
+    fclose (fp);
+    rename (tmp, metrics_path);
+}
+
+// stops the timer and writes the final metrics
+void metrics_stop (void)
+{
+    if (!metrics_path)
+        return;
+
+    pthread_mutex_lock (&metrics_lock);
+    metrics_stopping = 1;
+    pthread_cond_signal (&metrics_wake);
+    pthread_mutex_unlock (&metrics_lock);
+
+    pthread_join (metrics_thread, NULL);
+
+    metrics_write ();
+    metrics_path = NULL;
+}
@@ -0,0 +1,52 @@
+/*
+ * ARM emulator
+ * Luke Mitchell
+ *
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+/* Phases of a run that are timed */
+#define PHASE_LOAD      0 // reading the image
+#define PHASE_EXECUTE   1 // running the guest
+#define PHASE_DUMP      2 // memory dumps and diffs
+#define PHASE_COUNT     3
+
+/* Default seconds between writes of the metrics file */
+#define METRICS_INTERVAL 1
+
+// a snapshot of the emulator's own counters
+typedef struct {
+    uint64_t instructions;      // retired since start-up
+    double mips;                // over the time spent executing
+    uint64_t memory_lookups;    // guest pages looked up
+    uint64_t tlb_misses;        // lookups that went to the hashtable
+    uint64_t pages;             // guest pages allocated
+    uint64_t dirty_pages;       // pages snapshotted since the checkpoint
+    uint64_t blocks;            // blocks decoded
+    uint64_t hash_resizes;      // hashtable rehashes, across every table
+    int hash_max_chain;         // longest hashtable chain seen
+    uint64_t trace_bytes;       // binary trace written, before compression
+    double phase_seconds[PHASE_COUNT];
+} emu_metrics;
+
+/* Set when the metrics file is due to be written */
+extern atomic_int metrics_pending;
+
+// reading
+void    emu_get_metrics     (emu_metrics*);
+
+// phases
+void    metrics_begin       (int phase);
+void    metrics_end         (int phase);
+
+// periodic export
+int     metrics_start       (char* path, int interval);
+void    metrics_write       (void);
+void    metrics_stop        (void);
+
+#endif
@@ -0,0 +1,479 @@
+/*
+ * ARM emulator
+ * Luke Mitchell
+ *
+ */
+
+// Guest memory is held in pages of PAGE_SIZE bytes.
+// The hashtable maps a page number to the page's position in an array,
+// and a small direct-mapped cache of recent lookups (the TLB) saves
+// hashing on the common path.
+//
+// Images may also register lazy regions, backed by a mapping of the
+// image file. A page in a lazy region is only created, and filled from
+// the file, when it is first accessed. Shared regions work the same way,
+// but their pages point into a shared mapping of a host file, so guest
+// stores land in the file itself.
+//
+// Once a checkpoint is taken, the first store to each page after it
+// copies the page aside, so the changes since the checkpoint can be
+// found by comparing the dirty pages with their snapshots.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "pagetable.h"
+#include "hash.h"
+
+/* Helper functions not exposed in header file */
+
+// creates an empty page for the given page number
+// returns NULL if there's insufficient memory
+page* page_create (uint32_t number)
+{
+    page* p = calloc (1, sizeof (page));
+
+    if (p)
+    {
+        p->number = number;
+
+        // nothing written yet
+        p->lo = PAGE_SIZE;
+        p->hi = 0;
+    }
+
+    return p;
+}
+
+// adds a page to the table, growing the page array if needed
+// returns 0 on success, -1 if there's insufficient memory
+int pagetable_insert (pagetable* pt, page* p)
+{
+    page** pages;
+
+    if (pt->count == pt->capacity)
+    {
+        pages = realloc (pt->pages, 2 * pt->capacity * sizeof (page*));
+
+        if (!pages)
+            return -1;
+
+        pt->pages = pages;
+        pt->capacity *= 2;
+    }
+
+    if (hashtable_add_node (pt->index, p->number, pt->count) != 0)
+        return -1;
+
+    pt->pages[pt->count++] = p;
+    pt->tlb[p->number & (PAGETABLE_TLB_SIZE - 1)] = p;
+
+    return 0;
+}
+
+// returns the page holding addr if it is in the table
+// returns NULL otherwise, without faulting it in
+page* pagetable_lookup (pagetable* pt, uint32_t addr)
+{
+    uint32_t number = PAGE_NUMBER (addr);
+    page* p = pt->tlb[number & (PAGETABLE_TLB_SIZE - 1)];
+    node* n;
+
+    if (p && p->number == number)
+        return p;
+
+    pt->tlb_misses++;
+    n = hashtable_search (pt->index, number);
+
+    if (!n)
+        return NULL;
+
+    p = pt->pages[n->data];
+    pt->tlb[number & (PAGETABLE_TLB_SIZE - 1)] = p;
+
+    return p;
+}
+
+// allocates a zeroed page and adds it to the table
+// returns NULL if there's insufficient memory
+page* page_alloc (pagetable* pt, uint32_t number)
+{
+    page* p = page_create (number);
+
+    if (!p)
+        return NULL;
+
+    p->data = calloc (PAGE_SIZE, 1);
+
+    if (!p->data || pagetable_insert (pt, p) != 0)
+    {
+        free (p->data);
+        free (p);
+        return NULL;
+    }
+
+    return p;
+}
+
+// creates the page holding addr from the lazy regions covering it
+// returns NULL if no lazy region covers the page
+page* pagetable_fault (pagetable* pt, uint32_t addr)
+{
+    int i;
+    uint64_t base, lo, hi, file_hi;
+    lazy_region* r;
+    page* p = NULL;
+
+    base = (uint64_t) PAGE_NUMBER (addr) << PAGE_BITS;
+
+    for (i = 0; i < pt->lazy_count; i++)
+    {
+        r = &pt->lazy[i];
+
+        // overlap of the page and the region
+        lo = (base > r->addr) ? base : r->addr;
+        hi = base + PAGE_SIZE;
+
+        if (hi > (uint64_t) r->addr + r->size)
+            hi = (uint64_t) r->addr + r->size;
+
+        if (lo >= hi)
+            continue;
+
+        // shared regions are page aligned, so cover the whole page
+        if (r->flags & PAGE_SHARED)
+        {
+            p = pagetable_map (pt, addr, (uint8_t*) r->src + (base - r->addr), PAGE_SHARED);
+
+            if (p)
+            {
+                p->lo = 0;
+                p->hi = PAGE_SIZE;
+            }
+
+            return p;
+        }
+
+        if (!p && !(p = page_alloc (pt, PAGE_NUMBER (addr))))
+            return NULL;
+
+        // the part of the overlap backed by the file
+        file_hi = (uint64_t) r->addr + r->file_size;
+
+        if (file_hi > hi)
+            file_hi = hi;
+
+        if (lo < file_hi)
+            memcpy (p->data + (lo - base), r->src + (lo - r->addr), file_hi - lo);
+
+        if (lo - base < p->lo)
+            p->lo = lo - base;
+        if (hi - base > p->hi)
+            p->hi = hi - base;
+    }
+
+    return p;
+}
+
+// orders pages by address, for qsort
+int page_compare (const void* a, const void* b)
+{
+    uint32_t x = (*(page**) a)->number;
+    uint32_t y = (*(page**) b)->number;
+
+    return (x > y) - (x < y);
+}
+
+/* Abstract Data Structure functions */
+
+// returns the page holding addr, faulting it in from a lazy region
+// returns NULL if nothing has been stored in that page
+page* pagetable_find (pagetable* pt, uint32_t addr)
+{
+    page* p = pagetable_lookup (pt, addr);
+
+    pt->lookups++;
+
+    if (!p && pt->lazy_count)
+        p = pagetable_fault (pt, addr);
+
+    return p;
+}
+
+// returns the page holding addr, allocating it if necessary
+// returns NULL if there's insufficient memory
+page* pagetable_get (pagetable* pt, uint32_t addr)
+{
+    page* p = pagetable_find (pt, addr);
+
+    if (p)
+        return p;
+
+    return page_alloc (pt, PAGE_NUMBER (addr));
+}
+
+// returns the pages as an array ordered by address
+// and updates a variable to hold the size
+// the caller is responsible for freeing the array
+page** pagetable_sorted (pagetable* pt, int* size)
+{
+    page** arr = malloc ((pt->count + 1) * sizeof (page*));
+
+    if (!arr)
+    {
+        *size = 0;
+        return NULL;
+    }
+
+    memcpy (arr, pt->pages, pt->count * sizeof (page*));
+    qsort (arr, pt->count, sizeof (page*), page_compare);
+
+    *size = pt->count;
+
+    return arr;
+}
+
+// backs the page holding addr with PAGE_SIZE bytes of host memory at data
+// any memory previously owned by the page is released, and the flags
+// other than those saying what backs it are kept
+// returns the page, or NULL if there's insufficient memory
+page* pagetable_map (pagetable* pt, uint32_t addr, uint8_t* data, uint8_t flags)
+{
+    page* p = pagetable_lookup (pt, addr);
+
+    if (!p)
+    {
+        p = page_create (PAGE_NUMBER (addr));
+
+        if (!p || pagetable_insert (pt, p) != 0)
+        {
+            free (p);
+            return NULL;
+        }
+    }
+    else if (!(p->flags & PAGE_MAPPED))
+    {
+        free (p->data);
+    }
+
+    p->data = data;
+    p->flags = (p->flags & ~(PAGE_MAPPED | PAGE_SHARED)) | flags | PAGE_MAPPED;
+
+    // the instructions decoded from it may have changed
+    if (p->flags & PAGE_CODE)
+        pagetable_code_write (pt, p);
+
+    return p;
+}
+
+// records a host mapping to be unmapped when the table is destroyed
+void pagetable_add_mapping (pagetable* pt, void* base, size_t size)
+{
+    host_mapping* m = realloc (pt->mappings,
+        (pt->mapping_count + 1) * sizeof (host_mapping));
+
+    if (!m)
+        return;
+
+    m[pt->mapping_count].base = base;
+    m[pt->mapping_count].size = size;
+
+    pt->mappings = m;
+    pt->mapping_count++;
+}
+
+// registers size bytes of guest memory at addr to be filled from src
+// when first accessed, with bytes past file_size reading as zero
+// src must remain valid for the life of the table
+// returns 0 on success, -1 if there's insufficient memory
+int pagetable_add_lazy (pagetable* pt, uint32_t addr, uint32_t size,
+    uint32_t file_size, const uint8_t* src)
+{
+    lazy_region* r = realloc (pt->lazy, (pt->lazy_count + 1) * sizeof (lazy_region));
+
+    if (!r)
+        return -1;
+
+    r[pt->lazy_count].addr = addr;
+    r[pt->lazy_count].size = size;
+    r[pt->lazy_count].file_size = (file_size < size) ? file_size : size;
+    r[pt->lazy_count].flags = 0;
+    r[pt->lazy_count].src = src;
+
+    pt->lazy = r;
+    pt->lazy_count++;
+
+    return 0;
+}
+
+// backs size bytes of guest memory at addr with the shared host memory
+// at data, so guest stores land there directly
+// addr and size must be multiples of PAGE_SIZE, and pages already in
+// the range are replaced
+// returns 0 on success, -1 on failure
+int pagetable_add_shared (pagetable* pt, uint32_t addr, uint32_t size, uint8_t* data)
+{
+    int i;
+    uint64_t offset;
+    page* p;
+
+    if (PAGE_OFFSET (addr) || PAGE_OFFSET (size)
+        || pagetable_add_lazy (pt, addr, size, size, data) != 0)
+    {
+        return -1;
+    }
+
+    pt->lazy[pt->lazy_count - 1].flags = PAGE_SHARED;
+
+    // existing pages never fault, so point them at the file now
+    for (i = 0; i < pt->count; i++)
+    {
+        p = pt->pages[i];
+        offset = ((uint64_t) p->number << PAGE_BITS) - addr;
+
+        if (offset < size)
+        {
+            pagetable_map (pt, p->number << PAGE_BITS, data + offset, PAGE_SHARED);
+            p->lo = 0;
+            p->hi = PAGE_SIZE;
+        }
+    }
+
+    return 0;
+}
+
+// faults in every page of every lazy region
+// used before walking the whole of memory, such as for a dump
+void pagetable_populate (pagetable* pt)
+{
+    int i;
+    uint64_t addr, end;
+
+    for (i = 0; i < pt->lazy_count; i++)
+    {
+        addr = pt->lazy[i].addr & ~(uint64_t) (PAGE_SIZE - 1);
+        end = (uint64_t) pt->lazy[i].addr + pt->lazy[i].size;
+
+        for (; addr < end; addr += PAGE_SIZE)
+            pagetable_find (pt, addr);
+    }
+}
+
+// takes a checkpoint, tracking stores from here on
+// the snapshots of the previous checkpoint are released
+void pagetable_checkpoint (pagetable* pt)
+{
+    int i;
+
+    for (i = 0; i < pt->dirty_count; i++)
+    {
+        free (pt->dirty[i]->snapshot);
+        pt->dirty[i]->snapshot = NULL;
+        pt->dirty[i]->flags &= ~PAGE_DIRTY;
+    }
+
+    pt->dirty_count = 0;
+    pt->tracking = 1;
+}
+
+// notes that the instructions on page p may have changed, so the blocks
+// built from it are thrown away before another block runs
+// the page is no longer PAGE_CODE until blocks are built from it again
+void pagetable_code_write (pagetable* pt, page* p)
+{
+    if (!(p->flags & PAGE_CODE))
+        return;
+
+    p->flags &= ~PAGE_CODE;
+
+    if (pt->code_write_count < PAGETABLE_CODE_WRITES)
+        pt->code_writes[pt->code_write_count] = p->number;
+
+    pt->code_write_count++;
+    pt->code_written = 1;
+}
+
+// snapshots page p ahead of its first store since the checkpoint
+// returns 0 on success, -1 if there's insufficient memory
+int pagetable_mark_dirty (pagetable* pt, page* p)
+{
+    page** dirty;
+
+    if (pt->dirty_count == pt->dirty_capacity)
+    {
+        dirty = realloc (pt->dirty, (pt->dirty_capacity ? 2 * pt->dirty_capacity : 16)
+            * sizeof (page*));
+
+        if (!dirty)
+            return -1;
+
+        pt->dirty = dirty;
+        pt->dirty_capacity = pt->dirty_capacity ? 2 * pt->dirty_capacity : 16;
+    }
+
+    p->snapshot = malloc (PAGE_SIZE);
+
+    if (!p->snapshot)
+        return -1;
+
+    memcpy (p->snapshot, p->data, PAGE_SIZE);
+    p->flags |= PAGE_DIRTY;
+    pt->dirty[pt->dirty_count++] = p;
+
+    return 0;
+}
+
+// returns the pages stored to since the checkpoint, ordered by
+// address, and updates a variable to hold the size
+// the array belongs to the table
+page** pagetable_dirty (pagetable* pt, int* size)
+{
+    qsort (pt->dirty, pt->dirty_count, sizeof (page*), page_compare);
+
+    *size = pt->dirty_count;
+
+    return pt->dirty;
+}
+
+// create a new, empty, page table
+// returns NULL if there's insufficient memory
+pagetable* pagetable_create (void)
+{
+    pagetable* pt = calloc (1, sizeof (pagetable));
+
+    if (!pt)
+        return NULL;
+
+    pt->capacity = 16;
+    pt->pages = malloc (pt->capacity * sizeof (page*));
+    pt->index = hashtable_create ();
+
+    return pt;
+}
+
+// destroys the specified page table and frees all memory used by it
+void pagetable_destroy (pagetable* pt)
+{
+    int i;
+
+    for (i = 0; i < pt->count; i++)
+    {
+        if (!(pt->pages[i]->flags & PAGE_MAPPED))
+            free (pt->pages[i]->data);
+
+        free (pt->pages[i]->snapshot);
+        free (pt->pages[i]);
+    }
+
+    for (i = 0; i < pt->mapping_count; i++)
+        munmap (pt->mappings[i].base, pt->mappings[i].size);
+
+    hashtable_destroy (pt->index);
+
+    free (pt->dirty);
+    free (pt->lazy);
+    free (pt->mappings);
+    free (pt->pages);
+    free (pt);
+}
@@ -0,0 +1,110 @@
+/*
+ * ARM emulator
+ * Luke Mitchell
+ *
+ */
+
+#ifndef PAGETABLE_H
+#define PAGETABLE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "hash.h"
+
+/* Page geometry */
+#define PAGE_BITS 12
+#define PAGE_SIZE (1 << PAGE_BITS)
+#define PAGE_NUMBER(addr) ((uint32_t) (addr) >> PAGE_BITS)
+#define PAGE_OFFSET(addr) ((uint32_t) (addr) & (PAGE_SIZE - 1))
+
+/* Number of recently used pages remembered, must be a power of two */
+#define PAGETABLE_TLB_SIZE 64
+
+/* Code pages remembered as stored to between blocks, beyond which every
+   block is thrown away */
+#define PAGETABLE_CODE_WRITES 8
+
+/* Page flags */
+#define PAGE_MAPPED 0x01 // data belongs to a host mapping, not the page
+#define PAGE_SHARED 0x02 // data is a shared mapping of a host file
+#define PAGE_CODE   0x04 // holds instructions decoded into a block
+#define PAGE_DIRTY  0x08 // stored to since the last checkpoint
+#define PAGE_WATCH  0x10 // has a watchpoint, accesses are passed to the watcher
+#define PAGE_DEVICE 0x20 // accesses go to the device, not the data
+
+// a page of guest memory
+typedef struct {
+    uint32_t number;    // guest address >> PAGE_BITS
+    uint8_t flags;
+    uint16_t lo, hi;    // range of offsets that have been written
+    uint8_t* data;
+    uint8_t* snapshot;  // data at the last checkpoint, while PAGE_DIRTY
+    struct device* device; // while PAGE_DEVICE
+} page;
+
+// a host mapping whose lifetime is tied to the page table
+typedef struct {
+    void* base;
+    size_t size;
+} host_mapping;
+
+// part of a host mapping brought into guest memory a page at a time,
+// when each page is first accessed
+// pages are copied from src, unless the region is PAGE_SHARED, in which
+// case they point straight at it
+typedef struct {
+    uint32_t addr;      // guest address of the first byte
+    uint32_t size;      // bytes of guest memory covered
+    uint32_t file_size; // bytes backed by src, the rest read as zero
+    uint8_t flags;
+    const uint8_t* src;
+} lazy_region;
+
+// data structure representing guest memory
+typedef struct {
+    hashtable* index;   // page number -> position in pages
+    page** pages;
+    int count;
+    int capacity;
+    page* tlb[PAGETABLE_TLB_SIZE];
+    host_mapping* mappings;
+    int mapping_count;
+    lazy_region* lazy;
+    int lazy_count;
+    uint8_t code_written; // a PAGE_CODE page has been stored to
+    uint32_t code_writes[PAGETABLE_CODE_WRITES]; // numbers of those pages
+    int code_write_count; // may pass PAGETABLE_CODE_WRITES, when they didn't fit
+    uint8_t tracking;   // pages are snapshotted when first stored to
+    page** dirty;       // pages stored to since the last checkpoint
+    int dirty_count;
+    int dirty_capacity;
+    void (*watcher) (uint32_t addr, int size, int store); // for PAGE_WATCH pages
+    uint64_t lookups;   // calls to pagetable_find
+    uint64_t tlb_misses;
+} pagetable;
+
+// lookup
+page*           pagetable_find          (pagetable*, uint32_t);
+page*           pagetable_get           (pagetable*, uint32_t);
+page**          pagetable_sorted        (pagetable*, int*);
+
+// host-backed pages
+page*           pagetable_map           (pagetable*, uint32_t, uint8_t*, uint8_t);
+void            pagetable_add_mapping   (pagetable*, void*, size_t);
+int             pagetable_add_lazy      (pagetable*, uint32_t, uint32_t, uint32_t, const uint8_t*);
+int             pagetable_add_shared    (pagetable*, uint32_t, uint32_t, uint8_t*);
+void            pagetable_populate      (pagetable*);
+
+// code changes
+void            pagetable_code_write    (pagetable*, page*);
+
+// dirty tracking
+void            pagetable_checkpoint    (pagetable*);
+int             pagetable_mark_dirty    (pagetable*, page*);
+page**          pagetable_dirty         (pagetable*, int*);
+
+// ctor and dtor
+pagetable*      pagetable_create        (void);
+void            pagetable_destroy       (pagetable*);
+
+#endif
@@ -0,0 +1,253 @@
+/*
+ * ARM emulator
+ * Luke Mitchell
+ *
+ */
+
+// Plugins
+//
+// Plugins are loaded with dlopen and handed an emu_plugin_api (see
+// emu_plugin.h). Their subscriptions and counters are only looked at when
+// a block is decoded: each instruction is given the hooks that cover it,
+// and each block the counters for its start address. Blocks without hooks
+// or counters run as if no plugin were loaded, and counters are added to
+// in place when a block finishes.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dlfcn.h>
+#include "plugin.h"
+#include "emu.h"
+#include "common.h"
+#include "instructions.h"
+
+// a loaded plugin
+typedef struct {
+    void* handle;
+    void (*exit) (void);
+} plugin;
+
+/* Set while a load or store with a memory hook runs */
+int hook_memory;
+
+/* Loaded plugins */
+plugin plugins[PLUGIN_MAX];
+int plugin_count;
+
+/* Subscriptions and counters, across every plugin */
+plugin_subscription* subscriptions;
+int subscription_count;
+plugin_counter** counters;
+int counter_count;
+
+emu_plugin_api plugin_api;
+
+/* Helper functions not exposed in header file */
+
+// api: subscribes to events of kind in lo to hi
+// returns 0 on success, -1 on failure
+int plugin_subscribe (int kind, uint32_t lo, uint32_t hi, emu_callback callback, void* user)
+{
+    plugin_subscription* s;
+
+    if (kind < 0 || kind >= EMU_EVENT_COUNT || !callback)
+        return -1;
+
+    s = realloc (subscriptions, (subscription_count + 1) * sizeof (plugin_subscription));
+
+    if (!s)
+        return -1;
+
+    subscriptions = s;
+    s = &subscriptions[subscription_count++];
+
+    s->kind = kind;
+    s->lo = lo;
+    s->hi = hi;
+    s->callback = callback;
+    s->user = user;
+
+    return 0;
+}
+
+// api: returns a new counter of kind for blocks starting in lo to hi
+// returns NULL on failure
+uint64_t* plugin_counter_create (int kind, uint32_t lo, uint32_t hi)
+{
+    plugin_counter** list;
+    plugin_counter* c;
+
+    if (kind != EMU_COUNT_BLOCKS && kind != EMU_COUNT_INSTRUCTIONS)
+        return NULL;
+
+    list = realloc (counters, (counter_count + 1) * sizeof (plugin_counter*));
+
+    if (!list)
+        return NULL;
+
+    counters = list;
+
+    // each counter is allocated on its own, so it never moves
+    if (!(c = calloc (1, sizeof (plugin_counter))))
+        return NULL;
+
+    c->kind = kind;
+    c->lo = lo;
+    c->hi = hi;
+    counters[counter_count++] = c;
+
+    return &c->value;
+}
+
+// api: reads a word of guest memory
+uint32_t plugin_read32 (uint32_t addr)
+{
+    return fetch32 (memory, addr);
+}
+
+// returns 1 if a subscription of kind covers pc, 0 otherwise
+int subscribed (int kind, uint32_t pc)
+{
+    int i;
+
+    for (i = 0; i < subscription_count; i++)
+        if (subscriptions[i].kind == kind && pc >= subscriptions[i].lo && pc <= subscriptions[i].hi)
+            return 1;
+
+    return 0;
+}
+
+/* Loading */
+
+// loads the plugin described by spec, "path" or "path=args"
+// returns 0 on success, -1 if it can't be loaded or fails to start
+int plugin_load (char* spec)
+{
+    int (*init) (emu_plugin_api*, const char*);
+    char* args = strchr (spec, '=');
+    void* handle;
+
+    if (plugin_count == PLUGIN_MAX)
+        return -1;
+
+    if (args)
+        *args++ = '\0';
+
+    if (!(handle = dlopen (spec, RTLD_NOW | RTLD_LOCAL)))
+    {
+        fprintf (stderr, "%s\n", dlerror ());
+        return -1;
+    }
+
+    init = (int (*) (emu_plugin_api*, const char*)) dlsym (handle, "emu_plugin_init");
+
+    plugin_api.version = EMU_PLUGIN_VERSION;
+    plugin_api.subscribe = plugin_subscribe;
+    plugin_api.counter = plugin_counter_create;
+    plugin_api.registers = registers;
+    plugin_api.flags = flags;
+    plugin_api.read32 = plugin_read32;
+
+    if (!init || init (&plugin_api, args ? args : "") != 0)
+    {
+        dlclose (handle);
+        return -1;
+    }
+
+    plugins[plugin_count].handle = handle;
+    plugins[plugin_count].exit = (void (*) (void)) dlsym (handle, "emu_plugin_exit");
+    plugin_count++;
+
+    return 0;
+}
+
+// tells every plugin the run is over, then unloads them
+void plugin_unload_all (void)
+{
+    int i;
+
+    for (i = 0; i < plugin_count; i++)
+        if (plugins[i].exit)
+            plugins[i].exit ();
+
+    for (i = 0; i < plugin_count; i++)
+        dlclose (plugins[i].handle);
+
+    for (i = 0; i < counter_count; i++)
+        free (counters[i]);
+
+    free (counters);
+    free (subscriptions);
+
+    counters = NULL;
+    subscriptions = NULL;
+    plugin_count = counter_count = subscription_count = 0;
+}
+
+/* Decoding */
+
+// returns the hooks for an instruction of type at pc
+// first is set for the first instruction of a block
+uint8_t plugin_hooks (uint32_t pc, uint8_t type, int first)
+{
+    uint8_t hooks = 0;
+
+    if (!subscription_count)
+        return 0;
+
+    if (first && subscribed (EMU_EVENT_BLOCK, pc))
+        hooks |= HOOK_BLOCK;
+
+    if ((type == INSTR_LS || type == INSTR_LSM || type == INSTR_LSH)
+        && subscribed (EMU_EVENT_MEMORY, pc))
+        hooks |= HOOK_MEMORY;
+
+    if (type == INSTR_SWI && subscribed (EMU_EVENT_SVC, pc))
+        hooks |= HOOK_SVC;
+
+    if (subscribed (EMU_EVENT_BRANCH, pc))
+        hooks |= HOOK_BRANCH;
+
+    return hooks;
+}
+
+// finds the counters for a block starting at start, filling in
+// up to max of them and their kinds
+// returns the number found
+int plugin_counters (uint32_t start, uint64_t** found, uint8_t* kinds, int max)
+{
+    int i, n = 0;
+
+    for (i = 0; i < counter_count && n < max; i++)
+    {
+        if (start >= counters[i]->lo && start <= counters[i]->hi)
+        {
+            found[n] = &counters[i]->value;
+            kinds[n] = counters[i]->kind;
+            n++;
+        }
+    }
+
+    return n;
+}
+
+/* Events */
+
+// calls every subscriber to events of kind covering pc
+void plugin_event (int kind, uint32_t pc, uint32_t value, uint32_t info)
+{
+    emu_event e;
+    int i;
+
+    e.kind = kind;
+    e.pc = pc;
+    e.value = value;
+    e.flags = info;
+    e.registers = registers;
+
+    for (i = 0; i < subscription_count; i++)
+        if (subscriptions[i].kind == kind && pc >= subscriptions[i].lo && pc <= subscriptions[i].hi)
+            subscriptions[i].callback (subscriptions[i].user, &e);
+}
@@ -0,0 +1,52 @@
+/*
+ * ARM emulator
+ * Luke Mitchell
+ *
+ */
+
+#ifndef PLUGIN_H
+#define PLUGIN_H
+
+#include <stdint.h>
+#include "emu_plugin.h"
+
+/* Most plugins loaded at once */
+#define PLUGIN_MAX 16
+
+/* Hooks decided when code is decoded, one bit per EMU_EVENT_* */
+#define HOOK_BLOCK  (1 << EMU_EVENT_BLOCK)
+#define HOOK_MEMORY (1 << EMU_EVENT_MEMORY)
+#define HOOK_SVC    (1 << EMU_EVENT_SVC)
+#define HOOK_BRANCH (1 << EMU_EVENT_BRANCH)
+#define HOOK_COUNT  (1 << EMU_EVENT_COUNT)  // the block has counters
+
+// an event subscription made by a plugin
+typedef struct {
+    int kind;
+    uint32_t lo, hi;
+    emu_callback callback;
+    void* user;
+} plugin_subscription;
+
+// a counter handed to a plugin
+typedef struct {
+    int kind;
+    uint32_t lo, hi;
+    uint64_t value;
+} plugin_counter;
+
+/* Set while a load or store with a memory hook runs */
+extern int hook_memory;
+
+// loading
+int         plugin_load             (char* spec);
+void        plugin_unload_all       (void);
+
+// decoding
+uint8_t     plugin_hooks            (uint32_t pc, uint8_t type, int first);
+int         plugin_counters         (uint32_t start, uint64_t** counters, uint8_t* kinds, int max);
+
+// events
+void        plugin_event            (int kind, uint32_t pc, uint32_t value, uint32_t info);
+
+#endif
@@ -0,0 +1,319 @@
+/*
+ * ARM emulator
+ * Luke Mitchell
+ *
+ */
+
+// Guest profiler
+//
+// While profiling, the emulator counts complete runs of each block, and
+// for the rare runs cut short (a halt, a store to code, the instruction
+// limit) how far they got. Conditional instructions also count how often
+// their condition passed. Counts are moved out of the block cache into
+// the profile before blocks are thrown away, and at the end of the run,
+// so self-modifying code doesn't lose them.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "profile.h"
+#include "disasm.h"
+#include "instructions.h"
+
+/* The profile being gathered, or NULL when not profiling */
+profile* guest_profile;
+
+/* Helper functions not exposed in header file */
+
+// returns the counts for pc, adding them if necessary
+// returns NULL if there's insufficient memory
+profile_pc* profile_find_pc (profile* prof, uint32_t pc)
+{
+    node* n = hashtable_search (prof->pc_index, pc);
+    profile_pc* pcs;
+
+    if (n)
+        return &prof->pcs[n->data];
+
+    if (prof->pc_count == prof->pc_capacity)
+    {
+        pcs = realloc (prof->pcs, 2 * prof->pc_capacity * sizeof (profile_pc));
+
+        if (!pcs)
+            return NULL;
+
+        prof->pcs = pcs;
+        prof->pc_capacity *= 2;
+    }
+
+    if (hashtable_add_node (prof->pc_index, pc, prof->pc_count) != 0)
+        return NULL;
+
+    memset (&prof->pcs[prof->pc_count], 0, sizeof (profile_pc));
+    prof->pcs[prof->pc_count].pc = pc;
+
+    return &prof->pcs[prof->pc_count++];
+}
+
+// returns the counts for the block at start, adding them if necessary
+// returns NULL if there's insufficient memory
+profile_block* profile_find_block (profile* prof, uint32_t start)
+{
+    node* n = hashtable_search (prof->block_index, start);
+    profile_block* blocks;
+
+    if (n)
+        return &prof->blocks[n->data];
+
+    if (prof->block_count == prof->block_capacity)
+    {
+        blocks = realloc (prof->blocks, 2 * prof->block_capacity * sizeof (profile_block));
+
+        if (!blocks)
+            return NULL;
+
+        prof->blocks = blocks;
+        prof->block_capacity *= 2;
+    }
+
+    if (hashtable_add_node (prof->block_index, start, prof->block_count) != 0)
+        return NULL;
+
+    memset (&prof->blocks[prof->block_count], 0, sizeof (profile_block));
+    prof->blocks[prof->block_count].start = start;
+
+    return &prof->blocks[prof->block_count++];
+}
+
+// orders pc counts by count, highest first, for qsort
+int profile_pc_compare (const void* a, const void* b)
+{
+    uint64_t x = (*(profile_pc**) a)->count;
+    uint64_t y = (*(profile_pc**) b)->count;
+
+    return (x < y) - (x > y);
+}
+
+// orders block counts by instructions retired, highest first, for qsort
+int profile_block_compare (const void* a, const void* b)
+{
+    uint64_t x = (*(profile_block**) a)->instructions;
+    uint64_t y = (*(profile_block**) b)->instructions;
+
+    return (x < y) - (x > y);
+}
+
+// returns count as a percentage of total
+double percent (uint64_t count, uint64_t total)
+{
+    return total ? 100.0 * count / total : 0.0;
+}
+
+// prints the hottest addresses
+void report_pcs (profile* prof, uint64_t total)
+{
+    int i, n = prof->pc_count;
+    char text[DISASM_MAX];
+    profile_pc** sorted = malloc ((n + 1) * sizeof (profile_pc*));
+
+    if (!sorted)
+        return;
+
+    for (i = 0; i < n; i++)
+        sorted[i] = &prof->pcs[i];
+
+    qsort (sorted, n, sizeof (profile_pc*), profile_pc_compare);
+
+    printf ("Hot instructions:\n");
+
+    for (i = 0; i < n && i < PROFILE_TOP; i++)
+    {
+        instr_to_string (sorted[i]->pc, sorted[i]->word, text, sizeof (text));
+        printf ("  0x%08X %12llu %6.2f%%  %s\n", sorted[i]->pc,
+            (unsigned long long) sorted[i]->count, percent (sorted[i]->count, total), text);
+    }
+
+    printf ("\n");
+    free (sorted);
+}
+
+// prints the blocks that retired the most instructions
+void report_blocks (profile* prof, uint64_t total)
+{
+    int i, n = prof->block_count;
+    profile_block** sorted = malloc ((n + 1) * sizeof (profile_block*));
+
+    if (!sorted)
+        return;
+
+    for (i = 0; i < n; i++)
+        sorted[i] = &prof->blocks[i];
+
+    qsort (sorted, n, sizeof (profile_block*), profile_block_compare);
+
+    printf ("Hot blocks:\n");
+
+    for (i = 0; i < n && i < PROFILE_TOP; i++)
+    {
+        printf ("  0x%08X %3d instructions %12llu entries %6.2f%%\n", sorted[i]->start,
+            sorted[i]->length, (unsigned long long) sorted[i]->entries,
+            percent (sorted[i]->instructions, total));
+    }
+
+    printf ("\n");
+    free (sorted);
+}
+
+/* Gathering */
+
+// moves the counts held by the blocks in bc into prof
+void profile_harvest (profile* prof, blockcache* bc)
+{
+    int i, j;
+    uint64_t count;
+    block* b;
+    decoded_instruction* d;
+    profile_pc* pc;
+    profile_block* pb;
+
+    for (i = 0; i < bc->count; i++)
+    {
+        b = bc->blocks[i];
+
+        if (b->executions == 0 && b->instr[0].partial == 0)
+            continue;
+
+        if (!(pb = profile_find_block (prof, b->start)))
+            return;
+
+        pb->length = b->length;
+        pb->entries += b->executions;
+        pb->cycles += b->cycles;
+
+        for (j = 0; j < b->length; j++)
+        {
+            d = &b->instr[j];
+            count = b->executions + d->partial;
+
+            // runs cut short are entries too, counted at their first instruction
+            if (j == 0)
+                pb->entries += d->partial;
+
+            if (count == 0)
+                continue;
+
+            if (!(pc = profile_find_pc (prof, b->start + 4 * j)))
+                return;
+
+            pc->word = d->word;
+            pc->type = d->type;
+            pc->cond = d->cond;
+            pc->count += count;
+            pc->passed += d->passed;
+            pb->instructions += count;
+
+            d->partial = 0;
+            d->passed = 0;
+        }
+
+        b->executions = 0;
+        b->cycles = 0;
+    }
+}
+
+/* Reporting */
+
+// prints the profile to stdout: instructions retired by type, data
+// processing opcode and condition, then the hottest instructions and
+// blocks with their share of everything retired
+void profile_report (profile* prof)
+{
+    static const char* types[] = { "DP", "LS", "B", "SWI", "MUL", "LSM", "LSH" };
+    uint64_t total = 0, by_type[8] = { 0 }, by_opcode[16] = { 0 },
+        by_cond[16] = { 0 }, passed[16] = { 0 };
+    profile_pc* pc;
+    int i;
+
+    for (i = 0; i < prof->pc_count; i++)
+    {
+        pc = &prof->pcs[i];
+        total += pc->count;
+        by_type[(pc->type <= INSTR_LSH) ? pc->type : 7] += pc->count;
+
+        if (pc->type == INSTR_DP)
+            by_opcode[(pc->word >> 21) & 0xF] += pc->count;
+
+        by_cond[pc->cond] += pc->count;
+        passed[pc->cond] += pc->passed;
+    }
+
+    printf ("Profile: %llu instructions retired\n\n", (unsigned long long) total);
+
+    printf ("By type:\n");
+
+    for (i = 0; i < 8; i++)
+        if (by_type[i])
+            printf ("  %-8s %12llu %6.2f%%\n", (i < 7) ? types[i] : "UNKNOWN",
+                (unsigned long long) by_type[i], percent (by_type[i], total));
+
+    printf ("\nBy data processing opcode:\n");
+
+    for (i = 0; i < 16; i++)
+        if (by_opcode[i])
+            printf ("  %-8s %12llu %6.2f%%\n", opcode_to_string (i),
+                (unsigned long long) by_opcode[i], percent (by_opcode[i], total));
+
+    printf ("\nConditional instructions:\n");
+
+    for (i = 0; i < 16; i++)
+        if (i != COND_AL && by_cond[i])
+            printf ("  %-8s %12llu passed %12llu failed %6.2f%% passed\n", cond_to_string (i),
+                (unsigned long long) passed[i], (unsigned long long) (by_cond[i] - passed[i]),
+                percent (passed[i], by_cond[i]));
+
+    printf ("\n");
+
+    report_pcs (prof, total);
+    report_blocks (prof, total);
+}
+
+// create a new, empty, profile
+// returns NULL if there's insufficient memory
+profile* profile_create (void)
+{
+    profile* prof = calloc (1, sizeof (profile));
+
+    if (!prof)
+        return NULL;
+
+    prof->pc_capacity = 16;
+    prof->pcs = malloc (prof->pc_capacity * sizeof (profile_pc));
+    prof->pc_index = hashtable_create ();
+
+    prof->block_capacity = 16;
+    prof->blocks = malloc (prof->block_capacity * sizeof (profile_block));
+    prof->block_index = hashtable_create ();
+
+    if (!prof->pcs || !prof->pc_index || !prof->blocks || !prof->block_index)
+    {
+        profile_destroy (prof);
+        return NULL;
+    }
+
+    return prof;
+}
+
+// destroys the specified profile and frees all memory used by it
+void profile_destroy (profile* prof)
+{
+    if (prof->pc_index)
+        hashtable_destroy (prof->pc_index);
+
+    if (prof->block_index)
+        hashtable_destroy (prof->block_index);
+
+    free (prof->pcs);
+    free (prof->blocks);
+    free (prof);
+}
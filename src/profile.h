@@ -0,0 +1,62 @@
+/*
+ * ARM emulator
+ * Luke Mitchell
+ *
+ */
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+#include "hash.h"
+#include "block.h"
+
+/* Rows shown in each hot spot table */
+#define PROFILE_TOP 20
+
+// execution counts for one instruction address
+typedef struct {
+    uint32_t pc;
+    uint32_t word;      // the instruction last seen there
+    uint8_t type;       // INSTR_*
+    uint8_t cond;       // COND_*
+    uint64_t count;     // times retired
+    uint64_t passed;    // times its condition passed
+} profile_pc;
+
+// execution counts for one block start address
+typedef struct {
+    uint32_t start;
+    int length;
+    uint64_t entries;       // times the block was entered
+    uint64_t instructions;  // instructions retired within it
+    uint64_t cycles;        // estimated, when timing
+} profile_block;
+
+// counts gathered from the block cache over a run
+typedef struct {
+    hashtable* pc_index;    // pc -> position in pcs
+    profile_pc* pcs;
+    int pc_count;
+    int pc_capacity;
+
+    hashtable* block_index; // start -> position in blocks
+    profile_block* blocks;
+    int block_count;
+    int block_capacity;
+} profile;
+
+/* The profile being gathered, or NULL when not profiling */
+extern profile* guest_profile;
+
+// gathering
+void            profile_harvest         (profile*, blockcache*);
+
+// reporting
+void            profile_report          (profile*);
+
+// ctor and dtor
+profile*        profile_create          (void);
+void            profile_destroy         (profile*);
+
+#endif
@@ -0,0 +1,110 @@
+/*
+ * ARM emulator
+ * Luke Mitchell
+ *
+ */
+
+// Single-producer, single-consumer ring buffer
+//
+// head and tail count records ever pushed and released, and are reduced
+// modulo the capacity to index the buffer. Only the producer writes head
+// and only the consumer writes tail, so neither needs a lock: a release
+// store publishes a record, or frees its slot, to the other thread.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "ring.h"
+
+// copies a record into the ring
+// returns 0 on success, -1 if the ring is full
+int ring_push (ring* r, const void* record)
+{
+    size_t head = atomic_load_explicit (&r->head, memory_order_relaxed);
+
+    // only look at the consumer's index when the ring seems full
+    if (head - r->cached_tail == r->capacity)
+    {
+        r->cached_tail = atomic_load_explicit (&r->tail, memory_order_acquire);
+
+        if (head - r->cached_tail == r->capacity)
+            return -1;
+    }
+
+    memcpy (r->records + (head & (r->capacity - 1)) * r->size, record, r->size);
+    atomic_store_explicit (&r->head, head + 1, memory_order_release);
+
+    return 0;
+}
+
+// finds the records ready to be read, which stay in place until released
+// sets first to the oldest, and returns how many follow it contiguously
+size_t ring_peek (ring* r, void** first)
+{
+    size_t tail = atomic_load_explicit (&r->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit (&r->head, memory_order_acquire);
+    size_t index = tail & (r->capacity - 1);
+    size_t n = head - tail;
+
+    // stop at the end of the buffer, the rest is read next time
+    if (n > r->capacity - index)
+        n = r->capacity - index;
+
+    *first = r->records + index * r->size;
+
+    return n;
+}
+
+// hands n records returned by ring_peek back to the producer
+void ring_release (ring* r, size_t n)
+{
+    size_t tail = atomic_load_explicit (&r->tail, memory_order_relaxed);
+    atomic_store_explicit (&r->tail, tail + n, memory_order_release);
+}
+
+// returns the number of records waiting to be read
+size_t ring_count (ring* r)
+{
+    return atomic_load_explicit (&r->head, memory_order_acquire)
+        - atomic_load_explicit (&r->tail, memory_order_acquire);
+}
+
+// creates a ring of capacity records of size bytes
+// capacity is rounded up to a power of two
+// returns NULL if there's insufficient memory
+ring* ring_create (size_t size, size_t capacity)
+{
+    size_t c = 1;
+    ring* r;
+
+    while (c < capacity)
+        c <<= 1;
+
+    r = calloc (1, sizeof (ring));
+
+    if (!r)
+        return NULL;
+
+    r->records = malloc (c * size);
+
+    if (!r->records)
+    {
+        free (r);
+        return NULL;
+    }
+
+    r->size = size;
+    r->capacity = c;
+    atomic_init (&r->head, 0);
+    atomic_init (&r->tail, 0);
+
+    return r;
+}
+
+// destroys the ring and frees all memory used by it
+void ring_destroy (ring* r)
+{
+    free (r->records);
+    free (r);
+}
@@ -0,0 +1,46 @@
+/*
+ * ARM emulator
+ * Luke Mitchell
+ *
+ */
+
+#ifndef RING_H
+#define RING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+/* Bytes between the producer's and consumer's indexes, to keep them
+   on separate cache lines */
+#define RING_PAD 64
+
+// a lock-free ring buffer of fixed-size records
+// safe for one producer thread and one consumer thread
+typedef struct {
+    uint8_t* records;
+    size_t size;            // bytes per record
+    size_t capacity;        // records held, a power of two
+
+    _Atomic size_t head;    // next record written by the producer
+    size_t cached_tail;     // producer's last view of tail
+    char pad[RING_PAD];
+
+    _Atomic size_t tail;    // next record read by the consumer
+} ring;
+
+// producer
+int             ring_push       (ring*, const void*);
+
+// consumer
+size_t          ring_peek       (ring*, void**);
+void            ring_release    (ring*, size_t);
+
+// either thread
+size_t          ring_count      (ring*);
+
+// ctor and dtor
+ring*           ring_create     (size_t, size_t);
+void            ring_destroy    (ring*);
+
+#endif
@@ -0,0 +1,278 @@
+/*
+ * ARM emulator
+ * Luke Mitchell
+ *
+ */
+
+// Semihosting file I/O
+//
+// SVC 0x123456 follows the ARM semihosting convention: R0 holds the
+// operation, R1 points at its parameter words, and the result comes back
+// in R0. Handles are host file descriptors behind a table, so the guest
+// can only reach files it opened by name.
+//
+// Reads and writes go straight between the file and the pages of guest
+// memory. store_prepare and load_span give the host addresses of each
+// page, and a run of them is moved by one preadv or pwritev. Only the
+// bytes a read actually fills are then committed as stored to. Watched
+// and device pages are copied through a buffer, as the guest would see
+// them.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "semihost.h"
+#include "common.h"
+#include "io.h"
+#include "trace.h"
+
+/* Files opened by the guest, handles are their index plus one */
+semihost_file semihost_files[SEMIHOST_FILES];
+
+/* Helper functions not exposed in header file */
+
+// returns the file with the given handle, or NULL if it isn't open
+semihost_file* semihost_file_get (uint32_t handle)
+{
+    if (handle == 0 || handle > SEMIHOST_FILES || !semihost_files[handle - 1].open)
+        return NULL;
+
+    return &semihost_files[handle - 1];
+}
+
+// moves up to size bytes between the file at position and memory at addr,
+// into memory when in is set, and out of it otherwise
+// returns the number of bytes moved
+uint32_t semihost_transfer (int fd, off_t position, pagetable* memory,
+    uint32_t addr, uint32_t size, int in)
+{
+    struct iovec iov[SEMIHOST_IOV];
+    uint8_t buffer[PAGE_SIZE];
+    uint32_t total = 0, queued, n;
+    ssize_t moved;
+    void* data;
+    int count;
+    struct stat st;
+
+    // reads stop at the end of the file, so no page past it is touched
+    if (in && fstat (fd, &st) == 0)
+        size = (st.st_size <= position) ? 0
+            : (st.st_size - position < size) ? st.st_size - position : size;
+
+    while (total < size)
+    {
+        // gather the pages that can be used in place
+        count = 0;
+        queued = 0;
+
+        while (count < SEMIHOST_IOV && total + queued < size)
+        {
+            n = size - total - queued;
+            data = in ? store_prepare (memory, addr + total + queued, &n)
+                : (void*) load_span (memory, addr + total + queued, &n);
+
+            if (!data)
+                break;
+
+            iov[count].iov_base = data;
+            iov[count++].iov_len = n;
+            queued += n;
+        }
+
+        if (count)
+        {
+            moved = in ? preadv (fd, iov, count, position + total)
+                : pwritev (fd, iov, count, position + total);
+
+            if (in && moved > 0)
+                store_commit (memory, addr + total, moved);
+        }
+        else
+        {
+            // the next page has to be copied
+            queued = size - total;
+
+            if (queued > PAGE_SIZE - PAGE_OFFSET (addr + total))
+                queued = PAGE_SIZE - PAGE_OFFSET (addr + total);
+
+            if (in)
+            {
+                if ((moved = pread (fd, buffer, queued, position + total)) > 0)
+                    store (memory, addr + total, moved, buffer);
+            }
+            else
+            {
+                load_bytes (memory, addr + total, queued, buffer);
+                moved = pwrite (fd, buffer, queued, position + total);
+            }
+        }
+
+        if (moved <= 0)
+            break;
+
+        total += moved;
+
+        // the end of the file
+        if (moved < queued)
+            break;
+    }
+
+    return total;
+}
+
+// moves up to size bytes between the console and memory at addr,
+// from stdin when in is set, and to stdout otherwise
+// returns the number of bytes moved
+uint32_t semihost_console (pagetable* memory, uint32_t addr, uint32_t size, int in)
+{
+    uint8_t buffer[PAGE_SIZE];
+    uint32_t total = 0, n, got;
+
+    if (in)
+        console_flush ();
+
+    while (total < size)
+    {
+        n = (size - total < PAGE_SIZE) ? size - total : PAGE_SIZE;
+
+        if (in)
+        {
+            got = fread (buffer, 1, n, stdin);
+            store (memory, addr + total, got, buffer);
+        }
+        else
+        {
+            load_bytes (memory, addr + total, n, buffer);
+
+            // behind the trace, when it is written asynchronously
+            trace_drain ();
+            console_write (buffer, n);
+            got = n;
+        }
+
+        total += got;
+
+        if (got < n)
+            break;
+    }
+
+    return total;
+}
+
+// opens the file named by the length bytes at name, with a semihosting
+// mode from 0 to 11, "r", "rb", "r+", "r+b", "w" ... "a+b"
+// returns a handle, or -1 if it can't be opened
+uint32_t semihost_open (pagetable* memory, uint32_t name, uint32_t mode, uint32_t length)
+{
+    static const int modes[] = { O_RDONLY, O_WRONLY | O_CREAT | O_TRUNC,
+        O_WRONLY | O_CREAT | O_APPEND };
+    char path[PATH_MAX];
+    semihost_file* f = NULL;
+    int i;
+
+    if (mode > 11 || length >= sizeof (path))
+        return -1;
+
+    for (i = 0; i < SEMIHOST_FILES && !f; i++)
+        if (!semihost_files[i].open)
+            f = &semihost_files[i];
+
+    if (!f)
+        return -1;
+
+    load_bytes (memory, name, length, (uint8_t*) path);
+    path[length] = '\0';
+
+    f->position = 0;
+    f->console = strcmp (path, SEMIHOST_CONSOLE) == 0;
+
+    // the console reads stdin when opened for reading and writes stdout
+    // otherwise, there's nothing to open
+    if (f->console)
+        f->fd = (mode < 4) ? STDIN_FILENO : STDOUT_FILENO;
+    else
+        f->fd = open (path, (mode & 2) ? (modes[mode / 4] & ~O_WRONLY) | O_RDWR
+            : modes[mode / 4], 0666);
+
+    if (f->fd < 0)
+        return -1;
+
+    f->open = 1;
+
+    return f - semihost_files + 1;
+}
+
+/* Semihosting */
+
+// carries out semihosting operation op, with its parameters at args
+// returns the result for R0, -1 for an unknown operation
+uint32_t semihost_call (pagetable* memory, uint32_t op, uint32_t args)
+{
+    uint32_t i, moved, param[3];
+    semihost_file* f;
+    struct stat st;
+
+    for (i = 0; i < 3; i++)
+        param[i] = load32 (memory, args + 4 * i);
+
+    if (op == SYS_OPEN)
+        return semihost_open (memory, param[0], param[1], param[2]);
+
+    if (!(f = semihost_file_get (param[0])))
+        return -1;
+
+    switch (op)
+    {
+        case SYS_CLOSE:
+            if (!f->console)
+                close (f->fd);
+
+            f->open = 0;
+            return 0;
+
+        case SYS_WRITE:
+        case SYS_READ:
+            if (f->console)
+                moved = semihost_console (memory, param[1], param[2], op == SYS_READ);
+            else
+                moved = semihost_transfer (f->fd, f->position, memory,
+                    param[1], param[2], op == SYS_READ);
+
+            f->position += moved;
+            return param[2] - moved;
+
+        case SYS_SEEK:
+            if (f->console)
+                return -1;
+
+            f->position = param[1];
+            return 0;
+
+        case SYS_FLEN:
+            if (f->console || fstat (f->fd, &st) != 0)
+                return -1;
+
+            return st.st_size;
+    }
+
+    return -1;
+}
+
+// closes every file the guest left open
+void semihost_close_all (void)
+{
+    int i;
+
+    for (i = 0; i < SEMIHOST_FILES; i++)
+    {
+        if (semihost_files[i].open && !semihost_files[i].console)
+            close (semihost_files[i].fd);
+
+        semihost_files[i].open = 0;
+    }
+}
@@ -0,0 +1,42 @@
+/*
+ * ARM emulator
+ * Luke Mitchell
+ *
+ */
+
+#ifndef SEMIHOST_H
+#define SEMIHOST_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "pagetable.h"
+
+/* Semihosting operations, R1 points at the words listed */
+#define SYS_OPEN    0x01 // name, mode, name length; returns a handle or -1
+#define SYS_CLOSE   0x02 // handle; returns 0 or -1
+#define SYS_WRITE   0x05 // handle, buffer, length; returns the bytes not written
+#define SYS_READ    0x06 // handle, buffer, length; returns the bytes not read
+#define SYS_SEEK    0x0A // handle, position; returns 0 or -1
+#define SYS_FLEN    0x0C // handle; returns the length or -1
+
+/* Most files open at once */
+#define SEMIHOST_FILES 32
+
+/* File name opening the console, stdin for reading and stdout for writing */
+#define SEMIHOST_CONSOLE ":tt"
+
+/* Most pages moved by one preadv or pwritev */
+#define SEMIHOST_IOV 64
+
+// a file opened by the guest
+typedef struct {
+    int open;
+    int fd;
+    int console;        // reads stdin or writes stdout, rather than fd
+    off_t position;
+} semihost_file;
+
+uint32_t    semihost_call           (pagetable*, uint32_t op, uint32_t args);
+void        semihost_close_all      (void);
+
+#endif
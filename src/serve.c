@@ -0,0 +1,460 @@
+/*
+ * ARM emulator
+ * Luke Mitchell
+ *
+ */
+
+// Daemon mode
+//
+// A pool of worker processes accepts connections on a Unix domain socket.
+// Each connection carries a single job, given as one request line:
+//
+//   RUN <path> [options]     run an image from disk
+//   INLINE [options]         run the image that follows, in .emu format,
+//                            terminated by a line holding a single '.'
+//
+// where options are any of -trace, -before, -after, -diff,
+// -limit <instructions> and -timeout <seconds>.
+//
+// Workers keep the images they have loaded in memory, keyed by path and
+// modification time, along with the blocks decoded from them, starting
+// with those reachable from the entry point. Every job runs in a child
+// forked from its worker, so the child starts from the warm image and
+// any changes it makes to guest memory, or to its copy of the blocks,
+// are discarded when it exits. SVC output is streamed back over the
+// connection, followed by a status line and the final register dump.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "serve.h"
+#include "emu.h"
+#include "io.h"
+#include "instructions.h"
+#include "pagetable.h"
+#include "image.h"
+#include "trace.h"
+#include "common.h"
+#include "block.h"
+
+// a parsed image held by a worker
+typedef struct {
+    char path[SERVE_LINE_MAX];
+    time_t mtime;
+    off_t size;
+    pagetable* memory;
+    blockcache* blocks; // decoded ahead of jobs, NULL if it couldn't be
+    uint32_t entry;
+} cached_image;
+
+// options for a single job
+typedef struct {
+    int trace, before, after, diff;
+    uint64_t limit;
+    unsigned int timeout;
+} job_options;
+
+/* Worker state */
+cached_image image_cache[SERVE_CACHE_SIZE];
+int image_cache_next;
+
+/* Helper functions not exposed in header file */
+
+// reads a single '\n' terminated line from fd into buffer
+// the connection is read a byte at a time so that nothing
+// beyond the request line is consumed
+// returns the length of the line, or -1 on EOF or error
+int read_request_line (int fd, char* buffer, int size)
+{
+    int len = 0;
+    char c;
+
+    while (read (fd, &c, 1) == 1)
+    {
+        if (c == '\n')
+        {
+            buffer[len] = '\0';
+            return len;
+        }
+
+        if (len < size - 1)
+            buffer[len++] = c;
+    }
+
+    return -1;
+}
+
+// parses the options following the request verb
+// returns 0 on success, -1 if an option is not recognised
+int parse_job_options (job_options* opts)
+{
+    char* tok;
+
+    memset (opts, 0, sizeof (job_options));
+
+    while ((tok = strtok (NULL, " \t\r")) != NULL)
+    {
+        if (strcmp (tok, "-trace") == 0)
+            opts->trace = TRACE_TEXT;
+        else if (strcmp (tok, "-before") == 0)
+            opts->before = 1;
+        else if (strcmp (tok, "-after") == 0)
+            opts->after = 1;
+        else if (strcmp (tok, "-diff") == 0)
+            opts->diff = 1;
+        else if (strcmp (tok, "-limit") == 0 && (tok = strtok (NULL, " \t\r")))
+            opts->limit = strtoull (tok, NULL, 0);
+        else if (strcmp (tok, "-timeout") == 0 && (tok = strtok (NULL, " \t\r")))
+            opts->timeout = atoi (tok);
+        else
+            return -1;
+    }
+
+    return 0;
+}
+
+// decodes the blocks reachable from entry by branches and calls, and by
+// carrying on past anything that returns or may not be taken, up to
+// SERVE_WARM_BLOCKS of them
+// returns the block cache, or NULL if there's insufficient memory
+blockcache* warm_image (pagetable* pt, uint32_t entry)
+{
+    uint32_t pending[SERVE_WARM_BLOCKS], addr, next;
+    int head = 0, tail = 0;
+    blockcache* bc = blockcache_create ();
+    decoded_instruction* last;
+    block* b;
+
+    if (!bc)
+        return NULL;
+
+    pending[tail++] = entry;
+
+    while (head < tail && bc->count < SERVE_WARM_BLOCKS)
+    {
+        addr = pending[head++];
+
+        if (hashtable_search (bc->index, addr))
+            continue;
+
+        if (!(b = blockcache_find (bc, pt, addr)))
+            break;
+
+        last = &b->instr[b->length - 1];
+        next = addr + 4 * b->length;
+
+        // the PC reads 8 bytes ahead
+        if (last->type == INSTR_B && tail < SERVE_WARM_BLOCKS)
+            pending[tail++] = next + 4 + ((int32_t) (get_bits (last->word, 0, 24) << 8) >> 6);
+
+        // conditional instructions, calls, SVCs other than halt, and blocks
+        // cut short by their size or the end of a page go on to the next
+        if (tail < SERVE_WARM_BLOCKS
+            && (last->cond != COND_AL
+                || (last->type == INSTR_B && get_bit (last->word, 24))
+                || (last->type == INSTR_SWI && get_bits (last->word, 0, 24) != SVC_HALT)
+                || b->length == BLOCK_MAX_INSTRUCTIONS || PAGE_OFFSET (next) == 0))
+            pending[tail++] = next;
+    }
+
+    return bc;
+}
+
+// returns the cached image for path, parsing it on first use
+// an entry is reparsed if the file has changed on disk
+// returns NULL if the file cannot be opened
+cached_image* find_image (char* path)
+{
+    int i;
+    struct stat st;
+    cached_image* img;
+
+    if (stat (path, &st) != 0)
+        return NULL;
+
+    for (i = 0; i < SERVE_CACHE_SIZE; i++)
+    {
+        img = &image_cache[i];
+
+        if (img->memory && strcmp (img->path, path) == 0)
+        {
+            if (img->mtime == st.st_mtime && img->size == st.st_size)
+                return img;
+
+            break;
+        }
+    }
+
+    // not cached, or stale, take the next slot
+    if (i == SERVE_CACHE_SIZE)
+    {
+        img = &image_cache[image_cache_next];
+        image_cache_next = (image_cache_next + 1) % SERVE_CACHE_SIZE;
+    }
+
+    if (img->memory)
+    {
+        if (img->blocks)
+            blockcache_destroy (img->blocks);
+
+        pagetable_destroy (img->memory);
+        img->memory = NULL;
+        img->blocks = NULL;
+    }
+
+    // parse into the worker's copy of memory
+    memory = pagetable_create ();
+    img->entry = 0;
+
+    if (image_load (memory, path, 1, &img->entry) != 0)
+    {
+        pagetable_destroy (memory);
+        return NULL;
+    }
+
+    strncpy (img->path, path, SERVE_LINE_MAX - 1);
+    img->mtime = st.st_mtime;
+    img->size = st.st_size;
+    img->memory = memory;
+    img->blocks = warm_image (memory, img->entry);
+
+    return img;
+}
+
+// runs a job in a child process with stdout redirected to conn
+// img is NULL for inline jobs, in which case the image is read from conn
+void run_job (int conn, cached_image* img, job_options* opts)
+{
+    int status;
+    pid_t pid;
+    FILE* fp;
+
+    fflush (stdout);
+    pid = fork ();
+
+    if (pid < 0)
+    {
+        dprintf (conn, "ERROR fork failed\n");
+        return;
+    }
+
+    if (pid == 0)
+    {
+        signal (SIGPIPE, SIG_DFL);
+        dup2 (conn, STDOUT_FILENO);
+        dup2 (conn, STDERR_FILENO);
+
+        // stream output a line at a time, rather than through the large
+        // buffer console_open gave stdout
+        setvbuf (stdout, NULL, _IOLBF, 0);
+
+        if (opts->timeout)
+            alarm (opts->timeout);
+
+        if (img)
+        {
+            memory = img->memory;
+            warm_blocks = img->blocks;
+            registers[R_PC] = img->entry;
+        }
+        else
+        {
+            fp = fdopen (dup (conn), "r");
+            memory = pagetable_create ();
+
+            if (image_read_emu (memory, fp, &registers[R_PC]) != 0)
+            {
+                dprintf (conn, "ERROR the image could not be read\n");
+                _exit (0);
+            }
+
+            fclose (fp);
+        }
+
+        if (opts->trace)
+            trace_open (opts->trace, NULL, 0, registers, flags);
+
+        if (opts->diff)
+            pagetable_checkpoint (memory);
+
+        status = emulate (opts->trace, opts->before, opts->after, opts->limit);
+
+        if (opts->diff)
+            print_memory_diff (memory);
+
+        // report the final state
+        printf ("%s %llu\n", (status == EMU_HALTED) ? "HALT" : "LIMIT",
+            (unsigned long long) retired);
+        print_register_dump (registers);
+
+        fflush (stdout);
+        _exit (0);
+    }
+
+    // wait for the job, reporting jobs that were killed
+    if (waitpid (pid, &status, 0) == pid && WIFSIGNALED (status))
+    {
+        if (WTERMSIG (status) == SIGALRM)
+            dprintf (conn, "TIMEOUT\n");
+        else
+            dprintf (conn, "ERROR signal %d\n", WTERMSIG (status));
+    }
+}
+
+// handles the single job carried by a connection
+void handle_connection (int conn)
+{
+    char line[SERVE_LINE_MAX];
+    char *verb, *path = NULL;
+    cached_image* img = NULL;
+    job_options opts;
+
+    if (read_request_line (conn, line, sizeof (line)) < 0)
+        return;
+
+    verb = strtok (line, " \t\r");
+
+    if (!verb)
+        return;
+
+    if (strcmp (verb, "RUN") == 0)
+    {
+        path = strtok (NULL, " \t\r");
+
+        if (!path)
+        {
+            dprintf (conn, "ERROR no image given\n");
+            return;
+        }
+    }
+    else if (strcmp (verb, "INLINE") != 0)
+    {
+        dprintf (conn, "ERROR unknown request %s\n", verb);
+        return;
+    }
+
+    if (parse_job_options (&opts) != 0)
+    {
+        dprintf (conn, "ERROR bad option\n");
+        return;
+    }
+
+    if (path)
+    {
+        img = find_image (path);
+
+        if (!img)
+        {
+            dprintf (conn, "ERROR the file %s was not found\n", path);
+            return;
+        }
+    }
+
+    run_job (conn, img, &opts);
+}
+
+// accepts and serves connections forever
+void worker_loop (int fd)
+{
+    int conn;
+
+    signal (SIGPIPE, SIG_IGN);
+
+    for (;;)
+    {
+        conn = accept (fd, NULL, NULL);
+
+        if (conn < 0)
+            continue;
+
+        handle_connection (conn);
+        close (conn);
+    }
+}
+
+// forks a worker process serving fd
+// returns the pid of the worker, or -1 on failure
+pid_t spawn_worker (int fd)
+{
+    pid_t pid = fork ();
+
+    if (pid == 0)
+    {
+        worker_loop (fd);
+        _exit (0);
+    }
+
+    return pid;
+}
+
+/* Exposed functions */
+
+// listens on the Unix domain socket at path and serves jobs
+// using a pool of worker processes, replacing any that die
+// doesn't return once listening
+// returns a non-zero exit status if the socket can't be set up
+int serve (char* path, int workers)
+{
+    int i, fd, alive = 0;
+    struct sockaddr_un addr;
+
+    if (workers < 1)
+        workers = 1;
+
+    if (strlen (path) >= sizeof (addr.sun_path))
+    {
+        fprintf (stderr, "The socket path %s is too long.\n", path);
+        return 1;
+    }
+
+    fd = socket (AF_UNIX, SOCK_STREAM, 0);
+
+    if (fd < 0)
+    {
+        perror ("socket");
+        return 1;
+    }
+
+    memset (&addr, 0, sizeof (addr));
+    addr.sun_family = AF_UNIX;
+    strcpy (addr.sun_path, path);
+
+    unlink (path);
+
+    if (bind (fd, (struct sockaddr*) &addr, sizeof (addr)) != 0
+        || listen (fd, SOMAXCONN) != 0)
+    {
+        perror (path);
+        close (fd);
+        return 1;
+    }
+
+    for (i = 0; i < workers; i++)
+        if (spawn_worker (fd) > 0)
+            alive++;
+
+    // keep the pool at full strength, waiting a while if fork fails
+    // rather than spinning on it
+    for (;;)
+    {
+        if (alive < workers)
+        {
+            if (spawn_worker (fd) > 0)
+                alive++;
+            else
+                sleep (SERVE_RETRY);
+        }
+        else if (wait (NULL) > 0)
+            alive--;
+    }
+
+    return 0;
+}
@@ -0,0 +1,27 @@
+/*
+ * ARM emulator
+ * Luke Mitchell
+ *
+ */
+
+#ifndef SERVE_H
+#define SERVE_H
+
+/* Default number of worker processes accepting connections */
+#define SERVE_WORKERS 4
+
+/* Number of parsed images each worker keeps warm */
+#define SERVE_CACHE_SIZE 16
+
+/* Most blocks decoded ahead of the first job on an image */
+#define SERVE_WARM_BLOCKS 256
+
+/* Seconds to wait before retrying a worker that couldn't be forked */
+#define SERVE_RETRY 1
+
+/* Longest request line accepted, including the image path */
+#define SERVE_LINE_MAX 1024
+
+int serve (char* path, int workers);
+
+#endif
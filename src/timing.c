@@ -0,0 +1,261 @@
+/*
+ * ARM emulator
+ * Luke Mitchell
+ *
+ */
+
+// Cycle estimates
+//
+// Each instruction is costed before it runs, from the model's table and
+// the guest state it's about to use: the multiplier terminates early on
+// small values of Rs, a write to the PC refills the pipeline, and a
+// failed condition costs a single cycle however much the instruction
+// would have done. Loads also remember their destination, so the next
+// instruction pays the model's load-use stall if it reads it.
+//
+// Cycles are counted per block alongside the profiler's counts, and are
+// harvested with them, so each block's CPI is its cycles over the
+// instructions it retired.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "timing.h"
+#include "emu.h"
+#include "common.h"
+#include "instructions.h"
+
+/* Modelled processors */
+timing_model timing_models[] = {
+    // name    dp shift refill mul byte mla load use store branch swi skipped
+    { "arm7",  1, 1,    2,     1,  1,   1,  3,   0,  2,    3,     3,  1 },
+    { "arm9",  1, 1,    2,     1,  1,   1,  1,   1,  1,    3,     3,  1 }
+};
+
+/* The model in use, or NULL when not estimating cycles */
+timing_model* cycle_model;
+
+/* Cycles estimated so far */
+uint64_t cycles;
+
+/* Register written by the last load, -1 if the last instruction wasn't one */
+int timing_loaded = -1;
+
+/* Helper functions not exposed in header file */
+
+// returns 1 if the instruction word of type reads register r, 0 otherwise
+int timing_reads (uint32_t word, uint8_t type, int r)
+{
+    switch (type)
+    {
+        case INSTR_DP:
+            if (get_bits (word, 16, 4) == r)
+                return 1;
+
+            // register operand, shifted by a register?
+            if (!get_bit (word, 25))
+                return get_bits (word, 0, 4) == r
+                    || (get_bit (word, 4) && get_bits (word, 8, 4) == r);
+
+            return 0;
+
+        case INSTR_MUL:
+            return get_bits (word, 0, 4) == r || get_bits (word, 8, 4) == r
+                || (get_bit (word, 21) && get_bits (word, 12, 4) == r);
+
+        case INSTR_LS:
+            // base, register offset, and the value stored
+            return get_bits (word, 16, 4) == r
+                || (get_bit (word, 25) && get_bits (word, 0, 4) == r)
+                || (!get_bit (word, 20) && get_bits (word, 12, 4) == r);
+
+        case INSTR_LSH:
+            // base, register offset, and the value stored
+            return get_bits (word, 16, 4) == r
+                || (!get_bit (word, 22) && get_bits (word, 0, 4) == r)
+                || (!get_bit (word, 20) && get_bits (word, 12, 4) == r);
+
+        case INSTR_LSM:
+            // base, and the values stored
+            return get_bits (word, 16, 4) == r
+                || (!get_bit (word, 20) && get_bit (word, r));
+    }
+
+    return 0;
+}
+
+// returns the multiplier cycles for a multiply by rs
+// the multiplier stops early once the rest of rs is all zeros or all ones
+int timing_mul_bytes (uint32_t rs)
+{
+    int n = 1;
+
+    while (n < 4 && (rs >> (8 * n)) != 0 && (rs >> (8 * n)) != (0xFFFFFFFF >> (8 * n)))
+        n++;
+
+    return n;
+}
+
+// orders block counts by cycles, highest first, for qsort
+int timing_block_compare (const void* a, const void* b)
+{
+    uint64_t x = (*(profile_block**) a)->cycles;
+    uint64_t y = (*(profile_block**) b)->cycles;
+
+    return (x < y) - (x > y);
+}
+
+/* Models */
+
+// selects the named model
+// returns 0 on success, -1 if there's no such model
+int timing_select (char* name)
+{
+    int i;
+
+    for (i = 0; i < (int) (sizeof (timing_models) / sizeof (timing_model)); i++)
+    {
+        if (strcmp (name, timing_models[i].name) == 0)
+        {
+            cycle_model = &timing_models[i];
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/* Estimating */
+
+// returns the cycles taken by the instruction word of type, which is
+// about to run, where passed is set if its condition passes
+int timing_cost (uint32_t word, uint8_t type, int passed)
+{
+    timing_model* m = cycle_model;
+    int c = 0, opcode, rd;
+
+    // waiting on the last load?
+    if (timing_loaded >= 0 && timing_reads (word, type, timing_loaded))
+        c += m->load_use;
+
+    timing_loaded = -1;
+
+    if (!passed)
+        return c + m->skipped;
+
+    switch (type)
+    {
+        case INSTR_DP:
+            c += m->dp;
+
+            if (!get_bit (word, 25) && get_bit (word, 4))
+                c += m->shift_reg;
+
+            // TST, TEQ, CMP and CMN don't write Rd
+            opcode = get_bits (word, 21, 4);
+
+            if ((opcode < 8 || opcode > 11) && get_bits (word, 12, 4) == R_PC)
+                c += m->refill;
+
+            break;
+
+        case INSTR_MUL:
+            c += m->mul + m->mul_byte * timing_mul_bytes (registers[get_bits (word, 8, 4)]);
+
+            if (get_bit (word, 21))
+                c += m->mla;
+
+            break;
+
+        case INSTR_LS:
+        case INSTR_LSH:
+            rd = get_bits (word, 12, 4);
+
+            if (!get_bit (word, 20))
+                c += m->store;
+            else if (rd == R_PC)
+                c += m->load + m->refill;
+            else
+            {
+                c += m->load;
+                timing_loaded = rd;
+            }
+
+            break;
+
+        // a cycle for each register after the first
+        case INSTR_LSM:
+            for (rd = 0; rd < 16; rd++)
+                if (get_bit (word, rd))
+                    c++;
+
+            if (!get_bit (word, 20))
+                c += m->store - 1;
+            else if (get_bit (word, R_PC))
+                c += m->load - 1 + m->refill;
+            else
+            {
+                c += m->load - 1;
+
+                // the last register loaded is the highest
+                for (rd = 15; rd > 0 && !get_bit (word, rd); rd--)
+                    ;
+
+                timing_loaded = rd;
+            }
+
+            break;
+
+        case INSTR_B:
+            c += m->branch;
+            break;
+
+        case INSTR_SWI:
+            c += m->swi;
+            break;
+
+        default:
+            c += m->dp;
+    }
+
+    return c;
+}
+
+/* Reporting */
+
+// prints the cycles estimated in total and for the costliest blocks
+void timing_report (profile* prof)
+{
+    uint64_t instructions = 0;
+    profile_block** sorted;
+    int i, n = prof->block_count;
+
+    for (i = 0; i < n; i++)
+        instructions += prof->blocks[i].instructions;
+
+    printf ("Timing (%s): %llu cycles, %llu instructions, CPI %.3f\n\n", cycle_model->name,
+        (unsigned long long) cycles, (unsigned long long) instructions,
+        instructions ? (double) cycles / instructions : 0.0);
+
+    if (!(sorted = malloc ((n + 1) * sizeof (profile_block*))))
+        return;
+
+    for (i = 0; i < n; i++)
+        sorted[i] = &prof->blocks[i];
+
+    qsort (sorted, n, sizeof (profile_block*), timing_block_compare);
+
+    printf ("Costliest blocks:\n");
+
+    for (i = 0; i < n && i < PROFILE_TOP; i++)
+    {
+        printf ("  0x%08X %3d instructions %12llu cycles CPI %6.3f %6.2f%%\n", sorted[i]->start,
+            sorted[i]->length, (unsigned long long) sorted[i]->cycles,
+            sorted[i]->instructions ? (double) sorted[i]->cycles / sorted[i]->instructions : 0.0,
+            cycles ? 100.0 * sorted[i]->cycles / cycles : 0.0);
+    }
+
+    printf ("\n");
+    free (sorted);
+}
@@ -0,0 +1,45 @@
+/*
+ * ARM emulator
+ * Luke Mitchell
+ *
+ */
+
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <stdint.h>
+#include "profile.h"
+
+// cycle costs of a processor, for instructions whose condition passed
+typedef struct {
+    const char* name;
+    int dp;             // data processing
+    int shift_reg;      // extra for a shift by a register
+    int refill;         // extra for writing the PC, as the pipeline refills
+    int mul;            // multiply, before the multiplier cycles
+    int mul_byte;       // per significant byte of Rs
+    int mla;            // extra for accumulating
+    int load;           // LDR
+    int load_use;       // stall when the next instruction reads the loaded register
+    int store;          // STR
+    int branch;         // taken branch
+    int swi;
+    int skipped;        // any instruction whose condition failed
+} timing_model;
+
+/* The model in use, or NULL when not estimating cycles */
+extern timing_model* cycle_model;
+
+/* Cycles estimated so far */
+extern uint64_t cycles;
+
+// models
+int         timing_select           (char* name);
+
+// estimating
+int         timing_cost             (uint32_t word, uint8_t type, int passed);
+
+// reporting
+void        timing_report           (profile*);
+
+#endif
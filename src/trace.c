@@ -0,0 +1,540 @@
+/*
+ * ARM emulator
+ * Luke Mitchell
+ *
+ */
+
+// Binary trace
+//
+// Each record holds the instruction word and only what changed since
+// the previous record: the PC when it didn't simply advance by 4, the
+// flags when they changed, and a delta for each changed register.
+// emu-tracedump turns a trace back into the text of -trace.
+//
+// With TRACE_ASYNC the emulator only copies each instruction's state into
+// a ring buffer. A writer thread formats the entries, as text or binary
+// records, and writes them in large batches, so a slow disk or pipe no
+// longer stalls the guest. SVC output is queued in the same ring, so it
+// stays in order with a text trace. When the ring is full the emulator
+// either waits for the writer or, with TRACE_DROP, counts and drops the
+// entry.
+//
+// Filters pick out part of a run. The PC range and instruction classes
+// are checked once per instruction when its block is built, so blocks
+// outside them run as fast as untraced code; the condition outcome and
+// the every Nth block sampling are checked as traced blocks run.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <zlib.h>
+#include "trace.h"
+#include "ring.h"
+#include "io.h"
+#include "instructions.h"
+#include "common.h"
+
+/* Longest possible record: tag, PC, instruction, flags, mask, 15 deltas */
+#define TRACE_RECORD_MAX (1 + 4 + 4 + 1 + 2 + 15 * 5)
+
+/* Filters, trace everything by default */
+trace_filter trace_filters = { 0, 0xFFFFFFFF, 0xFF, TRACE_COND_ANY, 0 };
+
+/* Writer state */
+int trace_mode;
+int trace_options;
+gzFile trace_fp;
+uint32_t trace_last[16];
+uint8_t trace_last_flags;
+uint8_t trace_batch[TRACE_BATCH_BYTES];
+size_t trace_batch_len;
+_Atomic uint64_t trace_bytes;
+
+/* Asynchronous writer state */
+ring* trace_ring;
+pthread_t trace_thread;
+atomic_int trace_stopping;
+uint64_t trace_dropped;
+
+/* Helper functions not exposed in header file */
+
+// packs the N Z C V flags into the low 4 bits of a byte
+uint8_t pack_flags (uint8_t f[])
+{
+    return (f[F_N] << 3) | (f[F_Z] << 2) | (f[F_C] << 1) | f[F_V];
+}
+
+// unpacks flags packed by pack_flags
+void unpack_flags (uint8_t packed, uint8_t f[])
+{
+    f[F_N] = (packed >> 3) & 1;
+    f[F_Z] = (packed >> 2) & 1;
+    f[F_C] = (packed >> 1) & 1;
+    f[F_V] = packed & 1;
+}
+
+// writes a little-endian 32-bit value to buffer
+// returns the number of bytes written
+int put32 (uint8_t* buffer, uint32_t value)
+{
+    buffer[0] = value;
+    buffer[1] = value >> 8;
+    buffer[2] = value >> 16;
+    buffer[3] = value >> 24;
+
+    return 4;
+}
+
+// writes a register delta to buffer as a zig-zag encoded varint,
+// so small positive and negative changes take a single byte
+// returns the number of bytes written
+int put_delta (uint8_t* buffer, uint32_t delta)
+{
+    int len = 0;
+    uint32_t zz = (delta << 1) ^ (uint32_t) ((int32_t) delta >> 31);
+
+    while (zz >= 0x80)
+    {
+        buffer[len++] = (zz & 0x7F) | 0x80;
+        zz >>= 7;
+    }
+
+    buffer[len++] = zz;
+
+    return len;
+}
+
+// reads a little-endian 32-bit value from fp
+// returns 0 on success, -1 at end of file
+int get32 (gzFile fp, uint32_t* value)
+{
+    uint8_t b[4];
+
+    if (gzread (fp, b, 4) != 4)
+        return -1;
+
+    *value = b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t) b[3] << 24);
+
+    return 0;
+}
+
+// reads a delta written by put_delta from fp
+// returns 0 on success, -1 at end of file
+int get_delta (gzFile fp, uint32_t* delta)
+{
+    int c, shift = 0;
+    uint32_t zz = 0;
+
+    do
+    {
+        if ((c = gzgetc (fp)) == -1 || shift > 28)
+            return -1;
+
+        zz |= (uint32_t) (c & 0x7F) << shift;
+        shift += 7;
+    } while (c & 0x80);
+
+    *delta = (zz >> 1) ^ -(zz & 1);
+
+    return 0;
+}
+
+// writes out the binary records gathered so far
+void flush_batch (void)
+{
+    if (trace_batch_len)
+        gzwrite (trace_fp, trace_batch, trace_batch_len);
+
+    atomic_fetch_add_explicit (&trace_bytes, trace_batch_len, memory_order_relaxed);
+
+    trace_batch_len = 0;
+}
+
+// encodes the state before an instruction executes as a binary record
+void encode_record (uint32_t r[], uint8_t f[], uint32_t instr)
+{
+    uint8_t* buffer;
+    uint8_t tag = 0, packed;
+    uint16_t mask = 0;
+    int i, len = 1;
+
+    if (trace_batch_len > TRACE_BATCH_BYTES - TRACE_RECORD_MAX)
+        flush_batch ();
+
+    buffer = trace_batch + trace_batch_len;
+
+    if (r[R_PC] != trace_last[R_PC] + 4)
+    {
+        tag |= TRACE_TAG_PC;
+        len += put32 (buffer + len, r[R_PC]);
+    }
+
+    trace_last[R_PC] = r[R_PC];
+    len += put32 (buffer + len, instr);
+
+    packed = pack_flags (f);
+
+    if (packed != trace_last_flags)
+    {
+        tag |= TRACE_TAG_FLAGS;
+        buffer[len++] = packed;
+        trace_last_flags = packed;
+    }
+
+    for (i = 0; i < R_PC; i++)
+        if (r[i] != trace_last[i])
+            mask |= 1 << i;
+
+    if (mask)
+    {
+        tag |= TRACE_TAG_REGS;
+        buffer[len++] = mask;
+        buffer[len++] = mask >> 8;
+
+        for (i = 0; i < R_PC; i++)
+        {
+            if (mask & (1 << i))
+            {
+                len += put_delta (buffer + len, r[i] - trace_last[i]);
+                trace_last[i] = r[i];
+            }
+        }
+    }
+
+    buffer[0] = tag;
+    trace_batch_len += len;
+}
+
+// writes an instruction's state in the current mode
+void write_step (uint32_t r[], uint8_t f[], uint32_t instr)
+{
+    if (trace_mode == TRACE_BINARY)
+        encode_record (r, f, instr);
+    else
+        print_trace (r, instr);
+}
+
+// writer thread entry point
+// empties the ring until asked to stop
+void* trace_writer (void* arg)
+{
+    size_t i, n;
+    trace_entry* e;
+    struct timespec idle = { 0, 50000 };
+
+    for (;;)
+    {
+        n = ring_peek (trace_ring, (void**) &e);
+
+        if (n == 0)
+        {
+            // only stop once everything queued has been written
+            if (atomic_load (&trace_stopping) && ring_count (trace_ring) == 0)
+                break;
+
+            nanosleep (&idle, NULL);
+            continue;
+        }
+
+        for (i = 0; i < n; i++)
+        {
+            if (e[i].kind == TRACE_ENTRY_SVC)
+                print_svc (e[i].registers, e[i].instruction);
+            else
+                write_step (e[i].registers, e[i].flags, e[i].instruction);
+        }
+
+        ring_release (trace_ring, n);
+    }
+
+    return NULL;
+}
+
+// queues an entry for the writer thread
+// if the ring is full the entry is dropped when drop is set,
+// otherwise this waits for the writer to make room
+void queue_entry (trace_entry* e, int drop)
+{
+    while (ring_push (trace_ring, e) != 0)
+    {
+        if (drop)
+        {
+            trace_dropped++;
+            return;
+        }
+
+        sched_yield ();
+    }
+}
+
+/* Filtering */
+
+// returns 1 if an instruction of type at pc passes the filters
+// that don't depend on the state when it runs
+// returns 0 otherwise
+int trace_filter_static (uint32_t pc, uint8_t type)
+{
+    return pc >= trace_filters.lo && pc <= trace_filters.hi
+        && (trace_filters.classes & TRACE_CLASS (type));
+}
+
+// sets the PC range of filter from "start:end", where end is exclusive
+// returns 0 on success, -1 if arg isn't a valid range
+int trace_parse_range (char* arg, trace_filter* filter)
+{
+    return parse_range (arg, &filter->lo, &filter->hi);
+}
+
+// sets the classes of filter from a comma separated list
+// of dp, ls, b, swi, mul, lsm, lsh and unknown
+// returns 0 on success, -1 if arg names an unknown class
+int trace_parse_classes (char* arg, trace_filter* filter)
+{
+    static const char* names[] = { "dp", "ls", "b", "swi", "mul", "lsm", "lsh" };
+    uint8_t classes = 0;
+    size_t len;
+    int i;
+
+    while (*arg)
+    {
+        len = strcspn (arg, ",");
+
+        for (i = 0; i < 7; i++)
+            if (strlen (names[i]) == len && strncmp (arg, names[i], len) == 0)
+                break;
+
+        if (i < 7)
+            classes |= TRACE_CLASS (i);
+        else if (len == 7 && strncmp (arg, "unknown", len) == 0)
+            classes |= TRACE_CLASS (INSTR_UNKNOWN);
+        else
+            return -1;
+
+        arg += len;
+
+        if (*arg == ',')
+            arg++;
+    }
+
+    filter->classes = classes;
+
+    return 0;
+}
+
+/* Writing */
+
+// starts tracing in mode, TRACE_TEXT or TRACE_BINARY
+// a binary trace is written to path, starting from the given state
+// options are any of TRACE_ASYNC, TRACE_DROP and TRACE_COMPRESS
+// returns 0 on success, -1 if the trace can't be started
+int trace_open (int mode, char* path, int options, uint32_t r[], uint8_t f[])
+{
+    trace_header header;
+
+    trace_mode = mode;
+    trace_options = options;
+
+    if (mode == TRACE_BINARY)
+    {
+        trace_fp = gzopen (path, (options & TRACE_COMPRESS) ? "wb1" : "wbT");
+
+        if (!trace_fp)
+            return -1;
+
+        memset (&header, 0, sizeof (header));
+        header.magic = TRACE_MAGIC;
+        header.version = TRACE_VERSION;
+        memcpy (header.registers, r, sizeof (header.registers));
+        memcpy (header.flags, f, sizeof (header.flags));
+
+        gzwrite (trace_fp, &header, sizeof (header));
+
+        memcpy (trace_last, r, sizeof (trace_last));
+        trace_last_flags = pack_flags (f);
+
+        // the first record is at the initial PC
+        trace_last[R_PC] -= 4;
+    }
+
+    if (options & TRACE_ASYNC)
+    {
+        trace_ring = ring_create (sizeof (trace_entry), TRACE_RING_ENTRIES);
+        atomic_store (&trace_stopping, 0);
+
+        if (!trace_ring || pthread_create (&trace_thread, NULL, trace_writer, NULL) != 0)
+        {
+            if (trace_ring)
+                ring_destroy (trace_ring);
+
+            trace_ring = NULL;
+            trace_options &= ~TRACE_ASYNC;
+        }
+    }
+
+    return 0;
+}
+
+// records the state before an instruction executes
+void trace_record (uint32_t r[], uint8_t f[], uint32_t instr)
+{
+    trace_entry e;
+
+    if (!(trace_options & TRACE_ASYNC))
+    {
+        write_step (r, f, instr);
+        return;
+    }
+
+    memcpy (e.registers, r, sizeof (e.registers));
+    memcpy (e.flags, f, sizeof (e.flags));
+    e.instruction = instr;
+    e.kind = TRACE_ENTRY_STEP;
+
+    queue_entry (&e, trace_options & TRACE_DROP);
+}
+
+// queues the output of an SVC behind any trace entries
+// SVC output is never dropped
+// returns 1 if the output was queued, 0 if the caller should print it
+int trace_svc (uint32_t r[], uint32_t operand)
+{
+    trace_entry e;
+
+    if (!(trace_options & TRACE_ASYNC))
+        return 0;
+
+    memcpy (e.registers, r, sizeof (e.registers));
+    e.instruction = operand;
+    e.kind = TRACE_ENTRY_SVC;
+
+    queue_entry (&e, 0);
+
+    return 1;
+}
+
+// waits for the writer thread to catch up, so that output
+// written next to stdout comes after everything already queued
+void trace_drain (void)
+{
+    if (trace_options & TRACE_ASYNC)
+        while (ring_count (trace_ring) != 0)
+            sched_yield ();
+}
+
+// as trace_drain, and writes out stdout's buffer as well
+void trace_flush (void)
+{
+    trace_drain ();
+    fflush (stdout);
+}
+
+// finishes the trace, writing anything still queued
+void trace_close (void)
+{
+    if (trace_options & TRACE_ASYNC)
+    {
+        atomic_store (&trace_stopping, 1);
+        pthread_join (trace_thread, NULL);
+        ring_destroy (trace_ring);
+        trace_ring = NULL;
+
+        if (trace_dropped)
+            fprintf (stderr, "%llu trace entries were dropped\n",
+                (unsigned long long) trace_dropped);
+    }
+
+    if (trace_fp)
+    {
+        flush_batch ();
+        gzclose (trace_fp);
+    }
+
+    trace_fp = NULL;
+    trace_mode = TRACE_NONE;
+    trace_options = 0;
+}
+
+/* Reading */
+
+// reads the header of a binary trace into state
+// returns 0 on success, -1 if fp doesn't hold a trace
+int trace_read_header (gzFile fp, trace_state* state)
+{
+    trace_header header;
+
+    if (gzread (fp, &header, sizeof (header)) != sizeof (header)
+        || header.magic != TRACE_MAGIC || header.version != TRACE_VERSION)
+    {
+        return -1;
+    }
+
+    memcpy (state->registers, header.registers, sizeof (state->registers));
+    memcpy (state->flags, header.flags, sizeof (state->flags));
+    state->instruction = 0;
+    state->registers[R_PC] -= 4;
+
+    return 0;
+}
+
+// applies the next record of a binary trace to state
+// returns 0 on success, -1 at the end of the trace
+int trace_read_record (gzFile fp, trace_state* state)
+{
+    int i, tag, c;
+    uint32_t delta;
+    uint16_t mask;
+
+    if ((tag = gzgetc (fp)) == -1)
+        return -1;
+
+    if (tag & TRACE_TAG_PC)
+    {
+        if (get32 (fp, &state->registers[R_PC]) != 0)
+            return -1;
+    }
+    else
+    {
+        state->registers[R_PC] += 4;
+    }
+
+    if (get32 (fp, &state->instruction) != 0)
+        return -1;
+
+    if (tag & TRACE_TAG_FLAGS)
+    {
+        if ((c = gzgetc (fp)) == -1)
+            return -1;
+
+        unpack_flags (c, state->flags);
+    }
+
+    if (tag & TRACE_TAG_REGS)
+    {
+        if ((c = gzgetc (fp)) == -1)
+            return -1;
+
+        mask = c;
+
+        if ((c = gzgetc (fp)) == -1)
+            return -1;
+
+        mask |= c << 8;
+
+        for (i = 0; i < R_PC; i++)
+        {
+            if (mask & (1 << i))
+            {
+                if (get_delta (fp, &delta) != 0)
+                    return -1;
+
+                state->registers[i] += delta;
+            }
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,109 @@
+/*
+ * ARM emulator
+ * Luke Mitchell
+ *
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <zlib.h>
+
+/* Trace modes */
+#define TRACE_NONE      0
+#define TRACE_TEXT      1 // register dump and disassembly, to stdout
+#define TRACE_BINARY    2 // compact records, to a file
+
+/* Trace options */
+#define TRACE_ASYNC     0x01 // entries are written by a separate thread
+#define TRACE_DROP      0x02 // drop entries, rather than wait, when it falls behind
+#define TRACE_COMPRESS  0x04 // gzip the binary trace
+
+/* Condition filters */
+#define TRACE_COND_ANY  0
+#define TRACE_COND_PASS 1 // only instructions whose condition passes
+#define TRACE_COND_FAIL 2 // only instructions whose condition fails
+
+/* Bit for an INSTR_* type in a class mask, unknown instructions use bit 7 */
+#define TRACE_CLASS(type) (1 << ((type) & 7))
+
+/* Asynchronous writer */
+#define TRACE_RING_ENTRIES  (1 << 16)   // entries queued before backpressure
+#define TRACE_BATCH_BYTES   (1 << 16)   // binary trace written in batches of this size
+
+/* Kinds of queued entry */
+#define TRACE_ENTRY_STEP    0 // an instruction about to execute
+#define TRACE_ENTRY_SVC     1 // output from an SVC
+
+/* Binary trace format */
+#define TRACE_MAGIC     0x54554D45 // "EMUT"
+#define TRACE_VERSION   1
+
+/* Record tags */
+#define TRACE_TAG_PC    0x01 // PC follows, otherwise it is the previous PC + 4
+#define TRACE_TAG_FLAGS 0x02 // packed NZCV flags follow
+#define TRACE_TAG_REGS  0x04 // a mask of changed registers follows,
+                             // then a zig-zag varint delta for each
+
+// the header at the start of a binary trace
+// holds the state the first record is relative to
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t registers[16];
+    uint8_t flags[4];
+} trace_header;
+
+// the state rebuilt from a binary trace
+// a record is the state before an instruction executes, with
+// the PC pointing at the instruction
+typedef struct {
+    uint32_t registers[16];
+    uint8_t flags[4];
+    uint32_t instruction;
+} trace_state;
+
+// an entry queued for the writer thread
+typedef struct {
+    uint32_t registers[16];
+    uint32_t instruction;   // instruction word, or SVC number
+    uint8_t flags[4];
+    uint8_t kind;
+} trace_entry;
+
+// which instructions are traced
+// the PC range and classes are decided once, when a block is built,
+// and the condition and sampling as the block runs
+typedef struct {
+    uint32_t lo, hi;    // PC range, inclusive
+    uint8_t classes;    // mask of TRACE_CLASS bits
+    uint8_t cond;       // TRACE_COND_*
+    uint32_t sample;    // trace every Nth block, 0 traces all of them
+} trace_filter;
+
+extern trace_filter trace_filters;
+
+/* Bytes of binary trace records written, before compression,
+   updated by the writer thread */
+extern _Atomic uint64_t trace_bytes;
+
+// filtering
+int trace_filter_static (uint32_t pc, uint8_t type);
+int trace_parse_range (char* arg, trace_filter* filter);
+int trace_parse_classes (char* arg, trace_filter* filter);
+
+// writing
+int trace_open (int mode, char* path, int options, uint32_t r[], uint8_t f[]);
+void trace_record (uint32_t r[], uint8_t f[], uint32_t instr);
+int trace_svc (uint32_t r[], uint32_t operand);
+void trace_drain (void);
+void trace_flush (void);
+void trace_close (void);
+
+// reading
+int trace_read_header (gzFile fp, trace_state* state);
+int trace_read_record (gzFile fp, trace_state* state);
+
+#endif
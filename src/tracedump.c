@@ -0,0 +1,48 @@
+/*
+ * ARM emulator
+ * Luke Mitchell
+ *
+ */
+
+// emu-tracedump
+// renders a binary trace written by emu -trace-bin as the text
+// that emu -trace would have printed
+
+#include <stdint.h>
+#include <stdio.h>
+#include "io.h"
+#include "trace.h"
+
+int main (int argc, char** argv)
+{
+    gzFile fp;
+    trace_state state;
+
+    if (argc != 2)
+    {
+        printf ("Usage: %s trace.bin\n", argv[0]);
+        return 1;
+    }
+
+    // reads compressed and uncompressed traces alike
+    fp = gzopen (argv[1], "rb");
+
+    if (!fp)
+    {
+        fprintf (stderr, "The file %s was not found.\n", argv[1]);
+        return 1;
+    }
+
+    if (trace_read_header (fp, &state) != 0)
+    {
+        fprintf (stderr, "The file %s is not a trace.\n", argv[1]);
+        gzclose (fp);
+        return 1;
+    }
+
+    while (trace_read_record (fp, &state) == 0)
+        print_trace (state.registers, state.instruction);
+
+    gzclose (fp);
+    return 0;
+}